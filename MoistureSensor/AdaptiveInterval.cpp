@@ -0,0 +1,112 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <math.h>
+#include <string.h>
+#include "AdaptiveInterval.h"
+
+// 8 levels per doubling of the resistance
+const float LEVELS_PER_DOUBLING = 8.0f;
+// Dry means at least 4 times the wet resistance
+const uint8_t DRY_MARGIN_LEVELS = 16;
+// Flat means all values within about 9% of each other
+const uint8_t FLAT_LEVELS = 1;
+// Falling fast means the resistance halved over the history
+const uint8_t FALLING_LEVELS = 8;
+// The interval is kept in 16 bits
+const long MAX_INTERVAL_SECONDS = 0xFFFF;
+
+// The newest values go in front
+void AdaptiveInterval::addMeasurement(const float* rawValues) {
+  memmove(_history.levels[1], _history.levels[0], (HISTORY_SIZE - 1) * MAX_SENSORS);
+  for (int i = 0; i < _history.sensorCount; i++) {
+    _history.levels[0][i] = levelFor(_resistanceFor(rawValues[i]));
+  }
+  if (_history.count < HISTORY_SIZE) {
+    _history.count++;
+  }
+  long interval = _history.intervalSeconds;
+  if (isWetOrFalling()) {
+    interval = _baseSeconds;
+  } else if (isDryAndFlat()) {
+    interval *= 2;
+  } else {
+    interval = interval / 2 / _baseSeconds * _baseSeconds;
+  }
+  if (interval > _maxSeconds) {
+    interval = _maxSeconds;
+  } else if (interval < _baseSeconds) {
+    interval = _baseSeconds;
+  }
+  _history.intervalSeconds = interval;
+  // changes every measurement, so RTC memory only
+  _store->save(RECORD_INTERVAL_POLICY, &_history, sizeof(_history));
+}
+
+void AdaptiveInterval::begin(PersistentStore* store, int sensorCount, long baseSeconds, long maxSeconds, uint32_t wetResistanceOhm,
+  std::function<uint32_t(float)> resistanceFor) {
+  _store = store;
+  if (sensorCount > MAX_SENSORS) {
+    sensorCount = MAX_SENSORS;
+  }
+  _baseSeconds = baseSeconds;
+  if (maxSeconds > MAX_INTERVAL_SECONDS) {
+    maxSeconds = MAX_INTERVAL_SECONDS;
+  }
+  _maxSeconds = maxSeconds < baseSeconds ? baseSeconds : maxSeconds / baseSeconds * baseSeconds;
+  _wetLevel = levelFor(wetResistanceOhm);
+  _resistanceFor = resistanceFor;
+  if (!_store->load(RECORD_INTERVAL_POLICY, &_history, sizeof(_history)) || _history.sensorCount != sensorCount ||
+    _history.intervalSeconds < _baseSeconds || _history.intervalSeconds > _maxSeconds) {
+    memset(&_history, 0, sizeof(_history));
+    _history.sensorCount = sensorCount;
+    _history.intervalSeconds = _baseSeconds;
+  }
+}
+
+long AdaptiveInterval::intervalSeconds() {
+  return _history.intervalSeconds;
+}
+
+bool AdaptiveInterval::isDryAndFlat() {
+  if (_history.count < HISTORY_SIZE) {
+    return false;
+  }
+  for (int i = 0; i < _history.sensorCount; i++) {
+    uint8_t lowest = _history.levels[0][i];
+    uint8_t highest = lowest;
+    for (int entry = 1; entry < HISTORY_SIZE; entry++) {
+      uint8_t level = _history.levels[entry][i];
+      lowest = level < lowest ? level : lowest;
+      highest = level > highest ? level : highest;
+    }
+    if (lowest < _wetLevel + DRY_MARGIN_LEVELS || highest - lowest > FLAT_LEVELS) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool AdaptiveInterval::isWetOrFalling() {
+  int oldest = _history.count - 1;
+  for (int i = 0; i < _history.sensorCount; i++) {
+    uint8_t newest = _history.levels[0][i];
+    if (newest < _wetLevel || newest + FALLING_LEVELS <= _history.levels[oldest][i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t AdaptiveInterval::levelFor(uint32_t resistance) {
+  float level = LEVELS_PER_DOUBLING * log2f(resistance + 1.0f) + 0.5f;
+  return level > 255 ? 255 : static_cast<uint8_t>(level);
+}
@@ -0,0 +1,52 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class stretches the measurement interval while the walls stay dry, and tightens it as soon as they don't.
+// It keeps the last few resistances of each sensor in the persistent store, on a log scale in one byte each
+// (8 steps per doubling, so a step is about 9%). If all sensors are well above the wet boundary and flat over the
+// whole history, the interval doubles, up to the maximum. If a sensor is wet or its resistance halved over the
+// history, it goes straight back to the base interval. Anything in between halves it.
+// Intervals are always a multiple of the base interval, so the runs stay on the same grid.
+// The conversion from raw value to resistance comes from the caller, so the class itself has no hardware dependencies.
+
+#ifndef HEADER_ADAPTIVEINTERVAL
+#define HEADER_ADAPTIVEINTERVAL
+
+#include <functional>
+#include "IntervalPolicy.h"
+#include "PersistentStore.h"
+
+class AdaptiveInterval : public IntervalPolicy {
+public:
+    static const int MAX_SENSORS = 8;
+    void addMeasurement(const float* rawValues);
+    void begin(PersistentStore* store, int sensorCount, long baseSeconds, long maxSeconds, uint32_t wetResistanceOhm,
+        std::function<uint32_t(float)> resistanceFor);
+    long intervalSeconds() override;
+private:
+    static const int HISTORY_SIZE = 3;
+    struct History {
+        uint16_t intervalSeconds;
+        uint8_t count;
+        uint8_t sensorCount;
+        uint8_t levels[HISTORY_SIZE][MAX_SENSORS];
+    };
+    PersistentStore* _store;
+    History _history;
+    long _baseSeconds;
+    long _maxSeconds;
+    uint8_t _wetLevel;
+    std::function<uint32_t(float)> _resistanceFor;
+    bool isDryAndFlat();
+    bool isWetOrFalling();
+    static uint8_t levelFor(uint32_t resistance);
+};
+#endif
@@ -0,0 +1,87 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <string.h>
+#include "ChangeDetector.h"
+
+// Raw values are kept x10, like in MeasurementBuffer
+static uint16_t toStored(float rawValue) {
+  return static_cast<uint16_t>(rawValue * 10 + 0.5f);
+}
+
+void ChangeDetector::begin(PersistentStore* store, int sensorCount, uint32_t wetResistanceOhm, std::function<uint32_t(float)> resistanceFor) {
+  _store = store;
+  _sensorCount = sensorCount > MAX_SENSORS ? MAX_SENSORS : sensorCount;
+  _wetResistanceOhm = wetResistanceOhm;
+  _resistanceFor = resistanceFor;
+  if (!_store->load(RECORD_REPORTED, &_reported, sizeof(_reported))) {
+    _reported.timestamp = 0;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+      _reported.raw[i] = NO_VALUE;
+    }
+  }
+}
+
+bool ChangeDetector::crossedWetBoundary(const float* rawValues) {
+  for (int i = 0; i < _sensorCount; i++) {
+    if (_reported.raw[i] != NO_VALUE && isWet(_reported.raw[i] / 10.0f) != isWet(rawValues[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ChangeDetector::isChangeDetectionEnabled() {
+  return _changeDetection;
+}
+
+bool ChangeDetector::isReportDue(time_t timestamp, const float* rawValues) {
+  if (crossedWetBoundary(rawValues)) {
+    return true;
+  }
+  if (!_changeDetection) {
+    return false;
+  }
+  if (_reported.timestamp == 0 || timestamp - static_cast<time_t>(_reported.timestamp) >= static_cast<time_t>(_heartbeatSeconds)) {
+    return true;
+  }
+  for (int i = 0; i < _sensorCount; i++) {
+    if (_reported.raw[i] == NO_VALUE) {
+      return true;
+    }
+    uint32_t previous = _resistanceFor(_reported.raw[i] / 10.0f);
+    uint32_t current = _resistanceFor(rawValues[i]);
+    uint32_t difference = current > previous ? current - previous : previous - current;
+    if (static_cast<uint64_t>(difference) * 100 > static_cast<uint64_t>(previous) * _thresholdPercent) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ChangeDetector::isWet(float rawValue) {
+  return _resistanceFor(rawValue) < _wetResistanceOhm;
+}
+
+// Changes with every report, so RTC memory only
+void ChangeDetector::reported(time_t timestamp, const float* rawValues) {
+  _reported.timestamp = timestamp;
+  for (int i = 0; i < _sensorCount; i++) {
+    _reported.raw[i] = toStored(rawValues[i]);
+  }
+  _store->save(RECORD_REPORTED, &_reported, sizeof(_reported));
+}
+
+void ChangeDetector::setChangeDetection(bool enabled, uint8_t thresholdPercent, uint32_t heartbeatSeconds) {
+  _changeDetection = enabled;
+  _thresholdPercent = thresholdPercent;
+  _heartbeatSeconds = heartbeatSeconds;
+}
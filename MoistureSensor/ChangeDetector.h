@@ -0,0 +1,50 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class decides whether a measurement is worth switching on the radio for. It keeps the last reported raw value of
+// each sensor (and when that was) in the persistent store. Crossing the wet boundary since the last report always counts.
+// With change detection on, a resistance that moved more than the threshold (relative to the last report) also counts,
+// and so does the heartbeat interval passing. That way most wakes can skip the radio while the walls stay dry.
+// The conversion from raw value to resistance comes from the caller, so the class itself has no hardware dependencies.
+
+#ifndef HEADER_CHANGEDETECTOR
+#define HEADER_CHANGEDETECTOR
+
+#include <functional>
+#include <time.h>
+#include "PersistentStore.h"
+
+class ChangeDetector {
+public:
+    static const int MAX_SENSORS = 8;
+    void begin(PersistentStore* store, int sensorCount, uint32_t wetResistanceOhm, std::function<uint32_t(float)> resistanceFor);
+    bool crossedWetBoundary(const float* rawValues);
+    bool isChangeDetectionEnabled();
+    bool isReportDue(time_t timestamp, const float* rawValues);
+    void reported(time_t timestamp, const float* rawValues);
+    void setChangeDetection(bool enabled, uint8_t thresholdPercent, uint32_t heartbeatSeconds);
+private:
+    static const uint16_t NO_VALUE = 0xFFFF;
+    struct Reported {
+        uint32_t timestamp;
+        uint16_t raw[MAX_SENSORS];
+    };
+    PersistentStore* _store;
+    Reported _reported;
+    int _sensorCount;
+    uint32_t _wetResistanceOhm;
+    std::function<uint32_t(float)> _resistanceFor;
+    bool _changeDetection = false;
+    uint8_t _thresholdPercent = 0;
+    uint32_t _heartbeatSeconds = 0;
+    bool isWet(float rawValue);
+};
+#endif
@@ -0,0 +1,107 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <math.h>
+#include "DriftEstimator.h"
+
+// Starting points, empirically determined on the first devices
+const float DEFAULT_CORRECTION_FACTOR = 1.062f;
+const float DEFAULT_UNCERTAINTY = 0.01f;
+const float DEFAULT_STARTUP_SECONDS = 15.0f;
+
+// Never trust the estimate more than this
+const float MIN_UNCERTAINTY = 0.002f;
+// Short sleeps are dominated by the boot time and the clock resolution
+const double MIN_SAMPLE_SECONDS = 60.0;
+// Samples that deviate more than this from the estimate are considered glitches (e.g. a bad NTP response)
+const double MAX_SAMPLE_DEVIATION = 0.15;
+const uint16_t SAMPLES_BEFORE_REJECTING = 3;
+// Exponential averaging: the first samples get averaged evenly, after that we use this weight
+const float MIN_WEIGHT = 0.2f;
+const float MIN_STARTUP_SECONDS = 1.0f;
+const float MAX_STARTUP_SECONDS = 40.0f;
+
+DriftEstimator::DriftEstimator() {
+  _state.correctionFactor = DEFAULT_CORRECTION_FACTOR;
+  _state.uncertainty = DEFAULT_UNCERTAINTY;
+  _state.startupSeconds = DEFAULT_STARTUP_SECONDS;
+  _state.sleepSamples = 0;
+  _state.startupSamples = 0;
+}
+
+// requestedSeconds is what we asked deepSleep for, actualSeconds is how long the sleep really took.
+bool DriftEstimator::addSleepSample(double requestedSeconds, double actualSeconds) {
+  if (requestedSeconds < MIN_SAMPLE_SECONDS || actualSeconds <= 0) {
+    return false;
+  }
+  double sample = requestedSeconds / actualSeconds;
+  double deviation = fabs(sample - _state.correctionFactor) / _state.correctionFactor;
+  if (_state.sleepSamples >= SAMPLES_BEFORE_REJECTING && deviation > MAX_SAMPLE_DEVIATION) {
+    return false;
+  }
+  float weight = weightFor(_state.sleepSamples);
+  // the first sample says nothing about the spread
+  if (_state.sleepSamples > 0) {
+    _state.uncertainty += weight * (deviation - _state.uncertainty);
+    if (_state.uncertainty < MIN_UNCERTAINTY) {
+      _state.uncertainty = MIN_UNCERTAINTY;
+    }
+  }
+  _state.correctionFactor += weight * (sample - _state.correctionFactor);
+  if (_state.sleepSamples < UINT16_MAX) {
+    _state.sleepSamples++;
+  }
+  return true;
+}
+
+void DriftEstimator::addStartupSample(double startupSeconds) {
+  if (startupSeconds < MIN_STARTUP_SECONDS) {
+    startupSeconds = MIN_STARTUP_SECONDS;
+  } else if (startupSeconds > MAX_STARTUP_SECONDS) {
+    startupSeconds = MAX_STARTUP_SECONDS;
+  }
+  _state.startupSeconds += weightFor(_state.startupSamples) * (startupSeconds - _state.startupSeconds);
+  if (_state.startupSamples < UINT16_MAX) {
+    _state.startupSamples++;
+  }
+}
+
+float DriftEstimator::correctionFactor() {
+  return _state.correctionFactor;
+}
+
+uint64_t DriftEstimator::requestedMicrosFor(double realSeconds) {
+  if (realSeconds <= 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(realSeconds * _state.correctionFactor * 1e6);
+}
+
+void DriftEstimator::setState(const State& state) {
+  _state = state;
+}
+
+float DriftEstimator::startupSeconds() {
+  return _state.startupSeconds;
+}
+
+const DriftEstimator::State& DriftEstimator::state() {
+  return _state;
+}
+
+float DriftEstimator::uncertainty() {
+  return _state.uncertainty;
+}
+
+float DriftEstimator::weightFor(uint16_t samples) {
+  float weight = 1.0f / (samples + 1);
+  return weight < MIN_WEIGHT ? MIN_WEIGHT : weight;
+}
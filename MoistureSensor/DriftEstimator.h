@@ -0,0 +1,45 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// The deep sleep timer of the ESP8266 is not accurate, and the error differs per device. This class learns
+// the correction factor (requested sleep time per real second) and the time the device needs from waking up
+// until it is ready to measure. It only does arithmetic on the values it gets, so it has no hardware dependencies.
+// The scheduler feeds it the sleep time it requested and the real time that passed according to NTP.
+
+#ifndef HEADER_DRIFTESTIMATOR
+#define HEADER_DRIFTESTIMATOR
+
+#include <stdint.h>
+
+class DriftEstimator {
+public:
+    struct State {
+        float correctionFactor;
+        float uncertainty;
+        float startupSeconds;
+        uint16_t sleepSamples;
+        uint16_t startupSamples;
+    };
+
+    DriftEstimator();
+    bool addSleepSample(double requestedSeconds, double actualSeconds);
+    void addStartupSample(double startupSeconds);
+    float correctionFactor();
+    uint64_t requestedMicrosFor(double realSeconds);
+    void setState(const State& state);
+    float startupSeconds();
+    const State& state();
+    float uncertainty();
+private:
+    State _state;
+    static float weightFor(uint16_t samples);
+};
+#endif
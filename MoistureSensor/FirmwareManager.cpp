@@ -9,23 +9,97 @@
 //    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //    See the License for the specific language governing permissions and limitations under the License.
 
+#include <functional>
 #include <ESP.h>
 #include <ESP8266HTTPClient.h>
 #include <ESP8266httpUpdate.h>
 #include <WiFiClient.h>
+#include <Updater.h>
+
+#include "FirmwareManager.h"
+#include "PatchApplier.h"
 
-#include "FirmwareManager.h" 
 
 const char* VERSION_EXTENSION = ".version";
 const char* IMAGE_EXTENSION = ".bin";
+const char* PATCH_EXTENSION = ".patch";
+const char* ETAG_HEADER = "ETag";
+// Without an MQTT announcement, only fetch the version file every so many checks (i.e. wakes with the radio on)
+const int CHECK_INTERVAL_WAKES = 24;
+
+// Passes what HTTPClient downloads on to the patch applier, until the time is up
+class PatchStream : public Stream {
+public:
+  PatchStream(PatchApplier* applier, std::function<bool(void)> isOverTime) : _applier(applier), _isOverTime(isOverTime) {}
+  size_t write(uint8_t value) override { return write(&value, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override { 
+    return !_isOverTime() && _applier->write(buffer, size) ? size : 0; 
+  }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+private:
+  PatchApplier* _applier;
+  std::function<bool(void)> _isOverTime;
+};
+
+int FirmwareManager::availableVersion() {
+  return _announcedVersion > 0 ? _announcedVersion : _state.availableVersion;
+}
 
-void FirmwareManager::begin(WiFiClient* client, const char* baseUrl, const char* machineId) {
+void FirmwareManager::begin(WiFiClient* client, PersistentStore* store, const char* baseUrl, const char* machineId) {
   _client = client;
+  _store = store;
   strcpy(_baseUrl, baseUrl);
   strcat(_baseUrl, machineId);
+  if (!_store->load(RECORD_FIRMWARE, &_state, sizeof(_state))) {
+    memset(&_state, 0, sizeof(_state));
+    // check right away
+    _state.wakesSinceCheck = CHECK_INTERVAL_WAKES;
+  }
+}
+
+bool FirmwareManager::isOverTime() {
+  return _timeLimitMillis > 0 && millis() - _startMillis >= _timeLimitMillis;
+}
+
+// HTTPClient takes 16 bit timeouts
+unsigned long FirmwareManager::remainingMillis() {
+  if (_timeLimitMillis == 0) {
+    return UINT16_MAX;
+  }
+  unsigned long elapsedMillis = millis() - _startMillis;
+  unsigned long remaining = elapsedMillis < _timeLimitMillis ? _timeLimitMillis - elapsedMillis : 1;
+  return remaining < UINT16_MAX ? remaining : UINT16_MAX;
+}
+
+// The version as published on MQTT. It takes precedence over the version file.
+void FirmwareManager::setAnnouncedVersion(int version) {
+  Serial.printf("Announced firmware version: %d\n", version);
+  _announcedVersion = version;
+}
+
+// Starts counting now. 0 means no limit.
+void FirmwareManager::setTimeLimit(unsigned long timeLimitMillis) {
+  _startMillis = millis();
+  _timeLimitMillis = timeLimitMillis;
+}
+
+// Changes every wake, and losing it only costs an extra check, so RTC memory only.
+void FirmwareManager::saveState() {
+  _store->save(RECORD_FIRMWARE, &_state, sizeof(_state));
 }
 
 bool FirmwareManager::updateAvailableFor(int currentVersion) {
+  if (_announcedVersion > 0) {
+    Serial.printf("Current firmware version: %d; announced version: %d\n", currentVersion, _announcedVersion);
+    return _announcedVersion > currentVersion;
+  }
+  if (_state.wakesSinceCheck < CHECK_INTERVAL_WAKES) {
+    _state.wakesSinceCheck++;
+    saveState();
+    return _state.availableVersion > currentVersion;
+  }
   char versionUrl[BASE_URL_SIZE];
   strcpy(versionUrl, _baseUrl);
   strcat(versionUrl, VERSION_EXTENSION);
@@ -33,25 +107,55 @@ bool FirmwareManager::updateAvailableFor(int currentVersion) {
 
   HTTPClient httpClient;
   httpClient.begin(*_client, versionUrl);
-  bool returnValue = false;
+  httpClient.setTimeout(remainingMillis());
+  const char* headerKeys[] = { ETAG_HEADER };
+  httpClient.collectHeaders(headerKeys, 1);
+  if (_state.etag[0] != 0) {
+    httpClient.addHeader("If-None-Match", _state.etag);
+  }
   int httpCode = httpClient.GET();
-  if (httpCode == 200) {
-    int newVersion = httpClient.getString().toInt();
-    Serial.printf("Current firmware version: %d; available version: %d\n", currentVersion, newVersion);
-    returnValue = newVersion > currentVersion;
+  if (httpCode == HTTP_CODE_OK) {
+    _state.availableVersion = httpClient.getString().toInt();
+    String etag = httpClient.header(ETAG_HEADER);
+    // if it doesn't fit, we can't use it
+    if (etag.length() < ETAG_SIZE) {
+      strcpy(_state.etag, etag.c_str());
+    } else {
+      _state.etag[0] = 0;
+    }
+    _state.wakesSinceCheck = 0;
+  } else if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+    Serial.println("Firmware version file not modified");
+    _state.wakesSinceCheck = 0;
   } else {
     Serial.printf("Firmware version check failed with response code %d\n", httpCode);
   }
   httpClient.end();
-  return returnValue;
+  saveState();
+  Serial.printf("Current firmware version: %d; available version: %d\n", currentVersion, _state.availableVersion);
+  return _state.availableVersion > currentVersion;
 }
 
-void FirmwareManager::update() {
+void FirmwareManager::update(int currentVersion) {
   Serial.println("Updating firmware");
+  if (updateFromPatch(currentVersion, availableVersion())) {
+    return;
+  }
+  if (isOverTime()) {
+    Serial.println("No time left for the firmware image");
+    return;
+  }
   char imageUrl[BASE_URL_SIZE];
   strcpy(imageUrl, _baseUrl);
   strcat(imageUrl, IMAGE_EXTENSION);
 
+  ESPhttpUpdate.setClientTimeout(remainingMillis());
+  // closing the connection makes the update fail, and an incomplete image doesn't get used
+  ESPhttpUpdate.onProgress([this](int, int) {
+    if (isOverTime()) {
+      _client->stop();
+    }
+  });
   t_httpUpdate_return returnValue = ESPhttpUpdate.update(*_client, imageUrl);
 
   switch(returnValue) {
@@ -65,9 +169,54 @@ void FirmwareManager::update() {
   }
 }
 
+// Rebuilds the new image in the OTA partition from the running image and the patch. Reboots if that worked.
+// The running image starts at the beginning of the flash, so we can read it from there.
+bool FirmwareManager::updateFromPatch(int currentVersion, int newVersion) {
+  char patchUrl[BASE_URL_SIZE + 30];
+  snprintf(patchUrl, sizeof(patchUrl), "%s.%d-%d%s", _baseUrl, currentVersion, newVersion, PATCH_EXTENSION);
+  Serial.printf("Firmware patch URL: %s\n", patchUrl);
+  HTTPClient httpClient;
+  httpClient.begin(*_client, patchUrl);
+  httpClient.setTimeout(remainingMillis());
+  int httpCode = httpClient.GET();
+  if (httpCode != HTTP_CODE_OK) {
+    Serial.printf("No firmware patch (response code %d)\n", httpCode);
+    httpClient.end();
+    return false;
+  }
+  PatchApplier applier;
+  applier.begin(
+    [](uint32_t offset, uint8_t* data, size_t size) { return ESP.flashRead(offset, data, size); },
+    ESP.getSketchSize(),
+    [&applier](const uint8_t* data, size_t size) {
+      // the size of the new image is known once the header is in
+      if (!Update.isRunning() && !Update.begin(applier.targetSize())) {
+        return false;
+      }
+      return Update.write(const_cast<uint8_t*>(data), size) == size;
+    });
+  PatchStream patchStream(&applier, [this]() { return isOverTime(); });
+  httpClient.writeToStream(&patchStream);
+  httpClient.end();
+  if (applier.isComplete() && Update.end()) {
+    Serial.println("Firmware patched. Rebooting...");
+    ESP.restart();
+  }
+  if (applier.isComplete()) {
+    Serial.printf("Firmware patch failed: %s\n", Update.getErrorString().c_str());
+  } else {
+    Serial.printf("Firmware patch failed: %s\n", applier.error() != nullptr ? applier.error() : "incomplete download");
+  }
+  // the image is incomplete, so this discards it
+  if (Update.isRunning()) {
+    Update.end();
+  }
+  return false;
+}
+
 void FirmwareManager::tryUpdateFrom(int currentVersion) {
     if (updateAvailableFor(currentVersion)) {
-    update();
+    update(currentVersion);
   } else {
     Serial.println("No updates available");
   }
@@ -14,21 +14,47 @@
 // It looks for a specified url: https://base-url/path/device-name.version which contains available build version.
 // If that number is higher than the build of the device, it updates itself from https://base-url/path/device-name.bin
 // I got the inspiration for this mechanism from https://www.bakke.online/index.php/2017/06/02/self-updating-ota-firmware-for-esp8266/
+// Releases are rare, so we try to avoid the HTTPS request. If the available version was published on a (retained) MQTT topic,
+// we use that. Otherwise we only check every so many wakes, with a conditional request (If-None-Match) using the ETag
+// of the last response. Either way we only connect to the HTTP server for real if an update is pending.
+// Before downloading the whole image, it tries https://base-url/path/device-name.<current>-<available>.patch.
+// If that exists, the new image gets rebuilt from the running one and the patch (see PatchApplier), which is a much
+// smaller download. If there is no patch, or anything goes wrong with it, it falls back to the full image.
+// All of that stops at the time limit: a download that runs over gets aborted, so the new image doesn't get used.
 
 #ifndef HEADER_FIRMWAREMANAGER
 #define HEADER_FIRMWAREMANAGER
 
 #include <WiFiClient.h>
+#include "PersistentStore.h"
 
 class FirmwareManager {
 public:
-  void begin(WiFiClient* client, const char* baseUrl, const char* machineId);
+  void begin(WiFiClient* client, PersistentStore* store, const char* baseUrl, const char* machineId);
+  void setAnnouncedVersion(int version);
+  void setTimeLimit(unsigned long timeLimitMillis);
   bool updateAvailableFor(int currentVersion);
-  void update();
+  void update(int currentVersion);
   void tryUpdateFrom(int currentVersion);  
 private:
   static const int BASE_URL_SIZE = 100;
+  static const int ETAG_SIZE = 24;
+  struct CheckState {
+    int32_t availableVersion;
+    uint16_t wakesSinceCheck;
+    char etag[ETAG_SIZE];
+  };
   WiFiClient* _client;
+  PersistentStore* _store;
+  CheckState _state;
+  int _announcedVersion = 0;
+  unsigned long _startMillis = 0;
+  unsigned long _timeLimitMillis = 0;
   char _baseUrl[BASE_URL_SIZE];
+  int availableVersion();
+  bool isOverTime();
+  unsigned long remainingMillis();
+  void saveState();
+  bool updateFromPatch(int currentVersion, int newVersion);
 };
 #endif
@@ -0,0 +1,178 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <ESP.h>
+#include <FS.h>
+#include "FlashLog.h"
+
+const char* OLDEST_SEGMENT = "/log.old";
+const char* NEWEST_SEGMENT = "/log.new";
+const char* POSITION_FILE = "/log.pos";
+// Two segments of this size make about 24 kB, or 5 days of measurements every 15 minutes
+const size_t SEGMENT_ENTRIES = 512;
+
+static size_t entriesIn(const char* fileName) {
+  if (!SPIFFS.exists(fileName)) {
+    return 0;
+  }
+  File file = SPIFFS.open(fileName, "r");
+  size_t entries = file.size() / sizeof(FlashLog::Entry);
+  file.close();
+  return entries;
+}
+
+bool FlashLog::append(time_t timestamp, const float* rawValues, int sensorCount) {
+  if (!mount()) {
+    return false;
+  }
+  if (entriesIn(NEWEST_SEGMENT) >= SEGMENT_ENTRIES) {
+    rotate();
+  }
+  Entry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.timestamp = timestamp;
+  entry.sensorCount = sensorCount > MAX_SENSORS ? MAX_SENSORS : sensorCount;
+  for (int i = 0; i < entry.sensorCount; i++) {
+    entry.raw[i] = static_cast<uint16_t>(rawValues[i] * 10 + 0.5f);
+  }
+  File file = SPIFFS.open(NEWEST_SEGMENT, "a");
+  if (!file) {
+    Serial.println("Could not open the log");
+    return false;
+  }
+  bool success = file.write(reinterpret_cast<const uint8_t*>(&entry), sizeof(entry)) == sizeof(entry);
+  file.close();
+  updatePending();
+  return success;
+}
+
+void FlashLog::begin(PersistentStore* store) {
+  _store = store;
+  // after a power loss we need to look at the files
+  if (!_store->load(RECORD_LOG, &_state, sizeof(_state))) {
+    _state.pendingEntries = UNKNOWN;
+  }
+}
+
+uint32_t FlashLog::loadPosition() {
+  uint32_t position = 0;
+  File file = SPIFFS.open(POSITION_FILE, "r");
+  if (file) {
+    if (file.read(reinterpret_cast<uint8_t*>(&position), sizeof(position)) != sizeof(position)) {
+      position = 0;
+    }
+    file.close();
+  }
+  return position;
+}
+
+bool FlashLog::mount() {
+  if (!_mounted) {
+    _mounted = SPIFFS.begin();
+    if (!_mounted) {
+      Serial.println("Could not mount SPIFFS");
+    }
+  }
+  return _mounted;
+}
+
+uint16_t FlashLog::pendingEntries() {
+  if (_state.pendingEntries == UNKNOWN) {
+    if (!mount()) {
+      return 0;
+    }
+    updatePending();
+  }
+  return _state.pendingEntries;
+}
+
+// Publishes at most maxEntries, oldest first, in parts of REPLAY_PART_SIZE. Stops at the first part that fails.
+// Returns the number of entries published.
+int FlashLog::replay(int maxEntries, std::function<bool(const Entry* entries, int count)> publish) {
+  if (pendingEntries() == 0 || !mount()) {
+    return 0;
+  }
+  Entry entries[REPLAY_PART_SIZE];
+  int replayed = 0;
+  while (replayed < maxEntries) {
+    if (!SPIFFS.exists(OLDEST_SEGMENT)) {
+      if (!SPIFFS.exists(NEWEST_SEGMENT)) {
+        break;
+      }
+      if (!SPIFFS.rename(NEWEST_SEGMENT, OLDEST_SEGMENT)) {
+        Serial.println("Could not rotate the log");
+        break;
+      }
+      savePosition(0);
+    }
+    uint32_t position = loadPosition();
+    if (position >= entriesIn(OLDEST_SEGMENT)) {
+      // this segment is done. If we can't remove it, we would keep coming back here.
+      if (!SPIFFS.remove(OLDEST_SEGMENT)) {
+        Serial.println("Could not remove the replayed log segment");
+        break;
+      }
+      continue;
+    }
+    File file = SPIFFS.open(OLDEST_SEGMENT, "r");
+    int wanted = maxEntries - replayed < REPLAY_PART_SIZE ? maxEntries - replayed : REPLAY_PART_SIZE;
+    int count = 0;
+    if (file && file.seek(position * sizeof(Entry))) {
+      count = file.read(reinterpret_cast<uint8_t*>(entries), wanted * sizeof(Entry)) / sizeof(Entry);
+    }
+    if (file) {
+      file.close();
+    }
+    if (count == 0) {
+      // the entries are still there, so try again on a later wake
+      Serial.println("Could not read the log");
+      break;
+    }
+    if (!publish(entries, count)) {
+      break;
+    }
+    savePosition(position + count);
+    replayed += count;
+  }
+  updatePending();
+  if (_state.pendingEntries == 0) {
+    SPIFFS.remove(OLDEST_SEGMENT);
+    SPIFFS.remove(POSITION_FILE);
+  }
+  return replayed;
+}
+
+// Drops the oldest segment, replayed or not, to make room
+void FlashLog::rotate() {
+  if (SPIFFS.exists(OLDEST_SEGMENT) && loadPosition() < entriesIn(OLDEST_SEGMENT)) {
+    Serial.println("Log full, dropping the oldest entries");
+  }
+  SPIFFS.remove(OLDEST_SEGMENT);
+  SPIFFS.rename(NEWEST_SEGMENT, OLDEST_SEGMENT);
+  savePosition(0);
+}
+
+void FlashLog::savePosition(uint32_t position) {
+  File file = SPIFFS.open(POSITION_FILE, "w");
+  if (file) {
+    file.write(reinterpret_cast<const uint8_t*>(&position), sizeof(position));
+    file.close();
+  }
+}
+
+// Changes with every append and replay, which write flash anyway. The count itself goes to RTC memory only.
+void FlashLog::updatePending() {
+  size_t oldest = entriesIn(OLDEST_SEGMENT);
+  uint32_t position = loadPosition();
+  size_t pending = (oldest > position ? oldest - position : 0) + entriesIn(NEWEST_SEGMENT);
+  _state.pendingEntries = pending < UNKNOWN ? pending : UNKNOWN - 1;
+  _store->save(RECORD_LOG, &_state, sizeof(_state));
+}
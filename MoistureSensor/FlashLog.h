@@ -0,0 +1,56 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class keeps measurements that could not be published in an append-only log on SPIFFS, which spreads the
+// writes over the flash. It is only used when publishing fails (or the RTC buffer overflows while the radio is down),
+// and when the backlog gets replayed. The number of pending entries is kept in the persistent store, so other wakes
+// don't need to mount the file system.
+// The log has two segments of fixed size entries. New entries go to the newest. If that is full, the oldest segment
+// gets dropped (if it wasn't replayed by then) and the newest becomes the oldest. Replaying goes oldest first with
+// the original timestamps, in parts. The replay position is saved in flash after each part that got published,
+// so an interrupted replay (even by a power loss) continues where it stopped, and nothing gets sent twice.
+
+#ifndef HEADER_FLASHLOG
+#define HEADER_FLASHLOG
+
+#include <functional>
+#include <time.h>
+#include "PersistentStore.h"
+
+class FlashLog {
+public:
+    static const int MAX_SENSORS = 8;
+    static const int REPLAY_PART_SIZE = 8;
+    struct Entry {
+        uint32_t timestamp;
+        uint8_t sensorCount;
+        // raw values x10, like in MeasurementBuffer
+        uint16_t raw[MAX_SENSORS];
+    };
+    bool append(time_t timestamp, const float* rawValues, int sensorCount);
+    void begin(PersistentStore* store);
+    uint16_t pendingEntries();
+    int replay(int maxEntries, std::function<bool(const Entry* entries, int count)> publish);
+private:
+    static const uint16_t UNKNOWN = 0xFFFF;
+    struct State {
+        uint16_t pendingEntries;
+    };
+    PersistentStore* _store;
+    State _state;
+    bool _mounted = false;
+    uint32_t loadPosition();
+    bool mount();
+    void rotate();
+    void savePosition(uint32_t position);
+    void updatePending();
+};
+#endif
@@ -0,0 +1,61 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <ESP.h>
+#include <FS.h>
+#include "FlashStorage.h"
+
+const size_t FLASH_IMAGE_SIZE = 512;
+
+FlashStorage::FlashStorage(const char* fileName) {
+  _fileName = fileName;
+}
+
+size_t FlashStorage::capacity() {
+  return FLASH_IMAGE_SIZE;
+}
+
+bool FlashStorage::mount() {
+  if (!_mounted) {
+    _mounted = SPIFFS.begin();
+    if (!_mounted) {
+      Serial.println("Could not mount SPIFFS");
+    }
+  }
+  return _mounted;
+}
+
+bool FlashStorage::read(uint32_t* data, size_t size) {
+  if (!mount()) {
+    return false;
+  }
+  File file = SPIFFS.open(_fileName, "r");
+  if (!file) {
+    return false;
+  }
+  size_t bytesRead = file.read(reinterpret_cast<uint8_t*>(data), size);
+  file.close();
+  return bytesRead == size;
+}
+
+bool FlashStorage::write(const uint32_t* data, size_t size) {
+  if (!mount()) {
+    return false;
+  }
+  File file = SPIFFS.open(_fileName, "w");
+  if (!file) {
+    Serial.printf("open file '%s' failed\n", _fileName);
+    return false;
+  }
+  size_t bytesWritten = file.write(reinterpret_cast<const uint8_t*>(data), size);
+  file.close();
+  return bytesWritten == size;
+}
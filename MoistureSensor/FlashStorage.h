@@ -0,0 +1,31 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Storage backend on a SPIFFS file. SPIFFS is only mounted on first use, so wakes that don't touch flash
+// don't pay for mounting it.
+
+#ifndef HEADER_FLASHSTORAGE
+#define HEADER_FLASHSTORAGE
+
+#include "Storage.h"
+
+class FlashStorage : public Storage {
+public:
+    explicit FlashStorage(const char* fileName);
+    size_t capacity() override;
+    bool read(uint32_t* data, size_t size) override;
+    bool write(const uint32_t* data, size_t size) override;
+private:
+    const char* _fileName;
+    bool _mounted = false;
+    bool mount();
+};
+#endif
@@ -0,0 +1,24 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Interface for the way Scheduler chooses the time between runs. Without a policy, Scheduler uses the fixed
+// interval it got in begin(). AdaptiveInterval implements it based on the moisture trend.
+
+#ifndef HEADER_INTERVALPOLICY
+#define HEADER_INTERVALPOLICY
+
+class IntervalPolicy {
+public:
+    virtual ~IntervalPolicy() {}
+    // the time from the current run to the next one
+    virtual long intervalSeconds() = 0;
+};
+#endif
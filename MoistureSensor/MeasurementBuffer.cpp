@@ -0,0 +1,115 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <string.h>
+#include "MeasurementBuffer.h"
+
+const uint32_t MAX_OFFSET_SECONDS = 0xFFFF;
+
+static uint16_t toStored(float rawValue) {
+  return static_cast<uint16_t>(rawValue * 10 + 0.5f);
+}
+
+void MeasurementBuffer::add(time_t timestamp, const float* rawValues) {
+  if (_contents.count == 0) {
+    _contents.baseTimestamp = timestamp;
+  }
+  // the offset must fit in 16 bits, and the timestamps must be increasing
+  while (_contents.count > 0 &&
+    (_contents.count >= capacity() || timestamp < _contents.baseTimestamp || timestamp - _contents.baseTimestamp > MAX_OFFSET_SECONDS)) {
+    dropOldest();
+  }
+  if (_contents.count == 0) {
+    _contents.baseTimestamp = timestamp;
+  }
+  uint8_t* current = entry(_contents.count);
+  uint16_t offset = timestamp - _contents.baseTimestamp;
+  memcpy(current, &offset, sizeof(offset));
+  for (int i = 0; i < _contents.sensorCount; i++) {
+    uint16_t value = toStored(rawValues[i]);
+    memcpy(current + sizeof(offset) + i * sizeof(value), &value, sizeof(value));
+  }
+  _contents.count++;
+  save();
+}
+
+void MeasurementBuffer::begin(PersistentStore* store, int sensorCount) {
+  _store = store;
+  if (sensorCount > MAX_SENSORS) {
+    sensorCount = MAX_SENSORS;
+  }
+  if (!_store->load(RECORD_MEASUREMENTS, &_contents, sizeof(_contents)) || _contents.sensorCount != sensorCount) {
+    memset(&_contents, 0, sizeof(_contents));
+    _contents.sensorCount = sensorCount;
+  }
+}
+
+int MeasurementBuffer::capacity() {
+  return DATA_SIZE / entrySize();
+}
+
+// The number of entries that fit, e.g. to check a batch size before the buffer exists
+int MeasurementBuffer::capacityFor(int sensorCount) {
+  return DATA_SIZE / (sizeof(uint16_t) * (sensorCount + 1));
+}
+
+void MeasurementBuffer::clear() {
+  _contents.count = 0;
+  save();
+}
+
+int MeasurementBuffer::count() {
+  return _contents.count;
+}
+
+void MeasurementBuffer::dropOldest() {
+  uint8_t* next = entry(1);
+  uint16_t shift;
+  memcpy(&shift, next, sizeof(shift));
+  memmove(entry(0), next, (_contents.count - 1) * entrySize());
+  _contents.count--;
+  _contents.baseTimestamp += shift;
+  for (int i = 0; i < _contents.count; i++) {
+    uint16_t offset;
+    memcpy(&offset, entry(i), sizeof(offset));
+    offset -= shift;
+    memcpy(entry(i), &offset, sizeof(offset));
+  }
+}
+
+uint8_t* MeasurementBuffer::entry(int index) {
+  return _contents.data + index * entrySize();
+}
+
+int MeasurementBuffer::entrySize() {
+  return sizeof(uint16_t) * (_contents.sensorCount + 1);
+}
+
+bool MeasurementBuffer::get(int index, time_t* timestamp, float* rawValues) {
+  if (index < 0 || index >= _contents.count) {
+    return false;
+  }
+  uint8_t* current = entry(index);
+  uint16_t offset;
+  memcpy(&offset, current, sizeof(offset));
+  *timestamp = _contents.baseTimestamp + offset;
+  for (int i = 0; i < _contents.sensorCount; i++) {
+    uint16_t value;
+    memcpy(&value, current + sizeof(offset) + i * sizeof(value), sizeof(value));
+    rawValues[i] = value / 10.0f;
+  }
+  return true;
+}
+
+// Changes every measurement, so RTC memory only
+void MeasurementBuffer::save() {
+  _store->save(RECORD_MEASUREMENTS, &_contents, sizeof(_contents));
+}
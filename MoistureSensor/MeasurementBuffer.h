@@ -0,0 +1,48 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class collects measurements in the persistent store (i.e. RTC memory) on wakes without the radio, so they can be
+// published in one go on the next wake with the radio on. Entries are compact: a 16 bit time offset in seconds
+// relative to the first entry, followed by the raw pin value (x10) of each sensor. If the buffer is full, the oldest
+// entry is dropped.
+
+#ifndef HEADER_MEASUREMENTBUFFER
+#define HEADER_MEASUREMENTBUFFER
+
+#include <time.h>
+#include "PersistentStore.h"
+
+class MeasurementBuffer {
+public:
+    static const int MAX_SENSORS = 8;
+    void add(time_t timestamp, const float* rawValues);
+    void begin(PersistentStore* store, int sensorCount);
+    int capacity();
+    static int capacityFor(int sensorCount);
+    void clear();
+    int count();
+    bool get(int index, time_t* timestamp, float* rawValues);
+private:
+    static const int DATA_SIZE = 72;
+    struct Contents {
+        uint32_t baseTimestamp;
+        uint8_t count;
+        uint8_t sensorCount;
+        uint8_t data[DATA_SIZE];
+    };
+    PersistentStore* _store;
+    Contents _contents;
+    int entrySize();
+    uint8_t* entry(int index);
+    void dropOldest();
+    void save();
+};
+#endif
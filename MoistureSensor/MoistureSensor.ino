@@ -17,6 +17,18 @@
 // For a description of the circuit see SensorManager.h
 
 // After the measurement, it sends the results over MQTT and goes into deep sleep until the next measurement.
+// To save power, the radio is only switched on every BATCH_SIZE measurements. In between, the measurements are kept in 
+// RTC memory and they get published as a batch on the next wake with the radio on. If a sensor crosses the wet boundary,
+// the device restarts with the radio on to report right away.
+// If the radio can't connect, the device doesn't reboot but goes on measuring, and tries again after exponentially
+// more wakes. Measurements that could not be published go to a log in flash, and the next wakes with a connection
+// publish that backlog in parts, with the original timestamps (see FlashLog.h).
+// With REPORT_ON_CHANGE, the radio doesn't get switched on for a batch, but only if a resistance changed enough,
+// or the heartbeat interval passed (or if the clock needs an NTP sync). The NTP sync then goes along with the reports, and
+// only needs a wake of its own if there was no report for a heartbeat interval (or if the clock error gets too large).
+// On wakes with the radio on, measuring starts right away and runs while WiFi connects, so it doesn't add to the
+// time the radio is on.
+// Most settings can be changed for the whole fleet with a retained MQTT message, see RemoteConfig.h.
 // Also connect D0 (GPIO16/WAKE) to Reset (RST) to enable wake up from deep sleep (remove while uploading).
 // This implies you cannot use LED_BUILTIN_AUX as that's D0 too - switching it on (LOW) would reset the device.
 
@@ -48,29 +60,96 @@
 //   -----END PRIVATE KEY-----
 //   )certkey";
 //   #endif
+// The certificates and the key can also be DER byte arrays (e.g. from xxd -i), which skips the base64 decoding:
+//   static const uint8_t CONFIG_ROOTCA_CERTIFICATE[] PROGMEM = { 0x30, 0x82, ... };
+// The device key can be RSA or EC (P-256). EC makes the TLS handshake a lot faster. With an EC key, BearSSL also needs
+// the key type of the CA that signed the device certificate (not necessarily the root CA). secrets.h comes first, so it
+// needs to include the header with the constants:
+//   #include <WiFiClientSecure.h>
+//   static const unsigned CONFIG_DEVICE_CERTIFICATE_ISSUER_KEY_TYPE = BR_KEYTYPE_EC; // or BR_KEYTYPE_RSA
 
 #include "WifiDriver.h"
 #include "MqttDriver.h"
 #include "FirmwareManager.h"
 #include "Scheduler.h"
 #include "SensorManager.h"
+#include "PersistentStore.h"
+#include "RtcStorage.h"
+#include "FlashStorage.h"
+#include "MeasurementBuffer.h"
+#include "WakeMetrics.h"
+#include "ChangeDetector.h"
+#include "AdaptiveInterval.h"
+#include "RemoteConfig.h"
+#include "FlashLog.h"
+#include "WakeBudget.h"
 
+RtcStorage rtcStorage;
+FlashStorage flashStorage("/persistent_store.bin");
+PersistentStore store;
 Scheduler scheduler;
 SensorManager sensorManager;
 FirmwareManager firmwareManager;
 WifiDriver wifiDriver;
 MqttDriver mqttDriver;
+MeasurementBuffer measurementBuffer;
+WakeMetrics wakeMetrics;
+ChangeDetector changeDetector;
+AdaptiveInterval adaptiveInterval;
+RemoteConfig remoteConfig;
+FlashLog flashLog;
+WakeBudget wakeBudget;
 
 const int BUILD_NUMBER = 40;
+// The settings from here to SAMPLES_FORMAT are defaults. The retained config message overrides them (see RemoteConfig.h).
+// 1 to 8 sensors, see SensorManager.h for the wiring
 const int SENSOR_COUNT = 2;
+// 1 to 16, see SensorManager.h
+const int SAMPLES_PER_SENSOR = 16;
 const long MEASURE_INTERVAL_SECONDS = 900;
+// Stretch the interval up to MAX_MEASURE_INTERVAL_SECONDS while the walls stay dry (see AdaptiveInterval.h).
+// Keep the maximum below the longest deep sleep of the ESP8266 (about 3.5 hours).
+const bool ADAPTIVE_INTERVAL = false;
+const long MAX_MEASURE_INTERVAL_SECONDS = 3 * 3600;
+// Switch on the radio every BATCH_SIZE measurements. 1 means every measurement.
+const int BATCH_SIZE = 4;
+const uint32_t WET_RESISTANCE_OHM = 500000;
+// Only switch on the radio if a resistance changed more than the threshold since the last report, or after the heartbeat
+const bool REPORT_ON_CHANGE = false;
+const uint8_t CHANGE_THRESHOLD_PERCENT = 10;
+const uint32_t HEARTBEAT_SECONDS = 6 * 3600;
+// Publishing the readable comment per measurement is optional, as it is the largest payload
+const bool PUBLISH_COMMENT = false;
+// SAMPLES_CSV is readable, SAMPLES_PACKED and SAMPLES_DELTA are base64 encoded and much smaller (see SensorManager.h)
+const SamplesFormat SAMPLES_FORMAT = SAMPLES_CSV;
+// The settings below are compile time only.
+// SCAN_SINGLE_WINDOW measures all sensors in one power up of the muxes, which is faster with more sensors
+const ScanMode SCAN_MODE = SCAN_PER_SENSOR;
+// ACQUIRE_ADAPTIVE stops settling and sampling once the readings are stable, so stable walls take less time and power
+const AcquisitionMode ACQUISITION_MODE = ACQUIRE_FIXED;
+// Stay connected to MQTT in modem sleep while waiting for the next run, so remote commands arrive right away.
+// Without it, the radio goes off while waiting and the wait uses light sleep.
+const bool REMOTE_COMMANDS = false;
+// Blinking the LED while waiting shows the device is alive, but costs power
+const bool BLINK_WHILE_WAITING = false;
+// Publish at most this many entries from the flash log per wake, so a long backlog doesn't keep the radio on for long
+const int REPLAY_ENTRIES_PER_WAKE = 48;
+// Give each device its own slot in the interval (derived from the chip ID), so a fleet doesn't hit the broker all at once
+const bool SLOT_JITTER = false;
+// Upper bound of the awake time per run (not counting the wait for it). The phases have their own limits, see WakeBudget.cpp.
+const unsigned long WAKE_BUDGET_MILLIS = 90000;
+// Retained topic with the available firmware version (with the mac address filled in). Empty to only use the version file.
+const char* FIRMWARE_TOPIC_TEMPLATE = "firmware/%s/version";
 
-int sensorValue;
-float V_out;
-float R_wall;
-float smoothSensorValue = 0.0;
-unsigned long startTime;
+// the configuration of this wake. A new one only takes effect on the next wake.
+RemoteConfig::Values config;
+bool configChanged = false;
 time_t nextRunTimestamp;
+char firmwareTopic[50];
+// the scan for the current run was already started in setup
+bool runStarted = false;
+// the radio is enabled and connected to the broker on this wake
+bool radioConnected = false;
 
 void publishNextRun(time_t nextRunTimestamp) {
   Serial.printf("Next run:     %s", ctime(&nextRunTimestamp));
@@ -78,66 +157,405 @@ void publishNextRun(time_t nextRunTimestamp) {
   char dateBuffer[BUFFER_SIZE];
   strftime(dateBuffer, BUFFER_SIZE, "%FT%TZ", gmtime(&nextRunTimestamp));
   mqttDriver.publishDeviceProperty(PROPERTY_NEXTRUN, dateBuffer);    
+  sprintf(dateBuffer, "%ld", scheduler.intervalSeconds());
+  mqttDriver.publishDeviceProperty(PROPERTY_INTERVAL, dateBuffer);
+}
+
+// Publish measurements from earlier wakes as "timestamp,raw,resistance;...", and the last one as the current value
+bool publishPendingMeasurements() {
+  const int PAYLOAD_SIZE = 640;
+  char payload[PAYLOAD_SIZE];
+  char numberBuffer[20];
+  time_t timestamp;
+  float rawValues[SensorManager::MAX_SENSORS];
+  bool success = true;
+  mqttDriver.beginBatch();
+  for (int sensorNumber = 0; sensorNumber < config.sensorCount; sensorNumber++) {
+    payload[0] = 0;
+    int length = 0;
+    for (int i = 0; length < PAYLOAD_SIZE && measurementBuffer.get(i, &timestamp, rawValues); i++) {
+      length += snprintf(payload + length, PAYLOAD_SIZE - length, "%s%ld,%.1f,%lu", i == 0 ? "" : ";", 
+        static_cast<long>(timestamp), rawValues[sensorNumber], static_cast<unsigned long>(sensorManager.resistanceFor(rawValues[sensorNumber])));
+    }
+    success = mqttDriver.publishProperty(sensorNumber, PROPERTY_BATCH, payload) && success;
+    sprintf(numberBuffer, "%.1f", rawValues[sensorNumber]);
+    success = mqttDriver.publishProperty(sensorNumber, PROPERTY_RAW, numberBuffer) && success;
+    sprintf(numberBuffer, "%lu", static_cast<unsigned long>(sensorManager.resistanceFor(rawValues[sensorNumber])));
+    success = mqttDriver.publishProperty(sensorNumber, PROPERTY_RESISTANCE, numberBuffer) && success;
+  }
+  success = mqttDriver.endBatch() && success;
+  if (success) {
+    changeDetector.reported(timestamp, rawValues);
+  }
+  return success;
+}
+
+// Backlog entries from the flash log, in the same format as the batch in publishPendingMeasurements
+bool publishLogEntries(const FlashLog::Entry* entries, int count) {
+  const int PAYLOAD_SIZE = 320;
+  char payload[PAYLOAD_SIZE];
+  bool success = true;
+  mqttDriver.beginBatch();
+  for (int sensorNumber = 0; sensorNumber < config.sensorCount; sensorNumber++) {
+    int length = 0;
+    for (int i = 0; i < count && length < PAYLOAD_SIZE; i++) {
+      if (sensorNumber >= entries[i].sensorCount) {
+        continue;
+      }
+      float rawValue = entries[i].raw[sensorNumber] / 10.0f;
+      length += snprintf(payload + length, PAYLOAD_SIZE - length, "%s%lu,%.1f,%lu", length == 0 ? "" : ";", 
+        static_cast<unsigned long>(entries[i].timestamp), rawValue, static_cast<unsigned long>(sensorManager.resistanceFor(rawValue)));
+    }
+    if (length > 0) {
+      success = mqttDriver.publishProperty(sensorNumber, PROPERTY_BATCH, payload) && success;
+    }
+  }
+  success = mqttDriver.endBatch() && success;
+  mqttDriver.processMessages();
+  return success;
+}
+
+// Entries leave the RTC buffer either published or into the flash log, so nothing gets lost or sent twice
+void moveBufferToLog() {
+  time_t timestamp;
+  float rawValues[SensorManager::MAX_SENSORS];
+  for (int i = 0; measurementBuffer.get(i, &timestamp, rawValues); i++) {
+    if (!flashLog.append(timestamp, rawValues, config.sensorCount)) {
+      // keep them in RTC memory, that's the best we can do
+      return;
+    }
+  }
+  measurementBuffer.clear();
+}
+
+bool nextWakeNeedsRadio() {
+  bool batchFull = !changeDetector.isChangeDetectionEnabled() && measurementBuffer.count() + 1 >= config.batchSize;
+  return (batchFull || scheduler.isTimeSyncDue()) && scheduler.isRadioRetryDue();
+}
+
+void publishClockDrift() {
+  char numberBuffer[20];
+  sprintf(numberBuffer, "%.4f", scheduler.driftCorrectionFactor());
+  mqttDriver.publishDeviceProperty(PROPERTY_CLOCK_DRIFT, numberBuffer);
+}
+
+void configHandler(const char* payload) {
+  if (remoteConfig.apply(payload)) {
+    Serial.println("Configuration changed. It takes effect on the next wake.");
+    configChanged = true;
+  }
+}
+
+void publishConfig() {
+  char configBuffer[160];
+  remoteConfig.format(configBuffer, sizeof(configBuffer));
+  mqttDriver.publishDeviceProperty(PROPERTY_CONFIG, configBuffer);
+}
+
+RemoteConfig::Values defaultConfig() {
+  RemoteConfig::Values values;
+  values.intervalSeconds = MEASURE_INTERVAL_SECONDS;
+  values.maxIntervalSeconds = MAX_MEASURE_INTERVAL_SECONDS;
+  values.heartbeatMinutes = HEARTBEAT_SECONDS / 60;
+  values.wetKiloOhm = WET_RESISTANCE_OHM / 1000;
+  values.sensorCount = SENSOR_COUNT;
+  values.sampleCount = SAMPLES_PER_SENSOR;
+  values.batchSize = BATCH_SIZE;
+  values.thresholdPercent = CHANGE_THRESHOLD_PERCENT;
+  values.samplesFormat = SAMPLES_FORMAT;
+  values.adaptiveInterval = ADAPTIVE_INTERVAL;
+  values.reportOnChange = REPORT_ON_CHANGE;
+  values.publishComment = PUBLISH_COMMENT;
+  return values;
+}
+
+void messageHandler(const char* topic, const char* payload) {
+  if (strcmp(topic, firmwareTopic) == 0) {
+    firmwareManager.setAnnouncedVersion(atoi(payload));
+  }
+}
+
+// Add the cost of this wake to the totals, just before deep sleep
+void recordWake() {
+  wakeMetrics.endWake(millis(), scheduler.isRadioEnabled(), wifiDriver.bytesSent(), store.hasDurableChanges());
+}
+
+void pollSensors() {
+  sensorManager.poll();
+  wakeBudget.check();
+}
+
+void startPhase(WakeMetrics::Phase phase) {
+  wakeBudget.startPhase(phase);
+  wakeMetrics.startPhase(phase);
+}
+
+// Out of time: skip the rest of the wake. Measurements that were not published stay in the buffer.
+void budgetOverrun(WakeMetrics::Phase phase) {
+  Serial.printf("Wake budget used up in phase %d\n", phase);
+  wakeMetrics.overran(phase);
+  scheduler.abortWake(nextWakeNeedsRadio());
 }
 
 void waitCallback() {
-  digitalWrite(LED_BUILTIN, time(nullptr) % 2 == 0);
   // keep the MQTT connection active
   mqttDriver.processMessages();  
 }
+// Unless we accept remote commands, nothing needs the radio while waiting, so it goes off and the wait uses light sleep.
+// If the wait ends in deep sleep, that doesn't matter either.
+void prepareWait() {
+  bool keepConnection = REMOTE_COMMANDS && radioConnected;
+  if (!keepConnection && scheduler.isRadioEnabled() && wifiDriver.isConnected()) {
+    mqttDriver.disconnect();
+    wifiDriver.end();
+  }
+  scheduler.setWaitMode(keepConnection ? WAIT_MODEM_SLEEP : WAIT_LIGHT_SLEEP, BLINK_WHILE_WAITING);
+}
+
+void waitForResult(int sensorNumber) {
+  while (!sensorManager.isResultReady(sensorNumber)) {
+    sensorManager.poll();
+    mqttDriver.processMessages();
+    wakeBudget.check();
+    delay(1);
+  }
+}
+
+// The last sensor may still be reversing the current
+void finishScan() {
+  while (sensorManager.poll()) {
+    wakeBudget.check();
+    delay(1);
+  }
+}
 
 void setup() {
-  startTime = micros();
   Serial.begin(115200);
   delay(250);
-  sensorManager.begin(SENSOR_COUNT);
+  store.begin(&rtcStorage, &flashStorage);
+  // the cached configuration, so we don't need the network for it
+  remoteConfig.begin(&store, defaultConfig());
+  config = remoteConfig.values();
+  scheduler.begin(&store, config.intervalSeconds);
+  if (SLOT_JITTER) {
+    scheduler.setSlotJitter(ESP.getChipId());
+  }
+  wakeMetrics.begin(&store);
+  wakeBudget.begin(WAKE_BUDGET_MILLIS, budgetOverrun);
+  scheduler.setSleepHandler(recordWake);
+  sensorManager.begin(config.sensorCount);
+  sensorManager.setSampleCount(config.sampleCount);
+  sensorManager.setSamplesFormat(static_cast<SamplesFormat>(config.samplesFormat));
+  sensorManager.setScanMode(SCAN_MODE);
+  sensorManager.setAcquisitionMode(ACQUISITION_MODE);
+  measurementBuffer.begin(&store, config.sensorCount);
+  flashLog.begin(&store);
+  changeDetector.begin(&store, config.sensorCount, remoteConfig.wetResistanceOhm(), [](float rawValue) { return sensorManager.resistanceFor(rawValue); });
+  changeDetector.setChangeDetection(config.reportOnChange, config.thresholdPercent, remoteConfig.heartbeatSeconds());
+  if (config.reportOnChange) {
+    scheduler.setTimeSyncInterval(remoteConfig.heartbeatSeconds());
+  }
+  if (config.adaptiveInterval) {
+    adaptiveInterval.begin(&store, config.sensorCount, config.intervalSeconds, config.maxIntervalSeconds, remoteConfig.wetResistanceOhm(),
+      [](float rawValue) { return sensorManager.resistanceFor(rawValue); });
+    scheduler.setIntervalPolicy(&adaptiveInterval);
+  }
   pinMode(LED_BUILTIN, OUTPUT);
   digitalWrite(LED_BUILTIN, LOW);
-  if (!wifiDriver.begin()) {
-    Serial.println("Could not connect to WiFi. Rebooting...");
-    ESP.restart();
+  if (scheduler.isRadioEnabled()) {
+    // If we woke up for the run, measure while the radio connects. Without radio there is nothing to overlap with.
+    runStarted = scheduler.startRunIfDue();
+    if (runStarted) {
+      sensorManager.startScan();
+    }
+    radioConnected = connectRadio();
+  }
+  // The clock during deep sleep is not very accurate. Wait for the right time to start measuring
+  nextRunTimestamp = scheduler.getNextRunTimestamp();
+  if (radioConnected) {
+    publishNextRun(nextRunTimestamp);
+  }
+  if (!runStarted) {
+    wakeBudget.pause();
+    prepareWait();
+    scheduler.waitForNextRun(waitCallback, radioConnected);
+  }
+}
+
+// Rebooting would just fail again and drain the battery, so the wake goes on without the radio.
+// Without a clock, the scheduler goes into deep sleep until the next try.
+bool radioFailed(const char* message) {
+  Serial.println(message);
+  wifiDriver.end();
+  wakeMetrics.endPhase();
+  scheduler.radioFailed();
+  return false;
+}
+
+bool connectRadio() {
+  startPhase(WakeMetrics::PHASE_WIFI);
+  if (!wifiDriver.begin(&store, pollSensors, wakeBudget.remainingMillis())) {
+    return radioFailed("Could not connect to WiFi");
   }
   wifiDriver.printStatus();
-  scheduler.begin(MEASURE_INTERVAL_SECONDS); 
-  mqttDriver.begin(wifiDriver.client(), CONFIG_DEVICE_NAME, SENSOR_COUNT); 
+  startPhase(WakeMetrics::PHASE_NTP);
+  if (!scheduler.startTimeSync(pollSensors, wakeBudget.remainingMillis())) {
+    return radioFailed("Could not get the time");
+  }
+  // after a power cycle, make sure the broker has the right announcement
+  if (store.isColdStart()) {
+    mqttDriver.forceAnnouncement();
+  }
+  startPhase(WakeMetrics::PHASE_MQTT);
+  mqttDriver.setNodeOptions(config.publishComment, sensorManager.samplesFormatName());
+  mqttDriver.setConfigHandler(configHandler);
+  if (strlen(FIRMWARE_TOPIC_TEMPLATE) > 0) {
+    sprintf(firmwareTopic, FIRMWARE_TOPIC_TEMPLATE, wifiDriver.macAddress());
+    mqttDriver.setMessageHandler(firmwareTopic, messageHandler);
+  }
+  mqttDriver.setTimeout(wakeBudget.remainingMillis());
+  mqttDriver.begin(wifiDriver.client(), &store, CONFIG_DEVICE_NAME, config.sensorCount, BUILD_NUMBER); 
   if (!mqttDriver.isConnected()) {
-    Serial.println("Could not connect to MQTT broker. Rebooting...");
-    ESP.restart();
+    return radioFailed("Could not connect to MQTT broker");
   }
+  scheduler.radioConnected();
+  firmwareManager.begin(wifiDriver.client(), &store, CONFIG_BASE_FIRMWARE_URL, wifiDriver.macAddress());
   Serial.printf("Build: %d\n", BUILD_NUMBER);
-  char buildString[20];
-  sprintf(buildString, "%d", BUILD_NUMBER);
-  mqttDriver.publishDeviceProperty(PROPERTY_BUILD, buildString);
-  mqttDriver.publishDeviceProperty(PROPERTY_MAC, wifiDriver.macAddress());
-  // The clock during deep sleep is not very accurate. Wait for the right time to start measuring
-  nextRunTimestamp = scheduler.getNextRunTimestamp();
-  publishNextRun(nextRunTimestamp);
-  scheduler.waitForNextRun(waitCallback);
+  startPhase(WakeMetrics::PHASE_PUBLISH);
+  // collect the device properties so they go out in one TLS record
+  mqttDriver.beginBatch();
+  // build and mac address are retained and only change with the announcement
+  if (mqttDriver.wasAnnounced()) {
+    char buildString[20];
+    sprintf(buildString, "%d", BUILD_NUMBER);
+    mqttDriver.publishDeviceProperty(PROPERTY_BUILD, buildString);
+    mqttDriver.publishDeviceProperty(PROPERTY_MAC, wifiDriver.macAddress());
+    publishConfig();
+  }
+  char numberBuffer[20];
+  sprintf(numberBuffer, "%lu", wifiDriver.connectMillis());
+  mqttDriver.publishDeviceProperty(PROPERTY_WIFI_CONNECT_TIME, numberBuffer);
+  // total full and resumed TLS handshakes since the last cold boot, then the cost of the credentials:
+  // ms of the last TLS connect, µs and bytes of heap to parse the certificates and the key
+  char tlsBuffer[60];
+  sprintf(tlsBuffer, "%u,%u,%lu,%lu,%lu", wifiDriver.fullHandshakes(), wifiDriver.resumedHandshakes(), wifiDriver.tlsConnectMillis(),
+    static_cast<unsigned long>(wifiDriver.credentialMicros()), static_cast<unsigned long>(wifiDriver.credentialHeap()));
+  mqttDriver.publishDeviceProperty(PROPERTY_TLS_HANDSHAKES, tlsBuffer);
+  // totals of the wakes since the last report: wakes,radio wakes,awake ms,radio ms,bytes sent,flash writes,overruns,phase
+  if (wakeMetrics.wakes() > 0) {
+    char costBuffer[80];
+    wakeMetrics.format(costBuffer, sizeof(costBuffer));
+    mqttDriver.publishDeviceProperty(PROPERTY_WAKE_COST, costBuffer);
+    wakeMetrics.reset();
+  }
+  // phases of the last wake with the radio on: name=µs/free heap/largest free block;...
+  char phasesBuffer[256];
+  if (wakeMetrics.formatPhases(phasesBuffer, sizeof(phasesBuffer))) {
+    mqttDriver.publishDeviceProperty(PROPERTY_WAKE_PHASES, phasesBuffer);
+  }
+  mqttDriver.endBatch();
+  // the backlog is older than the buffer, so it goes first
+  int replayed = flashLog.replay(REPLAY_ENTRIES_PER_WAKE, publishLogEntries);
+  if (replayed > 0) {
+    Serial.printf("Published %d entries from the log, %u left\n", replayed, flashLog.pendingEntries());
+  }
+  if (measurementBuffer.count() > 0) {
+    if (publishPendingMeasurements()) {
+      measurementBuffer.clear();
+    } else {
+      moveBufferToLog();
+    }
+  }
+  wakeMetrics.endPhase();
+  return true;
 }
 
 void loop() {
-  if (mqttDriver.connect()) {
-    for (int sensorNumber = 0; sensorNumber < SENSOR_COUNT; sensorNumber++) {
-      sensorManager.read(sensorNumber);      
-      sensorManager.printResult();
-      
+  wakeBudget.resume();
+  bool radioEnabled = radioConnected;
+  if (!runStarted) {
+    sensorManager.startScan();
+  }
+  runStarted = false;
+  if (radioEnabled && !wifiDriver.isConnected()) {
+    // the radio went off while waiting. If it doesn't come back, this run goes on without it, like in connectRadio.
+    startPhase(WakeMetrics::PHASE_WIFI);
+    if (!wifiDriver.begin(&store, pollSensors, wakeBudget.remainingMillis())) {
+      radioEnabled = radioFailed("Could not reconnect to WiFi");
+      radioConnected = false;
+    }
+  }
+  startPhase(WakeMetrics::PHASE_MQTT);
+  mqttDriver.setTimeout(wakeBudget.remainingMillis());
+  bool published = radioEnabled && mqttDriver.connect();
+  float rawValues[SensorManager::MAX_SENSORS];
+  if (radioEnabled) {
+    mqttDriver.beginBatch();
+  }
+  for (int sensorNumber = 0; sensorNumber < config.sensorCount; sensorNumber++) {
+    startPhase(WakeMetrics::PHASE_MEASURE);
+    waitForResult(sensorNumber);
+    startPhase(WakeMetrics::PHASE_PUBLISH);
+    sensorManager.printResult(sensorNumber);
+    rawValues[sensorNumber] = sensorManager.pinValue(sensorNumber);
+    
+    if (radioEnabled) {
       // Send the results over MQTT
-      mqttDriver.publishProperty(sensorNumber, PROPERTY_COMMENT, sensorManager.comment());
-      mqttDriver.publishProperty(sensorNumber, PROPERTY_SAMPLES, sensorManager.samples());
+      if (config.publishComment) {
+        mqttDriver.publishProperty(sensorNumber, PROPERTY_COMMENT, sensorManager.comment(sensorNumber));
+      }
+      mqttDriver.publishProperty(sensorNumber, PROPERTY_SAMPLES, sensorManager.samples(sensorNumber));
       char numberBuffer[20];
-      sprintf(numberBuffer, "%.1f", sensorManager.pinValue());
-      mqttDriver.publishProperty(sensorNumber, PROPERTY_RAW, numberBuffer);
-      sprintf(numberBuffer, "%.0f", sensorManager.resistance());
-      mqttDriver.publishProperty(sensorNumber, PROPERTY_RESISTANCE, numberBuffer);
+      sprintf(numberBuffer, "%.1f", sensorManager.pinValue(sensorNumber));
+      published = mqttDriver.publishProperty(sensorNumber, PROPERTY_RAW, numberBuffer) && published;
+      sprintf(numberBuffer, "%lu", static_cast<unsigned long>(sensorManager.resistance(sensorNumber)));
+      published = mqttDriver.publishProperty(sensorNumber, PROPERTY_RESISTANCE, numberBuffer) && published;
       
       // keep the MQTT connection active
       mqttDriver.processMessages();
     }
   }
+  startPhase(WakeMetrics::PHASE_MEASURE);
+  finishScan();
+  startPhase(WakeMetrics::PHASE_PUBLISH);
+  if (radioEnabled) {
+    published = mqttDriver.endBatch() && published;
+  }
+  time_t measureTime = time(nullptr);
+  // while the radio backs off, a full buffer goes to flash instead of dropping the oldest entry
+  if (scheduler.radioFailures() > 0 && measurementBuffer.count() >= measurementBuffer.capacity()) {
+    moveBufferToLog();
+  }
+  measurementBuffer.add(measureTime, rawValues);
+  if (config.adaptiveInterval) {
+    adaptiveInterval.addMeasurement(rawValues);
+  }
+  if (published) {
+    measurementBuffer.clear();
+    changeDetector.reported(measureTime, rawValues);
+  } else if (radioEnabled) {
+    moveBufferToLog();
+  }
   nextRunTimestamp = scheduler.setNextRunTimestamp();
-  publishNextRun(nextRunTimestamp);
-  mqttDriver.disconnect();
-  firmwareManager.begin(wifiDriver.client(), CONFIG_BASE_FIRMWARE_URL, wifiDriver.macAddress());
-  firmwareManager.tryUpdateFrom(BUILD_NUMBER);
-  scheduler.waitForNextRun(waitCallback);
+  if (!radioEnabled) {
+    if (changeDetector.isReportDue(measureTime, rawValues) && scheduler.isRadioRetryDue()) {
+      scheduler.restartWithRadio();
+    }
+  } else {
+    // disconnect sends these together with the state
+    mqttDriver.beginBatch();
+    publishNextRun(nextRunTimestamp);
+    publishClockDrift();
+    if (configChanged) {
+      publishConfig();
+    }
+    mqttDriver.disconnect();
+    startPhase(WakeMetrics::PHASE_FIRMWARE);
+    firmwareManager.setTimeLimit(wakeBudget.remainingMillis());
+    firmwareManager.tryUpdateFrom(BUILD_NUMBER);
+  }
+  wakeMetrics.endPhase();
+  wakeBudget.endRun();
+  prepareWait();
+  scheduler.waitForNextRun(waitCallback, nextWakeNeedsRadio());
 }
@@ -28,122 +28,357 @@ const bool MESSAGE_RETAIN = true;
 const char* WILL_MESSAGE = "lost";
 const char* PROPERTY_STATE = "$state";
 const char* NODE_DEVICE = "device";
+// Change when the announcement changes in a way not covered by the property lists (e.g. a data type or format)
+const int ANNOUNCEMENT_VERSION = 1;
+const int DEVICE_NODE = -1;
+// The comment is optional, so it goes last in the node properties
+const char* DEVICE_PROPERTIES[] = { PROPERTY_MAC, PROPERTY_BUILD, PROPERTY_NEXTRUN, PROPERTY_INTERVAL, PROPERTY_CLOCK_DRIFT, 
+  PROPERTY_WIFI_CONNECT_TIME, PROPERTY_TLS_HANDSHAKES, PROPERTY_WAKE_COST, PROPERTY_WAKE_PHASES, PROPERTY_CONFIG };
+const char* NODE_PROPERTIES[] = { PROPERTY_RAW, PROPERTY_RESISTANCE, PROPERTY_SAMPLES, PROPERTY_BATCH, PROPERTY_COMMENT };
 
 PubSubClient mqttClient;
 
 bool MqttDriver::announceDevice() {
   char baseTopic[50];
-  char payload[100];
+  char payload[160];
   char sensorNumber[20];
   if (!publishEntity(_clientName, "$homie", "3.0.1")) {
       return false;
   }
-  setState("init");
-  publishEntity(_clientName, "$name", _clientName);
+  bool success = setState("init");
+  success = publishEntity(_clientName, "$name", _clientName) && success;
   strcpy(payload, NODE_DEVICE);
   for (int i = 0; i < _nodes; i++) {
       sprintf(sensorNumber,",%d",i);
       strcat(payload, sensorNumber);
   }
-  publishEntity(_clientName, "$nodes", payload);
-  publishEntity(_clientName, "$implementation", "esp8266");
-  publishEntity(_clientName, "$extensions", "");
+  success = publishEntity(_clientName, "$nodes", payload) && success;
+  success = publishEntity(_clientName, "$implementation", "esp8266") && success;
+  success = publishEntity(_clientName, "$extensions", "") && success;
   sprintf(baseTopic, "%s/%s",_clientName, NODE_DEVICE);
-  sprintf(payload, "%s,%s,%s", PROPERTY_MAC, PROPERTY_BUILD, PROPERTY_NEXTRUN);
-  announceNode(baseTopic, NODE_DEVICE, NODE_DEVICE, payload);
-  sprintf(payload, "%s,%s,%s,%s", PROPERTY_RAW, PROPERTY_RESISTANCE, PROPERTY_COMMENT, PROPERTY_SAMPLES);
+  listDeviceProperties(payload);
+  success = announceNode(baseTopic, NODE_DEVICE, NODE_DEVICE, payload) && success;
+  listNodeProperties(payload);
   strcat(baseTopic, "/");
   strcat(baseTopic, PROPERTY_NEXTRUN);
-  announceProperty(baseTopic, PROPERTY_NEXTRUN, TYPE_DATETIME, "", "");
+  success = announceProperty(baseTopic, PROPERTY_NEXTRUN, TYPE_DATETIME, "", "") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_INTERVAL);
+  success = announceProperty(baseTopic, PROPERTY_INTERVAL, TYPE_INTEGER, "", "s") && success;
   sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_MAC);
-  announceProperty(baseTopic, PROPERTY_MAC, TYPE_STRING, "", "");
+  success = announceProperty(baseTopic, PROPERTY_MAC, TYPE_STRING, "", "") && success;
   sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_BUILD);
-  announceProperty(baseTopic, PROPERTY_BUILD, TYPE_INTEGER, "", "");
+  success = announceProperty(baseTopic, PROPERTY_BUILD, TYPE_INTEGER, "", "") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_CLOCK_DRIFT);
+  success = announceProperty(baseTopic, PROPERTY_CLOCK_DRIFT, TYPE_FLOAT, "", "") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_WIFI_CONNECT_TIME);
+  success = announceProperty(baseTopic, PROPERTY_WIFI_CONNECT_TIME, TYPE_INTEGER, "", "ms") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_TLS_HANDSHAKES);
+  success = announceProperty(baseTopic, PROPERTY_TLS_HANDSHAKES, TYPE_STRING, "", "") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_WAKE_COST);
+  success = announceProperty(baseTopic, PROPERTY_WAKE_COST, TYPE_STRING, "", "") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_WAKE_PHASES);
+  success = announceProperty(baseTopic, PROPERTY_WAKE_PHASES, TYPE_STRING, "", "") && success;
+  sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_CONFIG);
+  success = announceProperty(baseTopic, PROPERTY_CONFIG, TYPE_STRING, "", "") && success;
+  success = publishEntity(baseTopic, "$settable", "true") && success;
 
   for (int i = 0; i < _nodes; i++) {
     sprintf(sensorNumber, "%i", i);
     sprintf(baseTopic, "%s/%s", _clientName, sensorNumber);
-    announceNode(baseTopic, sensorNumber, "moisture sensor", payload);  
+    success = announceNode(baseTopic, sensorNumber, "moisture sensor", payload) && success;
     strcat(baseTopic, "/");
     strcat(baseTopic, PROPERTY_RAW);
-    announceProperty(baseTopic, PROPERTY_RAW, TYPE_INTEGER, "0-1024", "");
+    success = announceProperty(baseTopic, PROPERTY_RAW, TYPE_INTEGER, "0-1024", "") && success;
     sprintf(baseTopic, "%s/%s/%s", _clientName, sensorNumber, PROPERTY_RESISTANCE);
-    announceProperty(baseTopic, PROPERTY_RESISTANCE, TYPE_INTEGER, RESISTANCE_RANGE, "Ω");
-    sprintf(baseTopic, "%s/%s/%s", _clientName, sensorNumber, PROPERTY_COMMENT);
-    announceProperty(baseTopic, PROPERTY_COMMENT, TYPE_STRING, "", "");    
+    success = announceProperty(baseTopic, PROPERTY_RESISTANCE, TYPE_INTEGER, RESISTANCE_RANGE, "Ω") && success;
+    if (_commentEnabled) {
+      sprintf(baseTopic, "%s/%s/%s", _clientName, sensorNumber, PROPERTY_COMMENT);
+      success = announceProperty(baseTopic, PROPERTY_COMMENT, TYPE_STRING, "", "") && success;
+    }
     sprintf(baseTopic, "%s/%s/%s", _clientName, sensorNumber, PROPERTY_SAMPLES);
-    announceProperty(baseTopic, PROPERTY_SAMPLES, TYPE_STRING, "", "");    
+    success = announceProperty(baseTopic, PROPERTY_SAMPLES, TYPE_STRING, _samplesFormat, "") && success;
+    sprintf(baseTopic, "%s/%s/%s", _clientName, sensorNumber, PROPERTY_BATCH);
+    success = announceProperty(baseTopic, PROPERTY_BATCH, TYPE_STRING, "", "") && success;
   }
-  setState("ready");
-  return true;
+  return setState("ready") && success;
+}
+
+// Identifies what we announce, so we know when the retained announcement on the broker is outdated
+uint32_t MqttDriver::announcementHash() {
+  char buffer[160];
+  int header[] = { ANNOUNCEMENT_VERSION, _build, _nodes };
+  uint32_t hash = PersistentStore::crc32(header, sizeof(header));
+  hash = PersistentStore::crc32(_clientName, strlen(_clientName), hash);
+  listDeviceProperties(buffer);
+  hash = PersistentStore::crc32(buffer, strlen(buffer), hash);
+  listNodeProperties(buffer);
+  hash = PersistentStore::crc32(buffer, strlen(buffer), hash);
+  return PersistentStore::crc32(_samplesFormat, strlen(_samplesFormat), hash);
 }
 
-void MqttDriver::announceNode(const char* baseTopic, const char* name, const char* type, const char* properties) {
-  publishEntity(baseTopic, "$name", name);
-  publishEntity(baseTopic, "$type", type);
-  publishEntity(baseTopic, "$properties", properties);
+bool MqttDriver::announceNode(const char* baseTopic, const char* name, const char* type, const char* properties) {
+  bool success = publishEntity(baseTopic, "$name", name);
+  success = publishEntity(baseTopic, "$type", type) && success;
+  return publishEntity(baseTopic, "$properties", properties) && success;
 }
 
-void MqttDriver::announceProperty(const char* baseTopic, const char* name, const char* dataType, const char* format, const char*  unit) {
-  publishEntity(baseTopic, "$name", name);
-  publishEntity(baseTopic, "$dataType", dataType);
+bool MqttDriver::announceProperty(const char* baseTopic, const char* name, const char* dataType, const char* format, const char*  unit) {
+  bool success = publishEntity(baseTopic, "$name", name);
+  success = publishEntity(baseTopic, "$dataType", dataType) && success;
   if (strlen(format) > 0) {
-    publishEntity(baseTopic, "$format", format);
+    success = publishEntity(baseTopic, "$format", format) && success;
   }
   if (strlen(unit) > 0) {
-    publishEntity(baseTopic, "$unit", unit);
+    success = publishEntity(baseTopic, "$unit", unit) && success;
   }
+  return success;
 }
 
-void MqttDriver::begin(Client* client, const char* clientName, int nodes) {
+// Puts a PUBLISH packet (QoS 0) in the batch buffer
+bool MqttDriver::appendPublish(const char* topic, const char* payload) {
+  size_t topicLength = strlen(topic);
+  size_t payloadLength = strlen(payload);
+  size_t remainingLength = 2 + topicLength + payloadLength;
+  uint8_t header[5];
+  size_t headerLength = 0;
+  header[headerLength++] = MQTTPUBLISH | (MESSAGE_RETAIN ? 1 : 0);
+  size_t value = remainingLength;
+  do {
+    uint8_t digit = value % 128;
+    value /= 128;
+    header[headerLength++] = value > 0 ? digit | 0x80 : digit;
+  } while (value > 0);
+  size_t packetLength = headerLength + remainingLength;
+  if (_batchLength + packetLength > BATCH_BUFFER_SIZE && !flushBatch()) {
+    return false;
+  }
+  if (packetLength > BATCH_BUFFER_SIZE) {
+    return mqttClient.publish(topic, payload, MESSAGE_RETAIN);
+  }
+  uint8_t* target = _batchBuffer + _batchLength;
+  memcpy(target, header, headerLength);
+  target += headerLength;
+  *target++ = topicLength >> 8;
+  *target++ = topicLength & 0xFF;
+  memcpy(target, topic, topicLength);
+  memcpy(target + topicLength, payload, payloadLength);
+  _batchLength += packetLength;
+  return true;
+}
+
+void MqttDriver::begin(Client* client, PersistentStore* store, const char* clientName, int nodes, int build) {
+  _client = client;
   mqttClient.setClient(*client);
+  _store = store;
   _clientName = clientName;
-  mqttClient.setBufferSize(512);
-  _nodes = nodes;
+  mqttClient.setBufferSize(768);
+  _nodes = nodes > MAX_NODES ? MAX_NODES : nodes;
+  _build = build;
+  buildTopics();
 
   mqttClient.setServer(CONFIG_MQTT_BROKER, CONFIG_MQTT_PORT);
+  mqttClient.setCallback([this](char* topic, uint8_t* payload, unsigned int length) { callback(topic, payload, length); });
   if (!connect()) {
     Serial.printf("Could not connect to MQTT broker: state %d\n", mqttClient.state());     
   }
 }
 
+void MqttDriver::beginBatch() {
+  _batching = true;
+  _batchSucceeded = true;
+}
+
+// Two passes: the first one measures the arena, the second one fills it
+void MqttDriver::buildTopics() {
+  char topic[TOPIC_BUFFER_SIZE];
+  delete[] _topicArena;
+  _topicArena = nullptr;
+  size_t length = 0;
+  auto add = [&](const char* baseTopic, const char* entity) -> uint16_t {
+    snprintf(topic, TOPIC_BUFFER_SIZE, BASE_TOPIC_TEMPLATE, baseTopic, entity);
+    uint16_t offset = length;
+    if (_topicArena != nullptr) {
+      strcpy(_topicArena + offset, topic);
+    }
+    length += strlen(topic) + 1;
+    return offset;
+  };
+  for (int pass = 0; pass < 2; pass++) {
+    length = 0;
+    char baseTopic[50];
+    _stateTopic = add(_clientName, PROPERTY_STATE);
+    sprintf(baseTopic, "%s/%s", _clientName, NODE_DEVICE);
+    for (int i = 0; i < DEVICE_PROPERTY_COUNT; i++) {
+      _deviceTopics[i] = add(baseTopic, DEVICE_PROPERTIES[i]);
+    }
+    sprintf(baseTopic, "%s/%s/%s", _clientName, NODE_DEVICE, PROPERTY_CONFIG);
+    _configSetTopic = add(baseTopic, "set");
+    for (int node = 0; node < _nodes; node++) {
+      sprintf(baseTopic, "%s/%d", _clientName, node);
+      for (int i = 0; i < NODE_PROPERTY_COUNT; i++) {
+        _nodeTopics[node][i] = add(baseTopic, NODE_PROPERTIES[i]);
+      }
+    }
+    if (pass == 0) {
+      _topicArena = new char[length];
+    }
+  }
+}
+
+void MqttDriver::callback(const char* topic, byte* payload, unsigned int length) {
+  bool isConfig = strcmp(topic, _topicArena + _configSetTopic) == 0;
+  if ((isConfig && _configHandler == nullptr) || (!isConfig && _messageHandler == nullptr)) {
+    return;
+  }
+  char message[PAYLOAD_BUFFER_SIZE];
+  if (length >= PAYLOAD_BUFFER_SIZE) {
+    Serial.printf("Ignoring too long message on %s\n", topic);
+    return;
+  }
+  memcpy(message, payload, length);
+  message[length] = 0;
+  if (isConfig) {
+    _configHandler(message);
+  } else {
+    _messageHandler(topic, message);
+  }
+}
+
+// Publishes during the connect (the announcement and the state) don't reconnect when they fail, so a connection
+// that drops halfway doesn't start a second announcement inside the first one
 bool MqttDriver::connect() {
   if (isConnected()) {
     return true;
   }
-  sprintf(_topicBuffer, BASE_TOPIC_TEMPLATE, _clientName, PROPERTY_STATE);
+  _connecting = true;
+  const char* willTopic = _topicArena + _stateTopic;
+  // both the TLS handshake and waiting for the broker stop at the timeout
+  _client->setTimeout(_timeoutMillis);
+  mqttClient.setSocketTimeout((_timeoutMillis + 999) / 1000);
   bool connectionSucceeded;
   if (strlen(SECRET_MQTT_USER) == 0) {
-    connectionSucceeded = mqttClient.connect(CONFIG_DEVICE_NAME, _topicBuffer, WILL_QOS, WILL_RETAIN, WILL_MESSAGE);
+    connectionSucceeded = mqttClient.connect(CONFIG_DEVICE_NAME, willTopic, WILL_QOS, WILL_RETAIN, WILL_MESSAGE);
   } else {
-    connectionSucceeded = mqttClient.connect(CONFIG_DEVICE_NAME, SECRET_MQTT_USER, SECRET_MQTT_PASSWORD, _topicBuffer, WILL_QOS, WILL_RETAIN, WILL_MESSAGE);
+    connectionSucceeded = mqttClient.connect(CONFIG_DEVICE_NAME, SECRET_MQTT_USER, SECRET_MQTT_PASSWORD, willTopic, WILL_QOS, WILL_RETAIN, WILL_MESSAGE);
   }
   if (connectionSucceeded) {
-    if (!announceDevice()) {
-      Serial.println("Could not announce device");
-      connectionSucceeded = false; 
-    }
+    connectionSucceeded = announceIfChanged();
   }  
+  // the configuration is retained, so the broker sends it right after subscribing
+  if (connectionSucceeded && _configHandler != nullptr) {
+    mqttClient.subscribe(_topicArena + _configSetTopic);
+  }
+  if (connectionSucceeded && _messageHandler != nullptr) {
+    mqttClient.subscribe(_messageTopic);
+  }
+  _connecting = false;
   return connectionSucceeded;
 }
 
+// The announcement is retained, so we only need to send it again if it changed. Otherwise just set the state.
+// The hash only gets saved if all of the announcement was sent.
+bool MqttDriver::announceIfChanged() {
+  uint32_t hash = announcementHash();
+  uint32_t announcedHash = 0;
+  _store->load(RECORD_ANNOUNCEMENT, &announcedHash, sizeof(announcedHash));
+  if (!_forceAnnouncement && hash == announcedHash) {
+    return setState("ready");
+  }
+  if (!announceDevice()) {
+    Serial.println("Could not announce device");
+    // part of it may be on the broker, so the next connect must send all of it again, also if this one was forced
+    uint32_t noHash = 0;
+    _store->save(RECORD_ANNOUNCEMENT, &noHash, sizeof(noHash), true);
+    return false;
+  }
+  _forceAnnouncement = false;
+  _announced = true;
+  _store->save(RECORD_ANNOUNCEMENT, &hash, sizeof(hash), true);
+  return true;
+}
+
 void MqttDriver::disconnect() {
-  if (isConnected()) {
+  bool connected = isConnected();
+  if (connected) {
     setState("disconnected");
+  }
+  if (_batching) {
+    endBatch();
+  }
+  if (connected) {
     mqttClient.disconnect();    
   }
 }
 
+// Sends what was collected since beginBatch. Returns whether all of it was sent.
+bool MqttDriver::endBatch() {
+  _batching = false;
+  return flushBatch() && _batchSucceeded;
+}
+
+bool MqttDriver::flushBatch() {
+  if (_batchLength == 0) {
+    return true;
+  }
+  bool success = isConnected() && _client->write(_batchBuffer, _batchLength) == _batchLength;
+  _batchLength = 0;
+  if (!success) {
+    _batchSucceeded = false;
+  }
+  return success;
+}
+
+void MqttDriver::forceAnnouncement() {
+  _forceAnnouncement = true;
+}
+
 bool MqttDriver::isConnected() {
   return mqttClient.connected();
 }
 
+// For topics that are not in the arena, like the ones of the announcement
 bool MqttDriver::publishEntity(const char* baseTopic, const char* entity, const char* payload) {
-  if (!mqttClient.connected() && !connect()) {
+  char topic[TOPIC_BUFFER_SIZE];
+  snprintf(topic, TOPIC_BUFFER_SIZE, BASE_TOPIC_TEMPLATE, baseTopic, entity);
+  return publishTopic(topic, payload);
+}
+
+// Only checks the connection if the publish fails, and then tries once more after reconnecting (except during connect)
+bool MqttDriver::publishTopic(const char* topic, const char* payload) {
+  if (_batching) {
+    if (appendPublish(topic, payload)) {
+      return true;
+    }
+    _batchSucceeded = false;
     return false;
   }
-  sprintf(_topicBuffer, BASE_TOPIC_TEMPLATE, baseTopic, entity);
-  return mqttClient.publish(_topicBuffer, payload, MESSAGE_RETAIN);
+  if (mqttClient.publish(topic, payload, MESSAGE_RETAIN)) {
+    return true;
+  }
+  return !_connecting && !isConnected() && connect() && mqttClient.publish(topic, payload, MESSAGE_RETAIN);
+}
+
+void MqttDriver::listDeviceProperties(char* payload) {
+  payload[0] = 0;
+  for (int i = 0; i < DEVICE_PROPERTY_COUNT; i++) {
+    if (i > 0) {
+      strcat(payload, ",");
+    }
+    strcat(payload, DEVICE_PROPERTIES[i]);
+  }
+}
+
+void MqttDriver::listNodeProperties(char* payload) {
+  payload[0] = 0;
+  for (int i = 0; i < NODE_PROPERTY_COUNT; i++) {
+    if (NODE_PROPERTIES[i] == PROPERTY_COMMENT && !_commentEnabled) {
+      continue;
+    }
+    if (i > 0) {
+      strcat(payload, ",");
+    }
+    strcat(payload, NODE_PROPERTIES[i]);
+  }
 }
 
 bool MqttDriver::processMessages() {
@@ -151,19 +386,84 @@ bool MqttDriver::processMessages() {
 }
 
 void MqttDriver::publishDeviceProperty(const char* propertyName, const char* payload) {
+  const char* topic = topicFor(DEVICE_NODE, propertyName);
+  if (topic != nullptr) {
+    publishTopic(topic, payload);
+    return;
+  }
   char baseTopic[50];
   sprintf(baseTopic, "%s/%s", _clientName, NODE_DEVICE);
   publishEntity(baseTopic, propertyName, payload);
 }
 
-void MqttDriver::publishProperty(int nodeNumber, const char* property, const char* payload) {
-  char baseTopic[50];
-  sprintf(baseTopic, "%s/%d", _clientName, nodeNumber);
-  if (!publishEntity(baseTopic, property, payload)) {
+// If batching, success means it is in the batch. endBatch tells whether it was sent.
+bool MqttDriver::publishProperty(int nodeNumber, const char* property, const char* payload) {
+  const char* topic = topicFor(nodeNumber, property);
+  bool success;
+  if (topic != nullptr) {
+    success = publishTopic(topic, payload);
+  } else {
+    char baseTopic[50];
+    sprintf(baseTopic, "%s/%d", _clientName, nodeNumber);
+    success = publishEntity(baseTopic, property, payload);
+  }
+  if (!success) {
     Serial.printf("Could not publish %s: %s\n", property, payload);
+    return false;
+  }
+  return true;
+}
+
+// Called with the payload of the retained <device>/device/config/set topic. Set it before begin.
+void MqttDriver::setConfigHandler(std::function<void(const char* payload)> handler) {
+  _configHandler = handler;
+}
+
+// Called with the messages on the topic, which must stay valid. Set it before begin.
+void MqttDriver::setMessageHandler(const char* topic, std::function<void(const char* topic, const char* payload)> handler) {
+  _messageTopic = topic;
+  _messageHandler = handler;
+}
+
+void MqttDriver::setNodeOptions(bool commentEnabled, const char* samplesFormat) {
+  _commentEnabled = commentEnabled;
+  _samplesFormat = samplesFormat;
+}
+
+// Applies to the next connect
+void MqttDriver::setTimeout(unsigned long timeoutMillis) {
+  _timeoutMillis = timeoutMillis;
+}
+
+bool MqttDriver::setState(const char* state) {
+    return publishTopic(_topicArena + _stateTopic, state);
+}
+
+bool MqttDriver::subscribe(const char* topic) {
+  return mqttClient.subscribe(topic);
+}
+
+// The topic from the arena, or nullptr if we don't have it
+const char* MqttDriver::topicFor(int nodeNumber, const char* property) {
+  if (_topicArena == nullptr || nodeNumber >= _nodes) {
+    return nullptr;
+  }
+  if (nodeNumber == DEVICE_NODE) {
+    for (int i = 0; i < DEVICE_PROPERTY_COUNT; i++) {
+      if (strcmp(DEVICE_PROPERTIES[i], property) == 0) {
+        return _topicArena + _deviceTopics[i];
+      }
+    }
+    return nullptr;
+  }
+  for (int i = 0; i < NODE_PROPERTY_COUNT; i++) {
+    if (strcmp(NODE_PROPERTIES[i], property) == 0) {
+      return _topicArena + _nodeTopics[nodeNumber][i];
+    }
   }
+  return nullptr;
 }
 
-void MqttDriver::setState(const char* state) {
-    publishEntity(_clientName, PROPERTY_STATE, state);
+bool MqttDriver::wasAnnounced() {
+  return _announced;
 }
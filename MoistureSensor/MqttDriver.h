@@ -11,41 +11,104 @@
 
 // This class implements the homie convention (https://homieiot.github.io/specification/) 
 // to allow home automation systems like OpenHAB to autodetect it.
+// The announcement is retained on the broker, so it is only published again if it changed since the last time
+// (detected via a hash kept in the persistent store), or if forced.
+// The comment property (a readable summary of a measurement) is optional, as it is by far the largest payload.
+// Set the node options before begin, since they are part of the announcement.
+// The topics of the properties and the state are built once in begin, in one block of memory.
+// Between beginBatch and endBatch, publishes are collected in a buffer and sent in one write, so they go out
+// in one TLS record instead of one each. If a publish doesn't fit anymore, the buffer is sent first.
+// The config device property is settable. With a config handler, it subscribes to its set topic on every connect.
+// The same goes for the topic of the message handler (e.g. the firmware version), so a reconnect keeps both.
 
 #ifndef HEADER_MQTTDRIVER
 #define HEADER_MQTTDRIVER
+#include <functional>
 #include "Client.h"
+#include "PersistentStore.h"
 
 static const char* PROPERTY_RAW = "raw";
 static const char* PROPERTY_RESISTANCE = "resistance";
 static const char* PROPERTY_COMMENT = "comment";
 static const char* PROPERTY_NEXTRUN = "next-run";
 static const char* PROPERTY_SAMPLES = "samples";
+static const char* PROPERTY_BATCH = "batch";
 static const char* PROPERTY_BUILD = "build"; 
 static const char* PROPERTY_MAC = "mac-address";
+static const char* PROPERTY_CLOCK_DRIFT = "clock-drift";
+static const char* PROPERTY_WIFI_CONNECT_TIME = "wifi-connect-time";
+static const char* PROPERTY_TLS_HANDSHAKES = "tls-handshakes";
+static const char* PROPERTY_WAKE_COST = "wake-cost";
+static const char* PROPERTY_WAKE_PHASES = "wake-phases";
+static const char* PROPERTY_INTERVAL = "interval";
+static const char* PROPERTY_CONFIG = "config";
 
 class MqttDriver {
 public:
-    void begin(Client* client, const char* clientName, int nodes);
+    void begin(Client* client, PersistentStore* store, const char* clientName, int nodes, int build);
+    void beginBatch();
     bool connect();
     void disconnect();
+    bool endBatch();
+    void forceAnnouncement();
     bool isConnected();
     bool processMessages();
     void publishDeviceProperty(const char* propertyName, const char* payload);
-    void publishProperty(int nodeNumber, const char* property, const char* payload);
-    void setState(const char* state);
+    bool publishProperty(int nodeNumber, const char* property, const char* payload);
+    void setConfigHandler(std::function<void(const char* payload)> handler);
+    void setMessageHandler(const char* topic, std::function<void(const char* topic, const char* payload)> handler);
+    void setNodeOptions(bool commentEnabled, const char* samplesFormat);
+    void setTimeout(unsigned long timeoutMillis);
+    bool setState(const char* state);
+    bool subscribe(const char* topic);
+    bool wasAnnounced();
 
 protected:
+    PersistentStore* _store = 0;
     const char* _clientName = 0;
     int _nodes = 1;
+    int _build = 0;
+    bool _forceAnnouncement = false;
+    bool _announced = false;
+    bool _connecting = false;
+    bool _commentEnabled = false;
+    const char* _samplesFormat = "";
+    std::function<void(const char* topic, const char* payload)> _messageHandler = nullptr;
+    const char* _messageTopic = nullptr;
+    std::function<void(const char* payload)> _configHandler = nullptr;
     static const int TOPIC_BUFFER_SIZE = 100;
-    char _topicBuffer[TOPIC_BUFFER_SIZE] = { 0 };
+    static const int PAYLOAD_BUFFER_SIZE = 160;
+    static const int MAX_NODES = 8;
+    static const int DEVICE_PROPERTY_COUNT = 10;
+    static const int NODE_PROPERTY_COUNT = 5;
+    static const int BATCH_BUFFER_SIZE = 1024;
+    Client* _client = nullptr;
+    // offsets of the topics in the arena
+    char* _topicArena = nullptr;
+    uint16_t _stateTopic = 0;
+    uint16_t _configSetTopic = 0;
+    uint16_t _deviceTopics[DEVICE_PROPERTY_COUNT];
+    uint16_t _nodeTopics[MAX_NODES][NODE_PROPERTY_COUNT];
+    uint8_t _batchBuffer[BATCH_BUFFER_SIZE];
+    size_t _batchLength = 0;
+    bool _batching = false;
+    bool _batchSucceeded = true;
+    unsigned long _timeoutMillis = 15000;
 
     bool announceDevice();
-    void announceNode(const char* baseTopic, const char* name, const char* type, const char* properties);
-    void announceProperty(const char* baseTopic, const char* name, const char* dataType, const char* format, const char* unit);
+    uint32_t announcementHash();
+    bool announceIfChanged();
+    bool appendPublish(const char* topic, const char* payload);
+    void buildTopics();
+    bool announceNode(const char* baseTopic, const char* name, const char* type, const char* properties);
+    bool announceProperty(const char* baseTopic, const char* name, const char* dataType, const char* format, const char* unit);
     void callback(const char* topic, byte* payload, unsigned int length);
+    bool flushBatch();
+    void listDeviceProperties(char* payload);
+    void listNodeProperties(char* payload);
     bool publishEntity(const char* baseTopic, const char* entity, const char* payload);
+    bool publishTopic(const char* topic, const char* payload);
+    const char* topicFor(int nodeNumber, const char* property);
 };
 
 #endif
@@ -0,0 +1,224 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <string.h>
+#include "PatchApplier.h"
+#include "PersistentStore.h"
+
+const uint8_t PATCH_MAGIC[] = { 'M', 'S', 'P', '1' };
+const uint8_t OPCODE_COPY = 0x01;
+const uint8_t OPCODE_INSERT = 0x02;
+// a 32 bit varint takes at most 5 bytes
+const int MAX_VARINT_SHIFT = 28;
+
+static uint32_t readUint32(const uint8_t* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+bool PatchApplier::applyOperation() {
+  if (_opcode == OPCODE_COPY) {
+    uint32_t zigzag = _arguments[0];
+    int32_t delta = (zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+    return copy(_sourcePosition + delta, _arguments[1]);
+  }
+  _literalRemaining = _arguments[0];
+  if (_literalRemaining > _targetSize - _written) {
+    return fail("insert beyond the target");
+  }
+  if (_literalRemaining > 0) {
+    _state = STATE_LITERAL;
+  }
+  return finishOperation();
+}
+
+void PatchApplier::begin(SourceReader readSource, uint32_t sourceCapacity, TargetWriter writeTarget) {
+  _readSource = readSource;
+  _sourceCapacity = sourceCapacity;
+  _writeTarget = writeTarget;
+  _state = STATE_HEADER;
+  _headerLength = 0;
+  _targetSize = 0;
+  _written = 0;
+  _crc = 0;
+  _sourcePosition = 0;
+  _literalRemaining = 0;
+  _error = nullptr;
+}
+
+bool PatchApplier::copy(uint32_t offset, uint32_t length) {
+  if (offset > _sourceSize || length > _sourceSize - offset) {
+    return fail("copy beyond the source");
+  }
+  if (length > _targetSize - _written) {
+    return fail("copy beyond the target");
+  }
+  _sourcePosition = offset + length;
+  while (length > 0) {
+    size_t chunk = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+    if (!_readSource(offset, _copyBuffer, chunk)) {
+      return fail("could not read the source");
+    }
+    if (!output(_copyBuffer, chunk)) {
+      return false;
+    }
+    offset += chunk;
+    length -= chunk;
+  }
+  return finishOperation();
+}
+
+// Why the patch failed, or nullptr if it didn't
+const char* PatchApplier::error() {
+  return _error;
+}
+
+bool PatchApplier::fail(const char* reason) {
+  if (_state != STATE_FAILED) {
+    _error = reason;
+  }
+  _state = STATE_FAILED;
+  return false;
+}
+
+// Checks that the patch was made for the image we have, before anything gets written
+bool PatchApplier::finishHeader() {
+  if (memcmp(_header, PATCH_MAGIC, sizeof(PATCH_MAGIC)) != 0) {
+    return fail("not a patch");
+  }
+  _sourceSize = readUint32(_header + 4);
+  uint32_t sourceCrc = readUint32(_header + 8);
+  _targetSize = readUint32(_header + 12);
+  _targetCrc = readUint32(_header + 16);
+  if (_sourceSize > _sourceCapacity) {
+    return fail("source too large");
+  }
+  uint32_t crc = 0;
+  for (uint32_t offset = 0; offset < _sourceSize; offset += COPY_BUFFER_SIZE) {
+    size_t chunk = _sourceSize - offset < COPY_BUFFER_SIZE ? _sourceSize - offset : COPY_BUFFER_SIZE;
+    if (!_readSource(offset, _copyBuffer, chunk)) {
+      return fail("could not read the source");
+    }
+    crc = PersistentStore::crc32(_copyBuffer, chunk, crc);
+  }
+  if (crc != sourceCrc) {
+    return fail("made for another image");
+  }
+  _state = STATE_OPCODE;
+  return finishOperation();
+}
+
+// After each operation: if the target is complete, check it
+bool PatchApplier::finishOperation() {
+  if (_written < _targetSize || _literalRemaining > 0) {
+    return true;
+  }
+  if (_crc != _targetCrc) {
+    return fail("target CRC mismatch");
+  }
+  _state = STATE_COMPLETE;
+  return true;
+}
+
+// All of the target was written, and it has the right CRC
+bool PatchApplier::isComplete() {
+  return _state == STATE_COMPLETE;
+}
+
+bool PatchApplier::isFailed() {
+  return _state == STATE_FAILED;
+}
+
+// The last part only gets written if the target CRC matches, so a bad image never gets completed
+bool PatchApplier::output(const uint8_t* data, size_t size) {
+  uint32_t crc = PersistentStore::crc32(data, size, _crc);
+  if (_written + size == _targetSize && crc != _targetCrc) {
+    return fail("target CRC mismatch");
+  }
+  if (!_writeTarget(data, size)) {
+    return fail("could not write the target");
+  }
+  _crc = crc;
+  _written += size;
+  return true;
+}
+
+// Known after the header was processed, 0 before
+uint32_t PatchApplier::targetSize() {
+  return _targetSize;
+}
+
+// Feed the next part of the patch. Returns false if the patch failed.
+bool PatchApplier::write(const uint8_t* data, size_t size) {
+  const uint8_t* end = data + size;
+  while (data < end) {
+    switch (_state) {
+      case STATE_HEADER:
+        _header[_headerLength++] = *data++;
+        if (_headerLength == HEADER_SIZE && !finishHeader()) {
+          return false;
+        }
+        break;
+      case STATE_OPCODE:
+        _opcode = *data++;
+        if (_opcode != OPCODE_COPY && _opcode != OPCODE_INSERT) {
+          return fail("unknown operation");
+        }
+        _argumentCount = _opcode == OPCODE_COPY ? 2 : 1;
+        _argumentIndex = 0;
+        _arguments[0] = 0;
+        _shift = 0;
+        _state = STATE_ARGUMENT;
+        break;
+      case STATE_ARGUMENT: {
+        uint8_t value = *data++;
+        if (_shift > MAX_VARINT_SHIFT) {
+          return fail("varint too long");
+        }
+        _arguments[_argumentIndex] |= static_cast<uint32_t>(value & 0x7F) << _shift;
+        _shift += 7;
+        if (value & 0x80) {
+          break;
+        }
+        if (++_argumentIndex < _argumentCount) {
+          _arguments[_argumentIndex] = 0;
+          _shift = 0;
+          break;
+        }
+        _state = STATE_OPCODE;
+        if (!applyOperation()) {
+          return false;
+        }
+        break;
+      }
+      case STATE_LITERAL: {
+        size_t available = end - data;
+        size_t chunk = _literalRemaining < available ? _literalRemaining : available;
+        if (!output(data, chunk)) {
+          return false;
+        }
+        data += chunk;
+        _literalRemaining -= chunk;
+        if (_literalRemaining == 0) {
+          _state = STATE_OPCODE;
+          if (!finishOperation()) {
+            return false;
+          }
+        }
+        break;
+      }
+      case STATE_COMPLETE:
+        return fail("data after the end");
+      default:
+        return false;
+    }
+  }
+  return true;
+}
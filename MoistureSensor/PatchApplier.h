@@ -0,0 +1,73 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class rebuilds a firmware image from the current one and a binary patch, so an update only needs to download
+// what changed. It is fed the patch in chunks as it arrives (write), reads the current image via a callback and
+// writes the new image via another one, so it doesn't need memory for either image and has no hardware dependencies.
+// Patch format (integers little endian):
+//   header: "MSP1", source size, CRC32 of the source, target size, CRC32 of the target (each 32 bits)
+//   then operations until the target is complete:
+//     0x01 COPY:   zigzag varint offset in the source relative to the end of the previous copy, varint length
+//     0x02 INSERT: varint length, followed by that many bytes
+// Varints are unsigned LEB128, the CRC32 is the usual one (as in zlib). The source CRC is checked before anything gets
+// written, so a patch for another image fails right away. The target CRC is checked before the last part gets written,
+// so the writer never sees a complete but bad image.
+
+#ifndef HEADER_PATCHAPPLIER
+#define HEADER_PATCHAPPLIER
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+class PatchApplier {
+public:
+    typedef std::function<bool(uint32_t offset, uint8_t* data, size_t size)> SourceReader;
+    typedef std::function<bool(const uint8_t* data, size_t size)> TargetWriter;
+    static const size_t HEADER_SIZE = 20;
+    void begin(SourceReader readSource, uint32_t sourceCapacity, TargetWriter writeTarget);
+    const char* error();
+    bool isComplete();
+    bool isFailed();
+    uint32_t targetSize();
+    bool write(const uint8_t* data, size_t size);
+private:
+    enum State { STATE_HEADER, STATE_OPCODE, STATE_ARGUMENT, STATE_LITERAL, STATE_COMPLETE, STATE_FAILED };
+    static const size_t COPY_BUFFER_SIZE = 256;
+    static const int MAX_ARGUMENTS = 2;
+    SourceReader _readSource;
+    TargetWriter _writeTarget;
+    uint32_t _sourceCapacity;
+    State _state;
+    uint8_t _header[HEADER_SIZE];
+    size_t _headerLength;
+    uint32_t _sourceSize;
+    uint32_t _targetSize;
+    uint32_t _targetCrc;
+    uint32_t _written;
+    uint32_t _crc;
+    uint32_t _sourcePosition;
+    uint8_t _opcode;
+    uint32_t _arguments[MAX_ARGUMENTS];
+    int _argumentCount;
+    int _argumentIndex;
+    int _shift;
+    uint32_t _literalRemaining;
+    uint8_t _copyBuffer[COPY_BUFFER_SIZE];
+    const char* _error;
+    bool applyOperation();
+    bool copy(uint32_t offset, uint32_t length);
+    bool fail(const char* reason);
+    bool finishHeader();
+    bool finishOperation();
+    bool output(const uint8_t* data, size_t size);
+};
+#endif
@@ -0,0 +1,192 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <string.h>
+#include "PersistentStore.h"
+
+// Change when the image header or the record header layout changes
+const uint32_t IMAGE_MAGIC = 0x4d530001;
+const size_t RECORD_HEADER_SIZE = 4;
+const uint8_t FLAG_DURABLE = 0x01;
+
+static size_t align4(size_t size) {
+  return (size + 3) & ~static_cast<size_t>(3);
+}
+
+uint8_t* PersistentStore::bytes() {
+  return reinterpret_cast<uint8_t*>(_image);
+}
+
+void PersistentStore::begin(Storage* fastStorage, Storage* durableStorage) {
+  _fastStorage = fastStorage;
+  _durableStorage = durableStorage;
+  _coldStart = !loadFrom(_fastStorage);
+  if (_coldStart) {
+    if (!loadFrom(_durableStorage)) {
+      clear();
+    }
+    // make sure the next wake finds a valid image in fast storage
+    _fastDirty = true;
+  }
+}
+
+void PersistentStore::clear() {
+  memset(_image, 0, IMAGE_SIZE);
+  _length = HEADER_SIZE;
+}
+
+bool PersistentStore::commit() {
+  if (!_fastDirty && !_durableDirty) {
+    return true;
+  }
+  seal();
+  bool success = true;
+  if (_fastStorage != nullptr) {
+    success = _fastStorage->write(_image, IMAGE_SIZE);
+    _fastDirty = !success;
+  }
+  if (_durableDirty && _durableStorage != nullptr) {
+    bool durableSuccess = writeDurable();
+    _durableDirty = !durableSuccess;
+    success = success && durableSuccess;
+  }
+  return success;
+}
+
+// True if the next commit writes to durable storage
+bool PersistentStore::hasDurableChanges() {
+  return _durableDirty && _durableStorage != nullptr;
+}
+
+// Only durable records go to flash. The others change too often, and some (like TLS sessions) must not end up there.
+bool PersistentStore::writeDurable() {
+  uint32_t durableImage[IMAGE_SIZE / sizeof(uint32_t)] = { 0 };
+  uint8_t* target = reinterpret_cast<uint8_t*>(durableImage);
+  size_t length = HEADER_SIZE;
+  size_t offset = HEADER_SIZE;
+  while (offset + RECORD_HEADER_SIZE <= _length) {
+    uint8_t* record = bytes() + offset;
+    uint16_t recordSize;
+    memcpy(&recordSize, record + 2, sizeof(recordSize));
+    size_t totalSize = RECORD_HEADER_SIZE + align4(recordSize);
+    if (record[1] & FLAG_DURABLE) {
+      memcpy(target + length, record, totalSize);
+      length += totalSize;
+    }
+    offset += totalSize;
+  }
+  durableImage[0] = IMAGE_MAGIC;
+  durableImage[1] = length;
+  durableImage[2] = crc32(target + HEADER_SIZE, length - HEADER_SIZE);
+  return _durableStorage->write(durableImage, IMAGE_SIZE);
+}
+
+uint32_t PersistentStore::crc32(const void* data, size_t size, uint32_t crc) {
+  const uint8_t* current = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  while (size-- > 0) {
+    crc ^= *current++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// Returns the offset of the record header, or 0 if the record doesn't exist (offset 0 is the image header)
+size_t PersistentStore::find(uint8_t recordId) {
+  size_t offset = HEADER_SIZE;
+  while (offset + RECORD_HEADER_SIZE <= _length) {
+    uint8_t* record = bytes() + offset;
+    if (record[0] == recordId) {
+      return offset;
+    }
+    uint16_t recordSize;
+    memcpy(&recordSize, record + 2, sizeof(recordSize));
+    offset += RECORD_HEADER_SIZE + align4(recordSize);
+  }
+  return 0;
+}
+
+bool PersistentStore::isColdStart() {
+  return _coldStart;
+}
+
+bool PersistentStore::load(uint8_t recordId, void* data, size_t size) {
+  size_t offset = find(recordId);
+  if (offset == 0) {
+    return false;
+  }
+  uint16_t recordSize;
+  memcpy(&recordSize, bytes() + offset + 2, sizeof(recordSize));
+  if (recordSize != size) {
+    return false;
+  }
+  memcpy(data, bytes() + offset + RECORD_HEADER_SIZE, size);
+  return true;
+}
+
+bool PersistentStore::loadFrom(Storage* storage) {
+  if (storage == nullptr || storage->capacity() < IMAGE_SIZE || !storage->read(_image, IMAGE_SIZE)) {
+    return false;
+  }
+  _length = _image[1];
+  if (_image[0] != IMAGE_MAGIC || _length < HEADER_SIZE || _length > IMAGE_SIZE) {
+    return false;
+  }
+  return _image[2] == crc32(bytes() + HEADER_SIZE, _length - HEADER_SIZE);
+}
+
+bool PersistentStore::save(uint8_t recordId, const void* data, size_t size, bool durable) {
+  size_t offset = find(recordId);
+  uint8_t* record = bytes() + offset;
+  if (offset != 0) {
+    uint16_t recordSize;
+    memcpy(&recordSize, record + 2, sizeof(recordSize));
+    if (recordSize == size) {
+      if (memcmp(record + RECORD_HEADER_SIZE, data, size) == 0 && (!durable || (record[1] & FLAG_DURABLE))) {
+        return true;
+      }
+    } else {
+      // layout changed: drop the old record and append the new one
+      size_t next = offset + RECORD_HEADER_SIZE + align4(recordSize);
+      memmove(record, bytes() + next, _length - next);
+      _length -= next - offset;
+      offset = 0;
+    }
+  }
+  if (offset == 0) {
+    if (_length + RECORD_HEADER_SIZE + align4(size) > IMAGE_SIZE) {
+      return false;
+    }
+    offset = _length;
+    record = bytes() + offset;
+    uint16_t recordSize = size;
+    record[0] = recordId;
+    record[1] = 0;
+    memcpy(record + 2, &recordSize, sizeof(recordSize));
+    memset(record + RECORD_HEADER_SIZE, 0, align4(size));
+    _length += RECORD_HEADER_SIZE + align4(size);
+  }
+  // Once durable, a record stays durable. Saving it as not durable only updates the flash copy along with
+  // the next durable save, so state that is durable now and then (like the drift) doesn't write flash every wake.
+  record[1] |= durable ? FLAG_DURABLE : 0;
+  memcpy(record + RECORD_HEADER_SIZE, data, size);
+  _fastDirty = true;
+  _durableDirty = _durableDirty || durable;
+  return true;
+}
+
+void PersistentStore::seal() {
+  _image[0] = IMAGE_MAGIC;
+  _image[1] = _length;
+  _image[2] = crc32(bytes() + HEADER_SIZE, _length - HEADER_SIZE);
+}
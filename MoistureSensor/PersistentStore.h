@@ -0,0 +1,67 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class keeps state across deep sleep so modules don't need to go to flash on every wake.
+// It holds an image of small records in RAM, each identified by a record ID. The image is protected by a CRC
+// and written to fast storage (RTC memory) at commit, which happens just before deep sleep.
+// If the fast storage doesn't contain a valid image (i.e. after a cold boot or an OTA update), it loads the copy
+// from durable storage (flash). That copy only contains the records saved as durable, and it is only rewritten
+// when one of those changed. So frequently changing state (like the next run time) doesn't wear the flash,
+// and secrets like TLS sessions never end up there.
+// Records are matched on ID and size, so a changed record layout after a firmware update reads as absent.
+
+#ifndef HEADER_PERSISTENTSTORE
+#define HEADER_PERSISTENTSTORE
+
+#include "Storage.h"
+
+static const uint8_t RECORD_SCHEDULER = 1;
+static const uint8_t RECORD_DRIFT = 2;
+static const uint8_t RECORD_ANNOUNCEMENT = 3;
+static const uint8_t RECORD_MEASUREMENTS = 4;
+static const uint8_t RECORD_WIFI = 5;
+static const uint8_t RECORD_TLS_SESSIONS = 6;
+static const uint8_t RECORD_FIRMWARE = 7;
+static const uint8_t RECORD_WAKE_METRICS = 8;
+static const uint8_t RECORD_WAKE_PHASES = 9;
+static const uint8_t RECORD_REPORTED = 10;
+static const uint8_t RECORD_INTERVAL_POLICY = 11;
+static const uint8_t RECORD_CONFIG = 12;
+static const uint8_t RECORD_LOG = 13;
+
+class PersistentStore {
+public:
+    void begin(Storage* fastStorage, Storage* durableStorage);
+    bool commit();
+    bool hasDurableChanges();
+    bool isColdStart();
+    bool load(uint8_t recordId, void* data, size_t size);
+    bool save(uint8_t recordId, const void* data, size_t size, bool durable = false);
+    static uint32_t crc32(const void* data, size_t size, uint32_t crc = 0);
+private:
+    static const size_t IMAGE_SIZE = 512;
+    static const size_t HEADER_SIZE = 12;
+    Storage* _fastStorage = nullptr;
+    Storage* _durableStorage = nullptr;
+    uint32_t _image[IMAGE_SIZE / sizeof(uint32_t)];
+    size_t _length = HEADER_SIZE;
+    bool _coldStart = true;
+    bool _fastDirty = false;
+    bool _durableDirty = false;
+
+    uint8_t* bytes();
+    void clear();
+    size_t find(uint8_t recordId);
+    bool loadFrom(Storage* storage);
+    void seal();
+    bool writeDurable();
+};
+#endif
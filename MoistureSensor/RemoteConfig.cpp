@@ -0,0 +1,145 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <ESP.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MeasurementBuffer.h"
+#include "RemoteConfig.h"
+
+// Same order as SamplesFormat, and the same names as SensorManager::samplesFormatName
+const char* FORMAT_NAMES[] = { "csv", "packed10", "delta" };
+const int FORMAT_COUNT = 3;
+const int MESSAGE_SIZE = 160;
+const long MIN_INTERVAL_SECONDS = 60;
+// Deep sleep can't last much longer than 3.5 hours (ESP.deepSleepMax() differs a little per chip), and an interval
+// should be one sleep
+const long MAX_INTERVAL_SECONDS = 12600;
+const long MAX_SENSOR_COUNT = 8;
+const long MAX_SAMPLE_COUNT = 16;
+
+// Returns whether the configuration changed. Only then it gets saved.
+bool RemoteConfig::apply(const char* message) {
+  char buffer[MESSAGE_SIZE];
+  if (strlen(message) >= MESSAGE_SIZE) {
+    Serial.println("Ignoring too long configuration");
+    return false;
+  }
+  strcpy(buffer, message);
+  Values values = _defaults;
+  char* context;
+  for (char* pair = strtok_r(buffer, ",", &context); pair != nullptr; pair = strtok_r(nullptr, ",", &context)) {
+    char* separator = strchr(pair, '=');
+    if (separator == nullptr) {
+      Serial.printf("Ignoring configuration: no value for '%s'\n", pair);
+      return false;
+    }
+    *separator = 0;
+    char* valueText = separator + 1;
+    long value = -1;
+    if (strcmp(pair, "format") == 0) {
+      for (int i = 0; i < FORMAT_COUNT; i++) {
+        if (strcmp(valueText, FORMAT_NAMES[i]) == 0) {
+          value = i;
+        }
+      }
+    } else {
+      char* end;
+      value = strtol(valueText, &end, 10);
+      if (end == valueText || *end != 0) {
+        value = -1;
+      }
+    }
+    if (!parse(pair, value, &values)) {
+      Serial.printf("Ignoring configuration: invalid '%s=%s'\n", pair, valueText);
+      return false;
+    }
+  }
+  if (values.maxIntervalSeconds < values.intervalSeconds || values.heartbeatMinutes * 60L < values.intervalSeconds) {
+    Serial.println("Ignoring configuration: inconsistent intervals");
+    return false;
+  }
+  // the measurements of a batch wait in the measurement buffer, and the entries get bigger with more sensors
+  if (values.batchSize > MeasurementBuffer::capacityFor(values.sensorCount)) {
+    Serial.printf("Ignoring configuration: a batch of %u doesn't fit with %u sensors\n", values.batchSize, values.sensorCount);
+    return false;
+  }
+  if (memcmp(&values, &_values, sizeof(values)) == 0) {
+    return false;
+  }
+  _values = values;
+  _store->save(RECORD_CONFIG, &_values, sizeof(_values), true);
+  return true;
+}
+
+void RemoteConfig::begin(PersistentStore* store, const Values& defaults) {
+  _store = store;
+  _defaults = defaults;
+  if (!_store->load(RECORD_CONFIG, &_values, sizeof(_values))) {
+    _values = _defaults;
+  }
+}
+
+// The effective configuration in the same format as the message
+void RemoteConfig::format(char* payload, size_t size) {
+  snprintf(payload, size, "interval=%u,max-interval=%u,heartbeat=%lu,wet=%lu,sensors=%u,samples=%u,batch=%u,threshold=%u,"
+    "format=%s,adaptive=%d,on-change=%d,comment=%d",
+    _values.intervalSeconds, _values.maxIntervalSeconds, static_cast<unsigned long>(heartbeatSeconds()), 
+    static_cast<unsigned long>(wetResistanceOhm()), _values.sensorCount, _values.sampleCount, _values.batchSize, 
+    _values.thresholdPercent, FORMAT_NAMES[_values.samplesFormat < FORMAT_COUNT ? _values.samplesFormat : 0], 
+    _values.adaptiveInterval, _values.reportOnChange, _values.publishComment);
+}
+
+uint32_t RemoteConfig::heartbeatSeconds() {
+  return _values.heartbeatMinutes * 60UL;
+}
+
+// Sets the value if the key is known and the value is in range
+bool RemoteConfig::parse(const char* key, long value, Values* values) {
+  auto inRange = [value](long minimum, long maximum) { return value >= minimum && value <= maximum; };
+  if (strcmp(key, "interval") == 0 && inRange(MIN_INTERVAL_SECONDS, MAX_INTERVAL_SECONDS)) {
+    values->intervalSeconds = value;
+  } else if (strcmp(key, "max-interval") == 0 && inRange(MIN_INTERVAL_SECONDS, MAX_INTERVAL_SECONDS)) {
+    values->maxIntervalSeconds = value;
+  } else if (strcmp(key, "heartbeat") == 0 && inRange(60, UINT16_MAX * 60L)) {
+    values->heartbeatMinutes = value / 60;
+  } else if (strcmp(key, "wet") == 0 && inRange(1000, UINT16_MAX * 1000L)) {
+    values->wetKiloOhm = value / 1000;
+  } else if (strcmp(key, "sensors") == 0 && inRange(1, MAX_SENSOR_COUNT)) {
+    values->sensorCount = value;
+  } else if (strcmp(key, "samples") == 0 && inRange(1, MAX_SAMPLE_COUNT)) {
+    values->sampleCount = value;
+  } else if (strcmp(key, "batch") == 0 && inRange(1, UINT8_MAX)) {
+    values->batchSize = value;
+  } else if (strcmp(key, "threshold") == 0 && inRange(1, 100)) {
+    values->thresholdPercent = value;
+  } else if (strcmp(key, "format") == 0 && inRange(0, FORMAT_COUNT - 1)) {
+    values->samplesFormat = value;
+  } else if (strcmp(key, "adaptive") == 0 && inRange(0, 1)) {
+    values->adaptiveInterval = value;
+  } else if (strcmp(key, "on-change") == 0 && inRange(0, 1)) {
+    values->reportOnChange = value;
+  } else if (strcmp(key, "comment") == 0 && inRange(0, 1)) {
+    values->publishComment = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const RemoteConfig::Values& RemoteConfig::values() {
+  return _values;
+}
+
+uint32_t RemoteConfig::wetResistanceOhm() {
+  return _values.wetKiloOhm * 1000UL;
+}
@@ -0,0 +1,58 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class holds the settings that can be changed over MQTT, so the fleet can be retuned without a new firmware image.
+// The message is a comma separated list of key=value pairs, e.g. "interval=1800,batch=2,format=delta". Keys that are
+// absent get the default (i.e. the compile time value), so an empty message resets everything. Keys:
+//   interval, max-interval, heartbeat (seconds), wet (ohm), sensors, samples (per sensor), batch, threshold (percent),
+//   format (csv, packed10 or delta), adaptive, on-change, comment (0 or 1).
+// A message with an unknown key or a value out of range is ignored as a whole. Intervals go up to 3.5 hours (about the
+// longest deep sleep), and a batch must fit in the MeasurementBuffer with the given number of sensors.
+// The values are cached in the persistent store as a durable record, so later wakes (and cold boots) don't need the
+// network, and flash only gets written when the configuration changes. A change takes effect on the next wake.
+// The firmware URL is not part of it: strings don't fit in the RTC memory budget.
+
+#ifndef HEADER_REMOTECONFIG
+#define HEADER_REMOTECONFIG
+
+#include <stddef.h>
+#include "PersistentStore.h"
+
+class RemoteConfig {
+public:
+    // Compact, as it lives in RTC memory. Converted to the usual units by the accessors.
+    struct Values {
+        uint16_t intervalSeconds;
+        uint16_t maxIntervalSeconds;
+        uint16_t heartbeatMinutes;
+        uint16_t wetKiloOhm;
+        uint8_t sensorCount;
+        uint8_t sampleCount;
+        uint8_t batchSize;
+        uint8_t thresholdPercent;
+        uint8_t samplesFormat;
+        bool adaptiveInterval;
+        bool reportOnChange;
+        bool publishComment;
+    };
+    bool apply(const char* message);
+    void begin(PersistentStore* store, const Values& defaults);
+    void format(char* payload, size_t size);
+    uint32_t heartbeatSeconds();
+    const Values& values();
+    uint32_t wetResistanceOhm();
+private:
+    PersistentStore* _store;
+    Values _defaults;
+    Values _values;
+    static bool parse(const char* key, long value, Values* values);
+};
+#endif
@@ -0,0 +1,27 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <ESP.h>
+#include "RtcStorage.h"
+
+const size_t RTC_USER_MEMORY_SIZE = 512;
+
+size_t RtcStorage::capacity() {
+  return RTC_USER_MEMORY_SIZE;
+}
+
+bool RtcStorage::read(uint32_t* data, size_t size) {
+  return ESP.rtcUserMemoryRead(0, data, size);
+}
+
+bool RtcStorage::write(const uint32_t* data, size_t size) {
+  return ESP.rtcUserMemoryWrite(0, const_cast<uint32_t*>(data), size);
+}
@@ -0,0 +1,27 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Storage backend on the 512 bytes of RTC user memory. It survives deep sleep and resets, but not a power loss.
+// Note that an OTA update uses the first 128 bytes to pass the eboot command, so the image gets corrupted
+// after an update. PersistentStore detects that via its CRC and falls back to the flash copy.
+
+#ifndef HEADER_RTCSTORAGE
+#define HEADER_RTCSTORAGE
+
+#include "Storage.h"
+
+class RtcStorage : public Storage {
+public:
+    size_t capacity() override;
+    bool read(uint32_t* data, size_t size) override;
+    bool write(const uint32_t* data, size_t size) override;
+};
+#endif
@@ -10,93 +10,426 @@
 //    See the License for the specific language governing permissions and limitations under the License.
 
 #include <time.h>
+#include <sys/time.h>
+#include <math.h>
 #include <ESP.h>
-#include <fs.h>
+#include <coredecls.h>
 
 #include "Scheduler.h"
 
 const time_t NON_SYNCED_TIME_UPPER_LIMIT = 16 * 3600;
-const char* NEXT_RUN_TIMESTAMP_FILE = "/nextrun_timestamp.txt";
 
-const long STARTUP_TIME_SECONDS = 15;
- // MAX_WAIT_SECONDS_WITHOUT_SLEEP must be larger than STARTUP_TIME_SECONDS
+// MAX_WAIT_SECONDS_WITHOUT_SLEEP must be larger than the startup time (max 40 seconds, see DriftEstimator)
 const long MAX_WAIT_SECONDS_WITHOUT_SLEEP = 60;
+// deepSleep is not very accurate, and the startup time varies. DriftEstimator learns both per device.
+// We aim to be ready this many seconds before the next run.
+const double WAKE_MARGIN_SECONDS = 3.0;
+// Deep sleep with 0 means sleeping forever, so we need a minimum
+const double MIN_SLEEP_SECONDS = 0.1;
+// Below this, going into light sleep and back costs more than it saves
+const double MIN_LIGHT_SLEEP_SECONDS = 0.5;
+// In modem sleep the radio only wakes for beacons, so polling more often than this doesn't help
+const unsigned long MODEM_SLEEP_POLL_MILLIS = 100;
 
-// deepSleep is not very accurate. Empirically determined correction factor
-const double TIME_CORRECTION_FACTOR = 1.062;
+// Sync with NTP at least every so many wakes, or earlier if the estimated clock error gets too large
+const int NTP_SYNC_INTERVAL_WAKES = 8;
+const long MAX_CLOCK_ERROR_SECONDS = 60;
+// After this many failures in a row, the backoff stops growing (i.e. at 32 wakes)
+const uint8_t MAX_BACKOFF_FAILURES = 6;
 
-// Sync time from the Internet (i.e. do this after wifi has become active)
-void Scheduler::begin(long measureIntervalSeconds) {
-  bool SPIFFSmounted = SPIFFS.begin();
-  if (!SPIFFSmounted) {
-    Serial.println("Could not mount SPIFFS");
+// Skips the rest of this wake. If the current run didn't happen yet, it is skipped too, so we don't wake up right away.
+void Scheduler::abortWake(bool radioNeeded) {
+  updateSyncState();
+  long interval = intervalSeconds();
+  if (!isClockValid()) {
+    deepSleep(interval, radioNeeded);
   }
-  _measureIntervalSeconds = measureIntervalSeconds;
-  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
   time_t now = time(nullptr);
-  Serial.print("Current time: ");
-  // if current time epoch is very low, the ntp time has not kicked in yet
-  while (now < NON_SYNCED_TIME_UPPER_LIMIT) {
-    delay(500);
-    Serial.print(".");
-    now = time(nullptr);
+  time_t nextRun = _state.nextRunTimestamp;
+  // no usable run time, so start a new series
+  if (nextRun < now - interval) {
+    nextRun = firstRunAfter(now);
+  }
+  while (nextRun - now <= MAX_WAIT_SECONDS_WITHOUT_SLEEP) {
+    nextRun += interval;
+  }
+  _state.nextRunTimestamp = nextRun;
+  Serial.printf("Aborting the wake, next run at %s", ctime(&nextRun));
+  deepSleep(nextRun - currentTime() - _drift.startupSeconds() - WAKE_MARGIN_SECONDS, radioNeeded);
+}
+
+// Restore the clock from the time we went into deep sleep plus the time we slept. No network needed.
+void Scheduler::begin(PersistentStore* store, long measureIntervalSeconds) {
+  _store = store;
+  _measureIntervalSeconds = measureIntervalSeconds;
+  loadState();
+  DriftEstimator::State driftState;
+  if (_store->load(RECORD_DRIFT, &driftState, sizeof(driftState))) {
+    _drift.setState(driftState);
+  }
+  settimeofday_cb([this](bool fromSntp) {
+    if (fromSntp) {
+      _syncMillis = millis();
+      _syncTime = currentTime();
+      _timeSynced = true;
+    }
+  });
+  _wokeFromDeepSleep = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+  // any other reset starts with the radio on
+  _radioEnabled = !_wokeFromDeepSleep || _state.radioOnWake;
+  if (_wokeFromDeepSleep && _state.sleepStartTime > NON_SYNCED_TIME_UPPER_LIMIT) {
+    double restoredTime = _state.sleepStartTime + _state.sleepSeconds + millis() / 1000.0;
+    struct timeval restored = { static_cast<time_t>(restoredTime), static_cast<suseconds_t>(fmod(restoredTime, 1.0) * 1e6) };
+    settimeofday(&restored, nullptr);
+    _state.clockErrorSeconds += _state.sleepSeconds * _drift.uncertainty();
+    _state.wakesSinceSync++;
+    printTime("Restored time");
+  } else {
+    _state.clockErrorSeconds = MAX_CLOCK_ERROR_SECONDS + 1;
+    // we can't tell how long we were off, so drift measurement needs a new starting point
+    _state.anchorTime = 0;
+  }
+  if (_wokeFromDeepSleep && _state.radioFailures > 0 && _state.wakesSinceRadioFailure < UINT8_MAX) {
+    _state.wakesSinceRadioFailure++;
+  }
+  _state.sleepStartTime = 0;
+  if (_wokeFromDeepSleep && !isClockValid() && !isRadioRetryDue()) {
+    sleepUntilRadioRetry();
+  }
+}
+
+int Scheduler::backoffWakes() {
+  if (_state.radioFailures == 0) {
+    return 0;
+  }
+  uint8_t exponent = _state.radioFailures < MAX_BACKOFF_FAILURES ? _state.radioFailures : MAX_BACKOFF_FAILURES;
+  return 1 << (exponent - 1);
+}
+
+double Scheduler::currentTime() {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  return now.tv_sec + now.tv_usec / 1e6;
+}
+
+float Scheduler::driftCorrectionFactor() {
+  updateSyncState();
+  return _drift.correctionFactor();
+}
+
+bool Scheduler::isClockValid() {
+  return time(nullptr) > NON_SYNCED_TIME_UPPER_LIMIT;
+}
+
+// A missing access point or broker shouldn't drain the battery, so after a failure we skip ever more wakes
+bool Scheduler::isRadioRetryDue() {
+  return _state.wakesSinceRadioFailure >= backoffWakes();
+}
+
+// The anchor is the time of the last sync, and it is only missing when the clock error is too large anyway
+bool Scheduler::isTimeSyncDue() {
+  if (!isClockValid() || _state.clockErrorSeconds > MAX_CLOCK_ERROR_SECONDS) {
+    return true;
   }
+  if (_timeSyncSeconds == 0) {
+    return _state.wakesSinceSync >= NTP_SYNC_INTERVAL_WAKES;
+  }
+  return currentTime() - _state.anchorTime >= _timeSyncSeconds;
+}
+
+// Forced light sleep stops the CPU with the radio off until the timer fires. The timer runs on the same
+// RTC clock as deep sleep, so it gets the same drift correction. The system clock may not run while the CPU
+// is stopped; if it hardly moved, we add the time we slept.
+void Scheduler::lightSleep(double sleepSeconds) {
+  if (sleepSeconds < MIN_LIGHT_SLEEP_SECONDS) {
+    return;
+  }
+  double startTime = currentTime();
+  unsigned long startMillis = millis();
+  uint64_t requestedMicros = _drift.requestedMicrosFor(sleepSeconds);
+  Serial.printf("Light sleep for %.1f seconds\n", sleepSeconds);
+  Serial.flush();
+  if (!ESP.forcedLightSleepBegin(requestedMicros, nullptr)) {
+    Serial.println("Could not enter light sleep");
+    return;
+  }
+  // the CPU stops during this delay, and the timer ends it
+  delay(requestedMicros / 1000 + 1);
+  ESP.forcedLightSleepEnd();
+  if (currentTime() - startTime < sleepSeconds / 2) {
+    double restoredTime = startTime + sleepSeconds;
+    struct timeval restored = { static_cast<time_t>(restoredTime), static_cast<suseconds_t>(fmod(restoredTime, 1.0) * 1e6) };
+    settimeofday(&restored, nullptr);
+  }
+  // The drift measurement takes all real time that millis() didn't see as deep sleep. Whatever part of the
+  // light sleep millis() missed must count as awake time, or it inflates the measured deep sleep.
+  if (_state.anchorTime > 0) {
+    _state.anchorAwakeSeconds += currentTime() - startTime - (millis() - startMillis) / 1000.0;
+  }
+}
+
+void Scheduler::loadState() {
+  if (!_store->load(RECORD_SCHEDULER, &_state, sizeof(_state))) {
+    _state = SchedulerState();
+  }
+}
+
+void Scheduler::printTime(const char* label) {
+  time_t now = time(nullptr);
   struct tm timeinfo;
   gmtime_r(&now, &timeinfo);
-  Serial.print(asctime(&timeinfo));
+  Serial.printf("%s: %s", label, asctime(&timeinfo));
 }
 
-// Read time stamp (epoch) from file
-time_t Scheduler::readTimestamp() {
-  File file = SPIFFS.open(NEXT_RUN_TIMESTAMP_FILE, "r");
-  if (!file) {
-    return 0;
+void Scheduler::saveDrift(bool durable) {
+  if (!_store->save(RECORD_DRIFT, &_drift.state(), sizeof(DriftEstimator::State), durable)) {
+    Serial.println("Could not save drift state");
+  }
+}
+
+// The state changes every run, so we keep it out of flash.
+void Scheduler::saveState() {
+  if (!_store->save(RECORD_SCHEDULER, &_state, sizeof(_state))) {
+    Serial.println("Could not save scheduler state");
+  }
+}
+
+// We woke up just before the next run, so this tells us how long startup took
+void Scheduler::measureStartup() {
+  if (_wokeFromDeepSleep && !_startupMeasured) {
+    _drift.addStartupSample(millis() / 1000.0);
+    _startupMeasured = true;
   }
-  time_t returnValue = file.readStringUntil('\n').toInt();
-  file.close();
-  return returnValue;  
 }
 
-// Write time stamp (epoch) to file
-void Scheduler::writeTimestamp(time_t timestamp) {
-  File file = SPIFFS.open(NEXT_RUN_TIMESTAMP_FILE, "w");
-  if (!file) {
-      Serial.printf("open file '%s' failed\n", NEXT_RUN_TIMESTAMP_FILE);
+// If we woke up for the next run, it can start right away instead of waiting for it. That way the measurement
+// overlaps with connecting the radio, and the startup time we learn only covers the time until we can measure.
+bool Scheduler::startRunIfDue() {
+  if (!isClockValid() || getNextRunTimestamp() - time(nullptr) > MAX_WAIT_SECONDS_WITHOUT_SLEEP) {
+    return false;
   }
-  file.println(timestamp);
-  file.close();
-  return;
+  measureStartup();
+  return true;
 }
 
-void Scheduler::waitForNextRun(std::function<void(void)> callback) {
+// Sync time from the Internet if needed (i.e. do this after wifi has become active).
+// SNTP runs in the background, so this only blocks if we have no usable clock at all.
+// While waiting, it calls the callback so other work can continue. If we have no clock, we wait up to the timeout.
+bool Scheduler::startTimeSync(std::function<void(void)> callback, unsigned long timeoutMillis) {
+  if (!isTimeSyncDue() && _timeSyncSeconds == 0) {
+    return true;
+  }
+  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+  if (isClockValid()) {
+    return true;
+  }
+  Serial.print("Waiting for NTP");
+  unsigned long startMillis = millis();
+  unsigned long dotMillis = startMillis;
+  while (!isClockValid() && millis() - startMillis < timeoutMillis) {
+    callback();
+    delay(10);
+    if (millis() - dotMillis >= 100) {
+      Serial.print(".");
+      dotMillis = millis();
+    }
+  }
+  Serial.println();
+  if (!isClockValid()) {
+    return false;
+  }
+  printTime("Current time");
+  return true;
+}
+
+// Once NTP has synced, we know how much real time passed since the previous sync. Subtracting the time
+// we were awake (measured by the crystal, which is accurate) gives the real sleep time, which we compare
+// with the sleep time we requested.
+void Scheduler::updateSyncState() {
+  if (!_timeSynced) {
+    return;
+  }
+  _timeSynced = false;
+  printTime("Time synced");
+  if (_state.anchorTime > 0 && _state.anchorRequestedSeconds > 0) {
+    double actualSleepSeconds = _syncTime - _state.anchorTime - _state.anchorAwakeSeconds - _syncMillis / 1000.0;
+    if (_drift.addSleepSample(_state.anchorRequestedSeconds, actualSleepSeconds)) {
+      Serial.printf("Requested %.1f s, slept %.1f s. Correction factor now %.4f\n", 
+        _state.anchorRequestedSeconds, actualSleepSeconds, _drift.correctionFactor());
+      // only changes once per sync, so it's cheap enough to keep in flash as well
+      saveDrift(true);
+    }
+  }
+  _state.anchorTime = _syncTime;
+  _state.anchorRequestedSeconds = 0;
+  _state.anchorAwakeSeconds = -(_syncMillis / 1000.0);
+  _state.clockErrorSeconds = 0;
+  _state.wakesSinceSync = 0;
+}
+
+void Scheduler::deepSleep(double sleepSeconds, bool radioNeeded) {
+  double now = currentTime();
+  if (sleepSeconds < MIN_SLEEP_SECONDS) {
+    sleepSeconds = MIN_SLEEP_SECONDS;
+  }
+  if (_sleepHandler != nullptr) {
+    _sleepHandler();
+  }
+  uint64_t requestedMicros = _drift.requestedMicrosFor(sleepSeconds);
+  // longer than the timer can take is undefined, so we wake up early instead
+  uint64_t maxMicros = ESP.deepSleepMax();
+  if (requestedMicros > maxMicros) {
+    sleepSeconds *= static_cast<double>(maxMicros) / requestedMicros;
+    requestedMicros = maxMicros;
+  }
+  _state.sleepStartTime = now;
+  _state.sleepSeconds = sleepSeconds;
+  _state.radioOnWake = radioNeeded;
+  if (_state.anchorTime > 0) {
+    _state.anchorRequestedSeconds += requestedMicros / 1e6;
+    _state.anchorAwakeSeconds += millis() / 1000.0;
+  }
+  saveState();
+  saveDrift(false);
+  _store->commit();
+  ESP.deepSleep(requestedMicros, radioNeeded ? WAKE_RF_DEFAULT : WAKE_RF_DISABLED);
+}
+
+// The radio is switched off during wakes that only measure. If we do need it (i.e. to report something urgent),
+// we need a reboot with the radio on.
+void Scheduler::restartWithRadio() {
+  Serial.println("Restarting with radio");
+  updateSyncState();
+  deepSleep(MIN_SLEEP_SECONDS, true);
+}
+
+void Scheduler::radioConnected() {
+  _state.radioFailures = 0;
+  _state.wakesSinceRadioFailure = 0;
+}
+
+// The wake goes on without the radio. Without a clock we can't measure either, so then we sleep until the retry.
+void Scheduler::radioFailed() {
+  if (_state.radioFailures < UINT8_MAX) {
+    _state.radioFailures++;
+  }
+  _state.wakesSinceRadioFailure = 0;
+  saveState();
+  Serial.printf("Radio failed %d times, retrying in %d wakes\n", _state.radioFailures, backoffWakes());
+  if (!isClockValid()) {
+    sleepUntilRadioRetry();
+  }
+}
+
+uint8_t Scheduler::radioFailures() {
+  return _state.radioFailures;
+}
+
+// Without a clock we can't measure, so we sleep through the backoff. That takes one interval per wake, since the
+// whole backoff can be longer than the deep sleep timer allows. The radio only comes on for the wake of the retry.
+void Scheduler::sleepUntilRadioRetry() {
+  bool retryNext = _state.wakesSinceRadioFailure + 1 >= backoffWakes();
+  deepSleep(intervalSeconds(), retryNext);
+}
+
+// The policy decides the interval from the current run to the next. nullptr means the fixed interval from begin().
+void Scheduler::setIntervalPolicy(IntervalPolicy* policy) {
+  _intervalPolicy = policy;
+}
+
+// Called just before deep sleep, before the persistent store gets committed
+void Scheduler::setSleepHandler(std::function<void(void)> handler) {
+  _sleepHandler = handler;
+}
+
+// Spreads the runs of devices with the same interval evenly over it. The hash makes sure that devices with
+// consecutive IDs don't end up in consecutive seconds, and the offset is whole seconds so slots stay exact.
+void Scheduler::setSlotJitter(uint32_t deviceId) {
+  _slotJitter = true;
+  _slotOffsetSeconds = PersistentStore::crc32(&deviceId, sizeof(deviceId)) % _measureIntervalSeconds;
+  Serial.printf("Slot offset: %ld seconds\n", _slotOffsetSeconds);
+}
+
+// WAIT_LIGHT_SLEEP needs the radio to be off, WAIT_MODEM_SLEEP keeps the connection (e.g. for MQTT keepalives).
+// Blinking the LED while waiting shows the device is alive, but costs power.
+void Scheduler::setWaitMode(WaitMode mode, bool blinkLed) {
+  _waitMode = mode;
+  _blinkLed = blinkLed;
+}
+
+// Sync when this much time passed since the last sync, instead of every NTP_SYNC_INTERVAL_WAKES wakes. Then a wake that
+// has the radio on anyway syncs too, so the next sync wake is this far from the last report rather than coming on its own.
+// 0 goes back to counting wakes. The estimated clock error still gets a sync earlier if needed.
+void Scheduler::setTimeSyncInterval(uint32_t seconds) {
+  _timeSyncSeconds = seconds;
+}
+
+long Scheduler::intervalSeconds() {
+  return _intervalPolicy != nullptr ? _intervalPolicy->intervalSeconds() : _measureIntervalSeconds;
+}
+
+bool Scheduler::isRadioEnabled() {
+  return _radioEnabled;
+}
+
+// If radioNeeded is set and the radio is off, we need to go into deep sleep to switch it on, even for short waits.
+void Scheduler::waitForNextRun(std::function<void(void)> callback, bool radioNeeded) {
+  updateSyncState();
   long sleepTimeSeconds = _nextRunTimestamp - time(nullptr);  
   Serial.printf("Wait time: %ld\n",sleepTimeSeconds);
-  if (sleepTimeSeconds > MAX_WAIT_SECONDS_WITHOUT_SLEEP) {
+  if (sleepTimeSeconds <= MAX_WAIT_SECONDS_WITHOUT_SLEEP) {
+    measureStartup();
+  }
+  bool switchRadioOn = radioNeeded && !_radioEnabled && sleepTimeSeconds > 0;
+  if (sleepTimeSeconds > MAX_WAIT_SECONDS_WITHOUT_SLEEP || switchRadioOn) {
     Serial.printf("Deep sleep for %d seconds\n", sleepTimeSeconds);
-    ESP.deepSleep((sleepTimeSeconds - STARTUP_TIME_SECONDS) * 1000L * 1000L * TIME_CORRECTION_FACTOR);
+    deepSleep(_nextRunTimestamp - currentTime() - _drift.startupSeconds() - WAKE_MARGIN_SECONDS, radioNeeded);
   }
   Serial.printf("Normal wait for %d seconds\n", _nextRunTimestamp - time(nullptr));
+  if (!_blinkLed) {
+    // the LED is active low
+    digitalWrite(LED_BUILTIN, HIGH);
+  }
+  if (_waitMode == WAIT_LIGHT_SLEEP) {
+    lightSleep(_nextRunTimestamp - currentTime());
+  }
+  // whatever is left after light sleep (or all of it in modem sleep)
   while (time(nullptr) < _nextRunTimestamp) {
-    digitalWrite(LED_BUILTIN, time(nullptr) % 2 == 0);
+    if (_blinkLed) {
+      digitalWrite(LED_BUILTIN, time(nullptr) % 2 == 0);
+    }
     callback();
-    delay(10);
+    delay(_waitMode == WAIT_MODEM_SLEEP ? MODEM_SLEEP_POLL_MILLIS : 10);
   }
   Serial.println("done waiting");
 }
 
+// The next start of a minute, or with slot jitter the next start of our slot
+time_t Scheduler::firstRunAfter(time_t now) {
+  if (!_slotJitter) {
+    return (now / 60 + 1) * 60;
+  }
+  time_t slotStart = now - (now - _slotOffsetSeconds) % _measureIntervalSeconds;
+  return slotStart + _measureIntervalSeconds;
+}
+
 time_t Scheduler::getNextRunTimestamp() {
-  _nextRunTimestamp = readTimestamp();
+  _nextRunTimestamp = _state.nextRunTimestamp;
   Serial.printf("nextRunTimestamp: %s", ctime(&_nextRunTimestamp));
-  // If we are much too late or the file wasn't there, wait for the next start of a minute
-  if (time(nullptr) > _nextRunTimestamp + _measureIntervalSeconds) {
-    _nextRunTimestamp = (time(nullptr)/60 + 1) * 60;
+  // If we are much too late or there was no earlier run, wait for the next start of a minute (or of our slot).
+  // Intervals are multiples of the base interval, so runs that are off the slot came from an earlier setting.
+  bool offSlot = _slotJitter && (_nextRunTimestamp - _slotOffsetSeconds) % _measureIntervalSeconds != 0;
+  if (time(nullptr) > _nextRunTimestamp + intervalSeconds() || offSlot) {
+    _nextRunTimestamp = firstRunAfter(time(nullptr));
   Serial.printf("updated nextRunTimestamp to %s", ctime(&_nextRunTimestamp));
   }
   return _nextRunTimestamp;
 }
 
 time_t Scheduler::setNextRunTimestamp() {
-  _nextRunTimestamp += _measureIntervalSeconds;
-  writeTimestamp(_nextRunTimestamp);
+  updateSyncState();
+  _nextRunTimestamp += intervalSeconds();
+  _state.nextRunTimestamp = _nextRunTimestamp;
+  saveState();
   return _nextRunTimestamp;
 }
@@ -10,25 +10,104 @@
 //    See the License for the specific language governing permissions and limitations under the License.
 
 // This class takes care of 
-// * retrieving the next run time from a file
+// * retrieving the next run time from the persistent store (RTC memory, so no need to mount SPIFFS on every wake)
 // * calculating the next run time based on the previous one (or taking the next start of a minute if absent or too long ago)
-// * saving the next run time into the file
+// * optionally spreading the runs of a fleet over the interval. Each device then gets a fixed slot derived from its ID,
+//   instead of all of them waking (and connecting to the broker) at the start of the same minute.
+// * saving the next run time into the persistent store
 // * waiting for the next run time. It will do that via deep sleep if the wait is long enough (configured as a minute).
+// * keeping the clock across deep sleep. After waking up, the clock is restored from the time we went to sleep plus
+//   the time we slept. NTP only runs every few wakes, or when the estimated error gets too large, and it does so
+//   in the background. With a sync interval set, the wake count doesn't matter, and NTP runs when the interval passed
+//   or on any wake that has the radio on anyway (for wakes that only rarely have the radio on, e.g. report on change).
+// * learning how inaccurate deep sleep is on this device, and how long it takes to start up (see DriftEstimator).
+//   That way it wakes up just a few seconds before the next run.
+// * telling whether we woke up for the next run, so measuring can start right away while the radio connects.
+// * choosing the interval between runs. That is fixed, unless an IntervalPolicy is set (e.g. AdaptiveInterval).
+// * switching the radio on or off for the next wake, so wakes that only measure don't power up the radio.
+// * ending a wake early (e.g. when it ran out of time), sleeping until the run after the current one.
+// * backing off exponentially (in wakes) after the radio failed to connect, instead of rebooting right away.
+// * waiting for short periods in forced light sleep (the radio must be off for that), or, if the connection needs
+//   to stay up, in modem sleep while calling the callback.
 
 #ifndef HEADER_SCHEDULER
 #define HEADER_SCHEDULER
 #include <functional>
+#include "PersistentStore.h"
+#include "DriftEstimator.h"
+#include "IntervalPolicy.h"
+
+enum WaitMode { WAIT_LIGHT_SLEEP, WAIT_MODEM_SLEEP };
 
 class Scheduler {
 public:
-    void begin(long measureIntervalSeconds);
+    void abortWake(bool radioNeeded);
+    void begin(PersistentStore* store, long measureIntervalSeconds);
+    float driftCorrectionFactor();
     time_t getNextRunTimestamp();
+    long intervalSeconds();
+    bool isRadioEnabled();
+    bool isRadioRetryDue();
+    void radioConnected();
+    void radioFailed();
+    uint8_t radioFailures();
+    bool isTimeSyncDue();
+    void restartWithRadio();
+    void setIntervalPolicy(IntervalPolicy* policy);
+    void setSleepHandler(std::function<void(void)> handler);
+    void setSlotJitter(uint32_t deviceId);
+    void setTimeSyncInterval(uint32_t seconds);
+    void setWaitMode(WaitMode mode, bool blinkLed);
     time_t setNextRunTimestamp();
-    void waitForNextRun(std::function<void(void)> callback);
+    bool startRunIfDue();
+    bool startTimeSync(std::function<void(void)> callback, unsigned long timeoutMillis);
+    void waitForNextRun(std::function<void(void)> callback, bool radioNeeded);
 private:
+    struct SchedulerState {
+        time_t nextRunTimestamp = 0;
+        double sleepStartTime = 0;
+        float sleepSeconds = 0;
+        float clockErrorSeconds = 0;
+        int wakesSinceSync = 0;
+        bool radioOnWake = true;
+        // these fit in the padding before anchorTime
+        uint8_t radioFailures = 0;
+        uint8_t wakesSinceRadioFailure = 0;
+        // drift measurement since the last NTP sync
+        double anchorTime = 0;
+        float anchorRequestedSeconds = 0;
+        float anchorAwakeSeconds = 0;
+    };
+    PersistentStore* _store;
+    SchedulerState _state;
+    DriftEstimator _drift;
     long _measureIntervalSeconds;
     time_t _nextRunTimestamp;
-    void writeTimestamp(time_t timestamp);
-    time_t readTimestamp();
+    volatile bool _timeSynced = false;
+    unsigned long _syncMillis = 0;
+    double _syncTime = 0;
+    bool _wokeFromDeepSleep = false;
+    bool _startupMeasured = false;
+    bool _radioEnabled = true;
+    IntervalPolicy* _intervalPolicy = nullptr;
+    bool _slotJitter = false;
+    long _slotOffsetSeconds = 0;
+    WaitMode _waitMode = WAIT_MODEM_SLEEP;
+    bool _blinkLed = false;
+    std::function<void(void)> _sleepHandler = nullptr;
+    uint32_t _timeSyncSeconds = 0;
+    int backoffWakes();
+    static double currentTime();
+    time_t firstRunAfter(time_t now);
+    void deepSleep(double sleepSeconds, bool radioNeeded);
+    bool isClockValid();
+    void lightSleep(double sleepSeconds);
+    void loadState();
+    void measureStartup();
+    void printTime(const char* label);
+    void saveDrift(bool durable);
+    void saveState();
+    void sleepUntilRadioRetry();
+    void updateSyncState();
 };
 #endif
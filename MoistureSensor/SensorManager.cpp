@@ -12,93 +12,454 @@
 #include <ESP.h>
 #include "SensorManager.h"
 
-const double ALPHA = 0.1;
+// Low pass filter: value = sample * ALPHA + value * (1 - ALPHA), with ALPHA = 1 / ALPHA_DIVISOR.
+// The filtered value is fixed point with FRACTION_BITS bits after the binary point.
+const int32_t ALPHA_DIVISOR = 10;
+const int FRACTION_BITS = 8;
 const int STARTUP_COUNT = 16;
-const int SAMPLE_COUNT = 16;
+// In single window mode the muxes are already powered, so channels after the first need less time to settle
+const int CHANNEL_SETTLE_COUNT = 4;
 const int SAMPLE_TIME_MILLIS = 10; 
+// Adaptive acquisition: settled once consecutive reads differ at most SETTLE_TOLERANCE (ADC steps) a few times in a row,
+// and precise enough once the 95% confidence interval of the mean is within ±SAMPLE_TOLERANCE.
+const int SETTLE_TOLERANCE = 2;
+const int SETTLE_STABLE_READS = 2;
+const int SAMPLE_TOLERANCE = 1;
+const int MIN_ADAPTIVE_SAMPLES = 4;
 const int CURRENT_DIRECTION_PIN = D1;
 const int INHIBIT_PIN = D2;
-const int SENSOR_SELECT_PIN = D5;
+// Mux address lines, least significant first
+const int SENSOR_SELECT_PINS[] = { D5, D6, D7 };
+const int MAX_ADDRESS_LINES = sizeof(SENSOR_SELECT_PINS) / sizeof(SENSOR_SELECT_PINS[0]);
+// The mux channel of each sensor number. Change if the sensors are wired differently.
+const uint8_t SENSOR_CHANNELS[SensorManager::MAX_SENSORS] = { 0, 1, 2, 3, 4, 5, 6, 7 };
 const int ANALOG_IN_PIN = A0;
 
+const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const uint16_t MAX_PACKED_VALUE = 0x3FF;
+const int PACKED_BITS = 10;
+
+// Encodes bytes as base64 while they come in, so we don't need an intermediate buffer
+class Base64Writer {
+public:
+  Base64Writer(char* buffer, int size);
+  void finish();
+  void write(uint8_t value);
+private:
+  char* _buffer;
+  int _size;
+  int _length = 0;
+  uint32_t _pending = 0;
+  int _pendingCount = 0;
+  void emit(int charCount);
+};
+
+Base64Writer::Base64Writer(char* buffer, int size) {
+  _buffer = buffer;
+  _size = size;
+}
+
+void Base64Writer::emit(int charCount) {
+  for (int i = 0; i < 4; i++) {
+    if (_length < _size - 1) {
+      _buffer[_length++] = i < charCount ? BASE64_CHARS[(_pending >> (18 - 6 * i)) & 0x3F] : '=';
+    }
+  }
+}
+
+void Base64Writer::finish() {
+  if (_pendingCount > 0) {
+    _pending <<= 8 * (3 - _pendingCount);
+    emit(_pendingCount + 1);
+  }
+  _buffer[_length] = 0;
+}
+
+void Base64Writer::write(uint8_t value) {
+  _pending = (_pending << 8) | value;
+  if (++_pendingCount == 3) {
+    emit(4);
+    _pending = 0;
+    _pendingCount = 0;
+  }
+}
+
 // The overall resistance in the ADC voltage divider (100kΩ + 220kΩ) and the wall create another voltage divider. This results in 
 // fairly accurate measurements between 15 kΩ and about 1 MΩ. The walls should have a higher resistance than 1MΩ, but accuracy is 
 // also not that critical. Knowing the resistance is above that is enough.
 
-const double R_REF = 320000.0; 
-const double V_IN = 3.3;
+constexpr double R_REF = 320000.0; 
+constexpr double V_IN = 3.3;
+// empirically calibrated correction factors (using resistors). Minimum is 1 to avoid division by zero.
+// TODO: correct. The internal voltage divider has a max of 3.2V, not 3.3V.
+constexpr double CORRECTION_SLOPE = 0.95;
+constexpr double CORRECTION_OFFSET = 5.7;
+constexpr int ADC_STEPS = 1025;
+
+// The calibration formula. The intermediate results are floats, as they always were.
+constexpr float correctedPinValueFor(float rawPinValue) {
+  return rawPinValue < 1024 ? 
+    static_cast<float>(rawPinValue * CORRECTION_SLOPE - CORRECTION_OFFSET > 1.0 ? rawPinValue * CORRECTION_SLOPE - CORRECTION_OFFSET : 1.0) : 
+    1024;
+}
+
+constexpr float vOutFor(float correctedPinValue) {
+  return static_cast<float>(correctedPinValue * V_IN / 1024.0);
+}
+
+constexpr float resistanceForVOut(float vOut) {
+  return static_cast<float>(R_REF * (V_IN - vOut) / vOut);
+}
+
+// The resistance in Ω for each ADC value, rounded
+struct ResistanceTable {
+  uint32_t ohm[ADC_STEPS];
+  constexpr ResistanceTable() : ohm() {
+    for (int i = 0; i < ADC_STEPS; i++) {
+      ohm[i] = static_cast<uint32_t>(static_cast<double>(resistanceForVOut(vOutFor(correctedPinValueFor(i)))) + 0.5);
+    }
+  }
+};
+
+static constexpr ResistanceTable RESISTANCE_TABLE PROGMEM = ResistanceTable();
+
+static uint32_t tableResistance(int index) {
+  return pgm_read_dword(&RESISTANCE_TABLE.ohm[index]);
+}
+
+// The total resistance of the divider (wall and R_REF) one step further, continuing the line 1 / total makes
+static uint64_t extrapolateTotal(uint64_t nearTotal, uint64_t farTotal) {
+  return nearTotal * farTotal / (2 * farTotal - nearTotal);
+}
+
+static uint64_t tableTotal(int index) {
+  return tableResistance(index) + static_cast<uint64_t>(R_REF);
+}
+
+// Interpolates between the table entries for the fraction. The corrected pin value is linear in the pin value, and
+// the total resistance is inversely proportional to it. So interpolating 1 / total is exact but for rounding,
+// where interpolating the resistance itself would be off by up to 9% at the high end.
+static uint32_t resistanceForFixed(int32_t pinValue) {
+  if (pinValue <= 0) {
+    return tableResistance(0);
+  }
+  int index = pinValue >> FRACTION_BITS;
+  if (index >= ADC_STEPS - 1) {
+    return tableResistance(ADC_STEPS - 1);
+  }
+  uint64_t maxTotal = tableTotal(0);
+  uint64_t lowTotal = tableTotal(index);
+  uint64_t highTotal = tableTotal(index + 1);
+  if (lowTotal == highTotal) {
+    return tableResistance(index);
+  }
+  // the corrected pin value is clamped at 1, and the formula jumps at the maximum ADC value.
+  // In those steps, continue the line of the neighbouring steps instead.
+  if (lowTotal == maxTotal) {
+    lowTotal = extrapolateTotal(highTotal, tableTotal(index + 2));
+  }
+  if (index == ADC_STEPS - 2) {
+    highTotal = extrapolateTotal(lowTotal, tableTotal(index - 1));
+  }
+  uint64_t fraction = pinValue & ((1 << FRACTION_BITS) - 1);
+  // 1 / total = (1 - fraction) / lowTotal + fraction / highTotal. The product of two neighbouring totals is below 2^56
+  // (the largest is at the clamped end), so shifting it by FRACTION_BITS fits.
+  uint64_t divisor = ((1 << FRACTION_BITS) - fraction) * highTotal + fraction * lowTotal;
+  uint64_t total = ((lowTotal * highTotal << FRACTION_BITS) + divisor / 2) / divisor;
+  return static_cast<uint32_t>((total < maxTotal ? total : maxTotal) - static_cast<uint64_t>(R_REF));
+}
+
+// One step of the low pass filter, rounded to the nearest fixed point value. Truncating would leave the filtered value
+// up to (ALPHA_DIVISOR - 1) / 2^FRACTION_BITS of an ADC step away from a steady input.
+static int32_t filterStep(int32_t filteredValue, int32_t sampleValue) {
+  int32_t difference = sampleValue - filteredValue;
+  return filteredValue + (difference + (difference < 0 ? -ALPHA_DIVISOR / 2 : ALPHA_DIVISOR / 2)) / ALPHA_DIVISOR;
+}
 
 void SensorManager::begin(int sensorCount) {
-  _sensorCount = sensorCount;
+  _sensorCount = sensorCount > MAX_SENSORS ? MAX_SENSORS : sensorCount;
+  // only use the address lines we need
+  _addressLines = 0;
+  while ((1 << _addressLines) < _sensorCount && _addressLines < MAX_ADDRESS_LINES) {
+    _addressLines++;
+  }
   pinMode(INHIBIT_PIN, OUTPUT);
   pinMode(CURRENT_DIRECTION_PIN, OUTPUT);
-  pinMode(SENSOR_SELECT_PIN, OUTPUT);
+  for (int i = 0; i < _addressLines; i++) {
+    pinMode(SENSOR_SELECT_PINS[i], OUTPUT);
+  }
   digitalWrite(INHIBIT_PIN, HIGH);
+  _phase = PHASE_IDLE;
   _comment[0] = 0;
+  for (int i = 0; i < MAX_SENSORS; i++) {
+    _results[i].ready = false;
+  }
   _samples[0] = 0;
 }
 
-const char* SensorManager::comment() {
+const char* SensorManager::comment(int sensorNumber) {
+  float correctedPinValue;
+  float vOut;
+  Result* result = &_results[sensorNumber];
+  float rawPinValue = pinValue(sensorNumber);
+  convert(rawPinValue, &correctedPinValue, &vOut);
+  snprintf(_comment, COMMENT_SIZE, "Sensor: %d, Pin: %.1f, Corrected: %.1f, V_out: %.3f V, R_wall:%.3f MΩ\n", 
+    sensorNumber, rawPinValue, correctedPinValue, vOut, result->resistance/1e6);
   return _comment;
 }
 
-void SensorManager::printResult() {
-  Serial.print(_comment);
+void SensorManager::finishSampling() {
+  Result* result = &_results[_sensorNumber];
+  // Adaptive sampling stops once the mean is precise enough, so report that mean. After a few samples the low pass
+  // filter still leans towards the first one.
+  if (_acquisitionMode == ACQUIRE_ADAPTIVE && _sampleIndex > 0) {
+    result->filteredPinValue = ((static_cast<int64_t>(_sum) << FRACTION_BITS) + _sampleIndex / 2) / _sampleIndex;
+  }
+  result->resistance = resistanceForFixed(result->filteredPinValue);
+  result->sampleCount = _sampleIndex;
+  // the last sample had its sample time too
+  result->poweredMillis = millis() - _channelStartMillis + SAMPLE_TIME_MILLIS;
+  result->ready = true;
+  if (_scanMode == SCAN_SINGLE_WINDOW && _sensorNumber + 1 < _sensorCount) {
+    _sensorNumber++;
+    startChannel(CHANNEL_SETTLE_COUNT);
+  } else {
+    startReversing(_scanMode == SCAN_SINGLE_WINDOW ? 0 : _sensorNumber);
+  }
 }
 
-float SensorManager::pinValue() {
-  return _rawPinValue;
+// About two standard errors of the mean within the tolerance. In integers: n * M2 = n * Σx² - (Σx)², and
+// 4 * M2 / (n * (n - 1)) <= tolerance² is the same as 4 * n * M2 <= tolerance² * n² * (n - 1).
+bool SensorManager::isPreciseEnough() {
+  if (_acquisitionMode != ACQUIRE_ADAPTIVE || _sampleIndex < MIN_ADAPTIVE_SAMPLES) {
+    return false;
+  }
+  int64_t n = _sampleIndex;
+  int64_t scaledSpread = n * _sumSquares - static_cast<int64_t>(_sum) * _sum;
+  return 4 * scaledSpread <= SAMPLE_TOLERANCE * SAMPLE_TOLERANCE * n * n * (n - 1);
 }
 
-const char* SensorManager::samples() {
-  return _samples;
+// The slope is flat if the last few reads hardly changed
+bool SensorManager::isSettled(int sensorValue) {
+  if (_acquisitionMode != ACQUIRE_ADAPTIVE) {
+    return false;
+  }
+  bool stable = _sampleIndex > 1 && abs(sensorValue - _previousValue) <= SETTLE_TOLERANCE;
+  _stableReads = stable ? _stableReads + 1 : 0;
+  _previousValue = sensorValue;
+  return _stableReads >= SETTLE_STABLE_READS;
+}
+
+// Still measuring, or still reversing the current of the last sensor
+bool SensorManager::isBusy() {
+  return _phase != PHASE_IDLE;
+}
+
+bool SensorManager::isResultReady(int sensorNumber) {
+  return _results[sensorNumber].ready;
 }
 
-void SensorManager::read(int sensorNumber) {
-  _sensorNumber = sensorNumber;
+float SensorManager::pinValue(int sensorNumber) {
+  return _results[sensorNumber].filteredPinValue / static_cast<float>(1 << FRACTION_BITS);
+}
+
+// Take the next step of the scan if it is due. Returns whether the scan is still busy.
+bool SensorManager::poll() {
+  if (_phase == PHASE_IDLE) {
+    return false;
+  }
+  unsigned long now = millis();
+  if (static_cast<long>(now - _nextActionMillis) < 0) {
+    return true;
+  }
+  // keep at least the sample time between samples, also if we were called late
+  _nextActionMillis = now + SAMPLE_TIME_MILLIS;
+  Result* result = &_results[_sensorNumber];
+  switch (_phase) {
+    case PHASE_SETTLING: {
+      // skip the first measurements to let it settle in
+      int sensorValue = analogRead(ANALOG_IN_PIN);
+      ++_sampleIndex;
+      if (isSettled(sensorValue) || _sampleIndex >= _settleCount) {
+        _phase = PHASE_SAMPLING;
+        _sampleIndex = 0;
+        _sum = 0;
+        _sumSquares = 0;
+      }
+      break;
+    }
+    case PHASE_SAMPLING: {
+      int sensorValue = analogRead(ANALOG_IN_PIN);
+      result->samples[_sampleIndex] = sensorValue;
+      _sum += sensorValue;
+      _sumSquares += sensorValue * sensorValue;
+      // Initialize at first value, after that do a low pass filter (averaging effect)
+      int32_t sampleValue = static_cast<int32_t>(sensorValue) << FRACTION_BITS;
+      if (_sampleIndex == 0) {
+        result->filteredPinValue = sampleValue;
+      } else {
+        result->filteredPinValue = filterStep(result->filteredPinValue, sampleValue);
+      }
+      if (++_sampleIndex >= _sampleCount || isPreciseEnough()) {
+        finishSampling();
+      }
+      break;
+    }
+    case PHASE_REVERSING:
+      if (++_reverseNumber <= _sensorNumber) {
+        selectChannel(_reverseNumber);
+        _nextActionMillis = now + _results[_reverseNumber].poweredMillis;
+        break;
+      }
+      // cut the power on the sensor 
+      digitalWrite(INHIBIT_PIN, HIGH);
+      if (++_sensorNumber < _sensorCount) {
+        powerUp();
+        startChannel(STARTUP_COUNT);
+      } else {
+        _phase = PHASE_IDLE;
+      }
+      break;
+    default:
+      break;
+  }
+  return _phase != PHASE_IDLE;
+}
+
+void SensorManager::powerUp() {
   // switch on led
   digitalWrite(LED_BUILTIN, LOW); 
-  // This assumes we have at most 2 sensors, called 0 and 1.
-  digitalWrite(SENSOR_SELECT_PIN,_sensorNumber == 1);
   // switch mux to connect to ADC
   digitalWrite(CURRENT_DIRECTION_PIN, LOW);
   // Power up the sensor (enable the muxes)
   digitalWrite(INHIBIT_PIN, LOW);
-  _samples[0] = 0;
+}
+
+void SensorManager::printResult(int sensorNumber) {
+  Serial.print(comment(sensorNumber));
+}
+
+uint32_t SensorManager::resistance(int sensorNumber) {
+  return _results[sensorNumber].resistance;
+}
+
+// Encodes the samples of the sensor in one pass. The result is valid until the next call.
+const char* SensorManager::samples(int sensorNumber) {
+  const uint16_t* values = _results[sensorNumber].samples;
+  int sampleCount = _results[sensorNumber].sampleCount;
+  if (_samplesFormat == SAMPLES_CSV) {
+    int length = 0;
+    _samples[0] = 0;
+    for (int i = 0; i < sampleCount && length < SAMPLES_SIZE; i++) {
+      length += snprintf(_samples + length, SAMPLES_SIZE - length, "%u,", values[i]);
+    }
+    return _samples;
+  }
+  Base64Writer writer(_samples, SAMPLES_SIZE);
+  if (_samplesFormat == SAMPLES_PACKED) {
+    uint32_t bits = 0;
+    int bitCount = 0;
+    for (int i = 0; i < sampleCount; i++) {
+      bits = (bits << PACKED_BITS) | (values[i] > MAX_PACKED_VALUE ? MAX_PACKED_VALUE : values[i]);
+      bitCount += PACKED_BITS;
+      while (bitCount >= 8) {
+        bitCount -= 8;
+        writer.write(bits >> bitCount);
+      }
+    }
+    if (bitCount > 0) {
+      writer.write(bits << (8 - bitCount));
+    }
+  } else {
+    writer.write(values[0] >> 8);
+    writer.write(values[0]);
+    for (int i = 1; i < sampleCount; i++) {
+      int delta = values[i] - values[i - 1];
+      uint32_t zigzag = delta < 0 ? -2 * delta - 1 : 2 * delta;
+      while (zigzag >= 0x80) {
+        writer.write(0x80 | (zigzag & 0x7F));
+        zigzag >>= 7;
+      }
+      writer.write(zigzag);
+    }
+  }
+  writer.finish();
+  return _samples;
+}
 
-  // skip the first measurements to let it settle in
-  for (int i = 0; i < STARTUP_COUNT; i++) {
-    analogRead(ANALOG_IN_PIN);
-    delay(SAMPLE_TIME_MILLIS);
+const char* SensorManager::samplesFormatName() {
+  switch (_samplesFormat) {
+    case SAMPLES_PACKED:
+      return "packed10";
+    case SAMPLES_DELTA:
+      return "delta";
+    default:
+      return "csv";
   }
+}
 
-  // read a number of samples
-  for (int i = 0; i < SAMPLE_COUNT; i++) {
-    int sensorValue = analogRead(ANALOG_IN_PIN);
-    char numberBuffer[10];
-    sprintf(numberBuffer,"%d,",sensorValue);
-    strcat(_samples, numberBuffer);
-    // Initialize at first value, after that do a low pass filter (averaging effect)
-    _rawPinValue = i==0 ? sensorValue : sensorValue * ALPHA + _rawPinValue * (1 - ALPHA);
-    delay(SAMPLE_TIME_MILLIS);
+void SensorManager::selectChannel(int sensorNumber) {
+  uint8_t channel = SENSOR_CHANNELS[sensorNumber];
+  for (int i = 0; i < _addressLines; i++) {
+    digitalWrite(SENSOR_SELECT_PINS[i], (channel >> i) & 1);
   }
+}
+
+// At most SAMPLE_COUNT. Fewer samples make the measurement shorter, but the filter has less to average.
+void SensorManager::setSampleCount(int count) {
+  _sampleCount = count < 1 ? 1 : (count > SAMPLE_COUNT ? SAMPLE_COUNT : count);
+}
+
+// In adaptive mode, the settle and sample counts are upper bounds
+void SensorManager::setAcquisitionMode(AcquisitionMode mode) {
+  _acquisitionMode = mode;
+}
+
+void SensorManager::setSamplesFormat(SamplesFormat format) {
+  _samplesFormat = format;
+}
 
-  // reverse the current over the wall the same amount of time to reduce corrosion of the sensor
+void SensorManager::setScanMode(ScanMode mode) {
+  _scanMode = mode;
+}
+
+void SensorManager::startScan() {
+  for (int i = 0; i < _sensorCount; i++) {
+    _results[i].ready = false;
+  }
+  _sensorNumber = 0;
+  powerUp();
+  startChannel(STARTUP_COUNT);
+}
+
+void SensorManager::startChannel(int settleCount) {
+  selectChannel(_sensorNumber);
+  _channelStartMillis = millis();
+  _nextActionMillis = _channelStartMillis;
+  _sampleIndex = 0;
+  _settleCount = settleCount;
+  _stableReads = 0;
+  _phase = PHASE_SETTLING;
+}
+
+// Reverse the current over the wall the same amount of time to reduce corrosion of the sensor.
+// This covers the sensors from firstSensor up to the current one, each for as long as it had the forward current.
+void SensorManager::startReversing(int firstSensor) {
   digitalWrite(LED_BUILTIN, HIGH);
   digitalWrite(CURRENT_DIRECTION_PIN, HIGH);
-  delay (SAMPLE_TIME_MILLIS * (STARTUP_COUNT + SAMPLE_COUNT));
-
-  // cut the power on the sensor 
-  digitalWrite(INHIBIT_PIN, HIGH);
+  _reverseNumber = firstSensor;
+  selectChannel(_reverseNumber);
+  _nextActionMillis = millis() + _results[_reverseNumber].poweredMillis;
+  _phase = PHASE_REVERSING;
+}
 
-  // empirically calibrated correction factors (using resistors). Minimum is 1 to avoid division by zero.
-  // TODO: correct. The internal voltage divider has a max of 3.2V, not 3.3V.
-  _correctedPinValue = _rawPinValue < 1024 ? max(_rawPinValue * 0.95 - 5.7, 1.0) : 1024;
-  _vOut = _correctedPinValue * V_IN / 1024.0;
-  _resistance = R_REF * (V_IN - _vOut) / _vOut;
-  sprintf(_comment, "Sensor: %d, Pin: %.1f, Corrected: %.1f, V_out: %.3f V, R_wall:%.3f MΩ\n", _sensorNumber, _rawPinValue, _correctedPinValue, _vOut, _resistance/1e6);
+uint32_t SensorManager::resistanceFor(float rawPinValue) {
+  return resistanceForFixed(static_cast<int32_t>(rawPinValue * (1 << FRACTION_BITS) + 0.5f));
 }
 
-float SensorManager::resistance() {
-  return _resistance;
+// Only needed for the comment
+float SensorManager::convert(float rawPinValue, float* correctedPinValue, float* vOut) {
+  *correctedPinValue = correctedPinValueFor(rawPinValue);
+  *vOut = vOutFor(*correctedPinValue);
+  return resistanceForVOut(*vOut);
 }
@@ -9,38 +9,109 @@
 //    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //    See the License for the specific language governing permissions and limitations under the License.
 
-// This class takes a measurement for the sensors (can be 1 or 2 at the moment)
+// This class takes a measurement for the sensors (up to 8)
 // We create a voltage divider circuit via the internal resistor of the ADC port (220k and 100k) and the wall.
 // To limit corrosion we need to simulate AC. But because of those resistors internal to the ADC (connected to GND), 
 // we can't simply reverse the current by switching between two ports.
 // So instead we use a 4052 multiplexer with X0 on ADC, Y0 on +3.3V (measuring) 
 // and X1 via a 320k resistor to 3.3V and Y1 to GND (reverse current). 
 // We switch port A of the 4052 with D1, and inhibit with D2.
-// The output Ports X and Y go to a second 4052 to multiplex the sensors. Two sensors are used, selected via port A on pin D5.
-// If 4 are needed, connect Port B of the second 4052 with e.g. D6 and change the code so it switches right.
+// The output Ports X and Y go to a second 4052 to multiplex the sensors. Two sensors are selected via port A on pin D5.
+// For 4 sensors, connect port B of the second 4052 to D6. For 8, use two of those 4052s and switch between them with D7
+// (e.g. on the inhibit of one, and via an inverter on the other). Only the address lines needed for the sensor count
+// are used. The mapping of sensor numbers to mux channels is a table in SensorManager.cpp, so it can follow the wiring.
+// By default each sensor gets its own power up and reverse current phase. In single window mode, the muxes stay powered
+// while all channels get measured one after another (after the first, a channel needs less settling), followed by one
+// reverse current phase that gives each channel the same time as it had with the forward current. That saves the
+// power up and down of each sensor, and the measurement gets shorter per sensor as the count goes up.
+// Measuring doesn't block: startScan() powers up the first sensor, and poll() takes the next sample when it is due.
+// So the caller can do other work in between, like connecting to WiFi. The result of a sensor is available
+// as soon as its samples are taken. The reverse current phase that follows runs while the caller publishes it,
+// and it lasts as long as the sensor was actually powered (the forward phase can take longer if poll() is late).
+// The number of samples per sensor can be lowered from the default (and maximum) SAMPLE_COUNT.
+// In adaptive acquisition mode, the settle and sample counts are upper bounds. Settling stops once consecutive reads
+// hardly change any more, and sampling stops once the mean is known precisely enough (from the running variance).
+// The result is then that mean, rather than the low pass filtered value.
+// Since the reverse current phase follows the time the sensor was really powered, a stable (e.g. dry) wall gets
+// measured in a fraction of the time.
+// The individual samples are kept as numbers, and only encoded when asked for. Next to the readable comma separated
+// list, there are two compact formats, both base64 encoded: the samples packed as 10 bit values (1024 becomes 1023),
+// or the first sample (16 bits) followed by the differences as zigzag varints (mostly one byte each).
+// The ESP8266 has no floating point unit, so filtering is done in fixed point, and the conversion to resistance
+// uses a table for all ADC values that gets generated at compile time from the calibration formula. Fractions are
+// interpolated in a way that matches the formula too.
 
 #ifndef HEADER_SENSORMANAGER
 #define HEADER_SENSORMANAGER
 
+#include <stdint.h>
+
+enum SamplesFormat { SAMPLES_CSV, SAMPLES_PACKED, SAMPLES_DELTA };
+enum ScanMode { SCAN_PER_SENSOR, SCAN_SINGLE_WINDOW };
+enum AcquisitionMode { ACQUIRE_FIXED, ACQUIRE_ADAPTIVE };
+
 class SensorManager {
 public:
+    static const int MAX_SENSORS = 8;
+    static const int SAMPLE_COUNT = 16;
     void begin(int sensorCount);
-    const char* comment();
-    float pinValue();
-    void printResult();
-    void read(int sensorNumber);
-    float resistance();
-    const char* samples();
+    const char* comment(int sensorNumber);
+    bool isBusy();
+    bool isResultReady(int sensorNumber);
+    float pinValue(int sensorNumber);
+    bool poll();
+    void printResult(int sensorNumber);
+    uint32_t resistance(int sensorNumber);
+    uint32_t resistanceFor(float rawPinValue);
+    const char* samples(int sensorNumber);
+    const char* samplesFormatName();
+    void setAcquisitionMode(AcquisitionMode mode);
+    void setSampleCount(int count);
+    void setSamplesFormat(SamplesFormat format);
+    void setScanMode(ScanMode mode);
+    void startScan();
 private:
+    enum Phase { PHASE_IDLE, PHASE_SETTLING, PHASE_SAMPLING, PHASE_REVERSING };
+    // enough for the comma separated list: 16 samples of at most 4 digits and a comma
+    static const int SAMPLES_SIZE = 96;
+    static const int COMMENT_SIZE = 128;
+    struct Result {
+        bool ready;
+        // fixed point, see FRACTION_BITS. The mean of the samples in adaptive acquisition mode.
+        int32_t filteredPinValue;
+        uint32_t resistance;
+        uint16_t samples[SAMPLE_COUNT];
+        uint8_t sampleCount;
+        unsigned long poweredMillis;
+    };
+    SamplesFormat _samplesFormat = SAMPLES_CSV;
+    ScanMode _scanMode = SCAN_PER_SENSOR;
+    AcquisitionMode _acquisitionMode = ACQUIRE_FIXED;
     int _sensorCount;
+    int _addressLines;
     int _sensorNumber;
-    float _rawPinValue;
-    float _correctedPinValue;
-    float _vOut;
-    float _resistance;
-    static const int COMMENT_SIZE = 512;
+    int _reverseNumber;
+    Phase _phase = PHASE_IDLE;
+    int _sampleIndex;
+    int _sampleCount = SAMPLE_COUNT;
+    int _settleCount;
+    // adaptive acquisition
+    int _previousValue;
+    int _stableReads;
+    uint32_t _sum;
+    uint32_t _sumSquares;
+    unsigned long _channelStartMillis;
+    unsigned long _nextActionMillis;
+    Result _results[MAX_SENSORS];
     char _comment[COMMENT_SIZE];
-    char _samples[COMMENT_SIZE];
-    
+    char _samples[SAMPLES_SIZE];
+    float convert(float rawPinValue, float* correctedPinValue, float* vOut);
+    void finishSampling();
+    bool isPreciseEnough();
+    bool isSettled(int sensorValue);
+    void powerUp();
+    void selectChannel(int sensorNumber);
+    void startChannel(int settleCount);
+    void startReversing(int firstSensor);
 };
 #endif
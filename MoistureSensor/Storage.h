@@ -0,0 +1,29 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Backend interface for PersistentStore. A backend holds one opaque image of at most capacity() bytes.
+// RtcStorage and FlashStorage implement it on the device; a test can use a plain buffer instead.
+
+#ifndef HEADER_STORAGE
+#define HEADER_STORAGE
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Storage {
+public:
+    virtual ~Storage() {}
+    virtual size_t capacity() = 0;
+    // size is a multiple of 4 and at most capacity()
+    virtual bool read(uint32_t* data, size_t size) = 0;
+    virtual bool write(const uint32_t* data, size_t size) = 0;
+};
+#endif
@@ -0,0 +1,85 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <ESP.h>
+#include "WakeBudget.h"
+
+// The time limits of the phases, in the order of WakeMetrics::Phase. 0 means only the budget of the wake applies.
+// A limit only works through remainingMillis, as the timeout of what waits for the network, so the phases that
+// don't wait for it have none. WiFi needs the fast connect plus a scan, and firmware updates download a few hundred kB.
+static const unsigned long PHASE_LIMIT_MILLIS[] = { 0, 12000, 10000, 10000, 0, 0, 60000 };
+
+// The boot phase runs from reset, so that counts too
+void WakeBudget::begin(unsigned long budgetMillis, std::function<void(WakeMetrics::Phase phase)> overrunHandler) {
+  _budgetMillis = budgetMillis;
+  _overrunHandler = overrunHandler;
+  _spentMillis = 0;
+  _activeSinceMillis = 0;
+  _phaseStartMillis = 0;
+  _phase = WakeMetrics::PHASE_BOOT;
+}
+
+void WakeBudget::check() {
+  if (_paused || _overrun || spentMillis() < _budgetMillis) {
+    return;
+  }
+  _overrun = true;
+  if (_overrunHandler != nullptr) {
+    _overrunHandler(_phase);
+  }
+}
+
+// A next run in the same wake gets a new budget
+void WakeBudget::endRun() {
+  _spentMillis = 0;
+  _phaseStartMillis = 0;
+  _paused = true;
+}
+
+void WakeBudget::pause() {
+  if (!_paused) {
+    _spentMillis = spentMillis();
+    _paused = true;
+  }
+}
+
+// The smaller of what is left for the current phase and for the wake. 0 if either one is used up.
+unsigned long WakeBudget::remainingMillis() {
+  unsigned long spent = spentMillis();
+  unsigned long remaining = spent < _budgetMillis ? _budgetMillis - spent : 0;
+  unsigned long phaseLimit = PHASE_LIMIT_MILLIS[_phase];
+  if (phaseLimit > 0) {
+    unsigned long phaseSpent = spent - _phaseStartMillis;
+    unsigned long phaseRemaining = phaseSpent < phaseLimit ? phaseLimit - phaseSpent : 0;
+    if (phaseRemaining < remaining) {
+      remaining = phaseRemaining;
+    }
+  }
+  return remaining;
+}
+
+void WakeBudget::resume() {
+  if (_paused) {
+    _activeSinceMillis = millis();
+    _paused = false;
+  }
+}
+
+// Going to the next phase is a good moment to check, so this does that first
+void WakeBudget::startPhase(WakeMetrics::Phase phase) {
+  check();
+  _phase = phase;
+  _phaseStartMillis = spentMillis();
+}
+
+unsigned long WakeBudget::spentMillis() {
+  return _paused ? _spentMillis : _spentMillis + millis() - _activeSinceMillis;
+}
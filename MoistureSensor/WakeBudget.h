@@ -0,0 +1,47 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class puts a bound on how long a wake can take, so the worst case energy per wake is predictable.
+// The wake as a whole gets a budget, and the phases that wait for the network (see WakeMetrics) a time limit. They use
+// the time they have left (remainingMillis) as their timeout, so a bad access point or a slow server makes the
+// phase fail rather than keep the device awake. Waiting loops call check(), which calls the overrun handler once the
+// budget of the wake is used up. That handler is expected to go into deep sleep. check() leaves the phase limits
+// alone, so a phase that runs out of time fails (and e.g. counts as a radio failure) instead of aborting the wake.
+// Waiting for the next run doesn't count (that is light or deep sleep), and every run starts with a new budget.
+
+#ifndef HEADER_WAKEBUDGET
+#define HEADER_WAKEBUDGET
+
+#include <functional>
+#include "WakeMetrics.h"
+
+class WakeBudget {
+public:
+    void begin(unsigned long budgetMillis, std::function<void(WakeMetrics::Phase phase)> overrunHandler);
+    void check();
+    void endRun();
+    void pause();
+    unsigned long remainingMillis();
+    void resume();
+    void startPhase(WakeMetrics::Phase phase);
+private:
+    unsigned long _budgetMillis = 0;
+    // the time used before the current stretch, and when that started
+    unsigned long _spentMillis = 0;
+    unsigned long _activeSinceMillis = 0;
+    unsigned long _phaseStartMillis = 0;
+    bool _paused = false;
+    bool _overrun = false;
+    WakeMetrics::Phase _phase = WakeMetrics::PHASE_BOOT;
+    std::function<void(WakeMetrics::Phase phase)> _overrunHandler = nullptr;
+    unsigned long spentMillis();
+};
+#endif
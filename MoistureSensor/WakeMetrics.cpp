@@ -0,0 +1,118 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <ESP.h>
+#include <stdio.h>
+#include <string.h>
+#include "WakeMetrics.h"
+
+static const char* PHASE_NAMES[] = { "boot", "wifi", "ntp", "mqtt", "measure", "publish", "firmware" };
+
+// The boot phase runs from reset until here
+void WakeMetrics::begin(PersistentStore* store) {
+  _store = store;
+  if (!_store->load(RECORD_WAKE_METRICS, &_totals, sizeof(_totals))) {
+    reset();
+  }
+  _hasPreviousPhases = _store->load(RECORD_WAKE_PHASES, _previousPhases, sizeof(_previousPhases));
+  memset(_phases, 0, sizeof(_phases));
+  _phases[PHASE_BOOT].micros = micros();
+  takeHeapStats(&_phases[PHASE_BOOT]);
+}
+
+void WakeMetrics::endPhase() {
+  if (_currentPhase == NO_PHASE) {
+    return;
+  }
+  PhaseStats* stats = &_phases[_currentPhase];
+  stats->micros += micros() - _phaseStartMicros;
+  takeHeapStats(stats);
+  _currentPhase = NO_PHASE;
+}
+
+// The radio is on from boot until deep sleep on wakes that use it, so the radio time is the awake time of those wakes
+void WakeMetrics::endWake(unsigned long awakeMillis, bool radioEnabled, uint32_t bytesSent, bool flashWritten) {
+  // stop counting rather than wrap around if nobody collects the totals
+  if (_totals.wakes == UINT16_MAX) {
+    return;
+  }
+  _totals.wakes++;
+  _totals.awakeMillis += awakeMillis;
+  if (radioEnabled) {
+    _totals.radioWakes++;
+    _totals.radioMillis += awakeMillis;
+  }
+  _totals.bytesSent += bytesSent;
+  if (flashWritten) {
+    _totals.flashWrites++;
+  }
+  save();
+  if (radioEnabled) {
+    endPhase();
+    _store->save(RECORD_WAKE_PHASES, _phases, sizeof(_phases));
+  }
+}
+
+// wakes,radio wakes,awake ms,radio ms,bytes sent,flash writes,overruns,phase of the last overrun
+void WakeMetrics::format(char* payload, size_t size) {
+  snprintf(payload, size, "%u,%u,%lu,%lu,%lu,%u,%u,%s", _totals.wakes, _totals.radioWakes, 
+    static_cast<unsigned long>(_totals.awakeMillis), static_cast<unsigned long>(_totals.radioMillis), 
+    static_cast<unsigned long>(_totals.bytesSent), _totals.flashWrites, 
+    _totals.overruns, _totals.overruns > 0 && _totals.lastOverrunPhase < PHASE_COUNT ? PHASE_NAMES[_totals.lastOverrunPhase] : "");
+}
+
+// The phases of the last wake with the radio on, as name=µs/free heap/largest free block;...
+bool WakeMetrics::formatPhases(char* payload, size_t size) {
+  if (!_hasPreviousPhases) {
+    return false;
+  }
+  size_t length = 0;
+  payload[0] = 0;
+  for (int i = 0; i < PHASE_COUNT && length < size; i++) {
+    length += snprintf(payload + length, size - length, "%s%s=%lu/%u/%u", i == 0 ? "" : ";", PHASE_NAMES[i], 
+      static_cast<unsigned long>(_previousPhases[i].micros), _previousPhases[i].freeHeap, _previousPhases[i].maxFreeBlock);
+  }
+  return true;
+}
+
+void WakeMetrics::overran(Phase phase) {
+  if (_totals.overruns < UINT8_MAX) {
+    _totals.overruns++;
+  }
+  _totals.lastOverrunPhase = phase;
+  save();
+}
+
+void WakeMetrics::reset() {
+  memset(&_totals, 0, sizeof(_totals));
+  save();
+}
+
+// Changes every wake, so RTC memory only
+void WakeMetrics::save() {
+  _store->save(RECORD_WAKE_METRICS, &_totals, sizeof(_totals));
+}
+
+void WakeMetrics::startPhase(Phase phase) {
+  endPhase();
+  _currentPhase = phase;
+  _phaseStartMicros = micros();
+}
+
+void WakeMetrics::takeHeapStats(PhaseStats* stats) {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  stats->freeHeap = freeHeap > UINT16_MAX ? UINT16_MAX : freeHeap;
+  stats->maxFreeBlock = ESP.getMaxFreeBlockSize();
+}
+
+uint16_t WakeMetrics::wakes() {
+  return _totals.wakes;
+}
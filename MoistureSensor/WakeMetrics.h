@@ -0,0 +1,66 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// This class keeps track of what the wakes cost: how long we were awake (with and without the radio), how many bytes
+// we sent and how often we wrote to flash. The totals are kept in the persistent store (RTC memory only) until they get
+// reported, so dividing them by the number of wakes gives the average cost per wake of the current configuration.
+// The current wake is added just before deep sleep, so a report covers the wakes before the one sending it.
+// It also times the phases of a wake (with microsecond resolution), and takes the free heap and the largest free
+// block at the end of each phase. It keeps those of the last wake with the radio on, since these are the ones
+// that vary. A phase can run more than once in a wake, e.g. publishing; the times are added up.
+// Wakes that ran out of time (see WakeBudget) are counted along with the phase they were in.
+
+#ifndef HEADER_WAKEMETRICS
+#define HEADER_WAKEMETRICS
+
+#include <stddef.h>
+#include "PersistentStore.h"
+
+class WakeMetrics {
+public:
+    enum Phase { PHASE_BOOT, PHASE_WIFI, PHASE_NTP, PHASE_MQTT, PHASE_MEASURE, PHASE_PUBLISH, PHASE_FIRMWARE, PHASE_COUNT };
+    void begin(PersistentStore* store);
+    void endPhase();
+    void endWake(unsigned long awakeMillis, bool radioEnabled, uint32_t bytesSent, bool flashWritten);
+    void format(char* payload, size_t size);
+    bool formatPhases(char* payload, size_t size);
+    void overran(Phase phase);
+    void reset();
+    void startPhase(Phase phase);
+    uint16_t wakes();
+private:
+    static const int NO_PHASE = -1;
+    struct PhaseStats {
+        uint32_t micros;
+        uint16_t freeHeap;
+        uint16_t maxFreeBlock;
+    };
+    struct Totals {
+        uint16_t wakes;
+        uint16_t radioWakes;
+        uint32_t awakeMillis;
+        uint32_t radioMillis;
+        uint32_t bytesSent;
+        uint16_t flashWrites;
+        uint8_t overruns;
+        uint8_t lastOverrunPhase;
+    };
+    PersistentStore* _store;
+    Totals _totals;
+    PhaseStats _phases[PHASE_COUNT];
+    PhaseStats _previousPhases[PHASE_COUNT];
+    bool _hasPreviousPhases = false;
+    int _currentPhase = NO_PHASE;
+    uint32_t _phaseStartMicros = 0;
+    void save();
+    void takeHeapStats(PhaseStats* stats);
+};
+#endif
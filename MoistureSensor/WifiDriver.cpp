@@ -14,25 +14,265 @@
 #include <WiFiClientSecure.h>
 #include "WifiDriver.h"
 
-BearSSL::WiFiClientSecure wifiClient;
-BearSSL::X509List caCert(CONFIG_ROOTCA_CERTIFICATE);
-BearSSL::X509List clientCert(CONFIG_DEVICE_CERTIFICATE);
-BearSSL::PrivateKey clientKey(SECRET_DEVICE_PRIVATE_KEY);
+// Keeps the TLS session of the MQTT broker, so its connections (also after deep sleep) can skip the full handshake.
+// Other hosts (the firmware server) don't replace it. The session lives in the persistent store, which only keeps
+// it in RTC memory. The handshake counts are those of the broker too.
+class ResumingClient : public BearSSL::WiFiClientSecure {
+public:
+  void begin(PersistentStore* store);
+  int connect(const char* name, uint16_t port) override;
+  int connect(const String& host, uint16_t port) override;
+  unsigned long connectMillis();
+  using BearSSL::WiFiClientSecure::write;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  uint32_t bytesSent();
+  uint16_t fullHandshakes();
+  uint16_t resumedHandshakes();
+private:
+  struct SessionCache {
+    BearSSL::Session session;
+    uint16_t fullHandshakes;
+    uint16_t resumedHandshakes;
+  };
+  PersistentStore* _store = nullptr;
+  SessionCache _cache;
+  uint32_t _bytesSent = 0;
+  unsigned long _connectMillis = 0;
+};
 
-bool WifiDriver::begin() {
+void ResumingClient::begin(PersistentStore* store) {
+  _store = store;
+  if (!_store->load(RECORD_TLS_SESSIONS, &_cache, sizeof(_cache))) {
+    _cache = SessionCache();
+  }
+}
+
+int ResumingClient::connect(const char* name, uint16_t port) {
+  if (_store == nullptr || port != CONFIG_MQTT_PORT || strcmp(name, CONFIG_MQTT_BROKER) != 0) {
+    unsigned long startMillis = millis();
+    int result = BearSSL::WiFiClientSecure::connect(name, port);
+    _connectMillis = millis() - startMillis;
+    return result;
+  }
+  BearSSL::Session* session = &_cache.session;
+  // the session is opaque, so we compare the raw bytes to see whether the handshake was resumed
+  uint8_t previousSession[sizeof(BearSSL::Session)];
+  memcpy(previousSession, session, sizeof(previousSession));
+  static const uint8_t EMPTY_SESSION[sizeof(BearSSL::Session)] = { 0 };
+  bool hadSession = memcmp(previousSession, EMPTY_SESSION, sizeof(previousSession)) != 0;
+  setSession(session);
+  unsigned long startMillis = millis();
+  int result = BearSSL::WiFiClientSecure::connect(name, port);
+  _connectMillis = millis() - startMillis;
+  setSession(nullptr);
+  if (result) {
+    if (hadSession && memcmp(previousSession, session, sizeof(previousSession)) == 0) {
+      _cache.resumedHandshakes++;
+    } else {
+      _cache.fullHandshakes++;
+    }
+    _store->save(RECORD_TLS_SESSIONS, &_cache, sizeof(_cache));
+  }
+  return result;
+}
+
+int ResumingClient::connect(const String& host, uint16_t port) {
+  return connect(host.c_str(), port);
+}
+
+// TCP connect plus TLS handshake of the last connection
+unsigned long ResumingClient::connectMillis() {
+  return _connectMillis;
+}
+
+// Application data only, so this excludes the TLS overhead
+uint32_t ResumingClient::bytesSent() {
+  return _bytesSent;
+}
+
+uint16_t ResumingClient::fullHandshakes() {
+  return _cache.fullHandshakes;
+}
+
+uint16_t ResumingClient::resumedHandshakes() {
+  return _cache.resumedHandshakes;
+}
+
+size_t ResumingClient::write(const uint8_t* buffer, size_t size) {
+  size_t written = BearSSL::WiFiClientSecure::write(buffer, size);
+  _bytesSent += written;
+  return written;
+}
+
+ResumingClient wifiClient;
+// Parsed on first use, so wakes without the radio don't pay for it (and neither does static construction)
+BearSSL::X509List* caCert = nullptr;
+BearSSL::X509List* clientCert = nullptr;
+BearSSL::PrivateKey* clientKey = nullptr;
+
+// secrets.h can define the certificates and the key as PEM text (char arrays) or as DER (uint8_t arrays).
+// DER skips the base64 decoding, and the overloads pick the right parser.
+template <size_t N> static BearSSL::X509List* loadCertificates(const char (&pem)[N]) {
+  return new BearSSL::X509List(pem);
+}
+
+template <size_t N> static BearSSL::X509List* loadCertificates(const uint8_t (&der)[N]) {
+  return new BearSSL::X509List(der, N);
+}
+
+template <size_t N> static BearSSL::PrivateKey* loadPrivateKey(const char (&pem)[N]) {
+  return new BearSSL::PrivateKey(pem);
+}
+
+template <size_t N> static BearSSL::PrivateKey* loadPrivateKey(const uint8_t (&der)[N]) {
+  return new BearSSL::PrivateKey(der, N);
+}
+
+const unsigned long FAST_CONNECT_TIMEOUT_MILLIS = 3000;
+const unsigned long CONNECT_TIMEOUT_MILLIS = 10000;
+
+bool WifiDriver::begin(PersistentStore* store, std::function<void(void)> idleCallback, unsigned long timeoutMillis) {
+  _store = store;
+  _idleCallback = idleCallback;
+  unsigned long startMillis = millis();
+  if (!loadCredentials()) {
+    return false;
+  }
+  // Don't let the SDK write the WiFi configuration to flash on every connect
+  WiFi.persistent(false);
   WiFi.mode(WIFI_STA);
-  wifiClient.setClientRSACert(&clientCert, &clientKey);
-  wifiClient.setTrustAnchors(&caCert);
+  wifiClient.begin(store);
+  // EC (P-256) keys sign much faster than RSA on this CPU
+  if (clientKey->isEC()) {
+    wifiClient.setClientECCert(clientCert, clientKey, BR_KEYTYPE_KEYX | BR_KEYTYPE_SIGN, CONFIG_DEVICE_CERTIFICATE_ISSUER_KEY_TYPE);
+  } else {
+    wifiClient.setClientRSACert(clientCert, clientKey);
+  }
+  wifiClient.setTrustAnchors(caCert);
   if (!WiFi.hostname(CONFIG_DEVICE_NAME)) {
     Serial.println("Could not set host name");
   }
-  WiFi.begin(SECRET_SSID, SECRET_WIFI_PASSWORD);
-  Serial.print("Connecting");
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    attempts++;
-    Serial.print(".");
+  _fastConnect = connectWithCache(timeoutMillis < FAST_CONNECT_TIMEOUT_MILLIS ? timeoutMillis : FAST_CONNECT_TIMEOUT_MILLIS);
+  bool connected = _fastConnect;
+  unsigned long elapsedMillis = millis() - startMillis;
+  if (!connected && elapsedMillis < timeoutMillis) {
+    unsigned long remainingMillis = timeoutMillis - elapsedMillis;
+    Serial.print("Connecting");
+    WiFi.begin(SECRET_SSID, SECRET_WIFI_PASSWORD);
+    connected = waitForConnection(remainingMillis < CONNECT_TIMEOUT_MILLIS ? remainingMillis : CONNECT_TIMEOUT_MILLIS);
+    if (connected) {
+      saveConnection();
+    }
+  }
+  _connectMillis = millis() - startMillis;
+  Serial.printf("%s connect took %lu ms\n", _fastConnect ? "Fast" : "Full", _connectMillis);
+  return connected;
+}
+
+void WifiDriver::end() {
+  wifiClient.stop();
+  WiFi.disconnect(true);
+}
+
+unsigned long WifiDriver::tlsConnectMillis() {
+  return wifiClient.connectMillis();
+}
+
+uint32_t WifiDriver::credentialHeap() {
+  return _credentialHeap;
+}
+
+uint32_t WifiDriver::credentialMicros() {
+  return _credentialMicros;
+}
+
+bool WifiDriver::isConnected() {
+  return WiFi.status() == WL_CONNECTED;
+}
+
+uint32_t WifiDriver::bytesSent() {
+  return wifiClient.bytesSent();
+}
+
+uint16_t WifiDriver::fullHandshakes() {
+  return wifiClient.fullHandshakes();
+}
+
+uint16_t WifiDriver::resumedHandshakes() {
+  return wifiClient.resumedHandshakes();
+}
+
+unsigned long WifiDriver::connectMillis() {
+  return _connectMillis;
+}
+
+// Keeps what parsing cost, so the PEM/RSA and DER/EC setups can be compared
+// Parse the certificates and the key if we didn't do that yet. If one of them doesn't parse, nothing is kept.
+bool WifiDriver::loadCredentials() {
+  if (caCert != nullptr) {
+    return true;
+  }
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t startMicros = micros();
+  caCert = loadCertificates(CONFIG_ROOTCA_CERTIFICATE);
+  clientCert = loadCertificates(CONFIG_DEVICE_CERTIFICATE);
+  clientKey = loadPrivateKey(SECRET_DEVICE_PRIVATE_KEY);
+  if (caCert->getCount() == 0 || clientCert->getCount() == 0 || !(clientKey->isEC() || clientKey->isRSA())) {
+    Serial.println("Could not parse the certificates or the device key");
+    delete caCert;
+    delete clientCert;
+    delete clientKey;
+    caCert = nullptr;
+    clientCert = nullptr;
+    clientKey = nullptr;
+    return false;
+  }
+  _credentialMicros = micros() - startMicros;
+  _credentialHeap = freeHeap - ESP.getFreeHeap();
+  Serial.printf("Credentials took %lu µs and %lu bytes of heap\n", 
+    static_cast<unsigned long>(_credentialMicros), static_cast<unsigned long>(_credentialHeap));
+  return true;
+}
+
+// Skip the scan and DHCP by using the access point and lease of the last successful connection
+bool WifiDriver::connectWithCache(unsigned long timeoutMillis) {
+  ConnectionCache cache;
+  if (!_store->load(RECORD_WIFI, &cache, sizeof(cache))) {
+    return false;
+  }
+  WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+  WiFi.begin(SECRET_SSID, SECRET_WIFI_PASSWORD, cache.channel, cache.bssid, true);
+  if (waitForConnection(timeoutMillis)) {
+    return true;
+  }
+  Serial.println("Fast connect failed, scanning");
+  WiFi.disconnect();
+  // back to DHCP
+  WiFi.config(IPAddress(), IPAddress(), IPAddress());
+  return false;
+}
+
+bool WifiDriver::isFastConnect() {
+  return _fastConnect;
+}
+
+// This only changes if the access point or the lease changes, so it's worth keeping in flash too
+void WifiDriver::saveConnection() {
+  ConnectionCache cache;
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.ip = WiFi.localIP();
+  cache.gateway = WiFi.gatewayIP();
+  cache.subnet = WiFi.subnetMask();
+  cache.dns = WiFi.dnsIP(0);
+  _store->save(RECORD_WIFI, &cache, sizeof(cache), true);
+}
+
+bool WifiDriver::waitForConnection(unsigned long timeoutMillis) {
+  unsigned long startMillis = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - startMillis < timeoutMillis) {
+    _idleCallback();
+    delay(10);
   }
   return WiFi.status() == WL_CONNECTED;  
 }
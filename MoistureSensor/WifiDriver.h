@@ -14,21 +14,63 @@
 // This way, you can use TLS without swithching on the insecure flag.
 // The interface hides the TLS complexity by exposing a normal WiFiClient that MQTTDriver and FirmwareManager can use.
 // So should you e.g. want to use normal HTTP instead, all you need to change is this class.
+// After a successful connect, it keeps the access point (BSSID and channel) and the DHCP lease in the persistent store.
+// The next time, it connects directly with those, skipping the scan and DHCP. If that fails, it falls back to a full connect.
+// The client keeps the TLS session of the MQTT broker (in RTC memory), so connections after deep sleep can resume it
+// instead of doing a full handshake with client certificate authentication. One session is all that fits in the
+// RTC memory budget, so the rare HTTPS connections for firmware checks don't get one and leave it alone.
+// While waiting for the connection, it calls the idle callback so the caller can do other work (e.g. measure).
+// The whole connect (fast attempt and scan) stops at the timeout the caller passes.
+// The certificates and the key get parsed on the first begin, so wakes without the radio never do. They can be PEM or
+// DER (which skips the base64 decoding), and the device key can be RSA or EC (P-256, which signs much faster).
+// If one of them doesn't parse, begin fails without touching the radio (and tries again the next time).
+// The parse time and heap, and the time of the last TLS connect, are kept so the alternatives can be compared.
+// end() switches the radio off (e.g. to wait in light sleep). Calling begin again reconnects.
 
 #ifndef HEADER_WIFIDRIVER
 #define HEADER_WIFIDRIVER
 
+#include <functional>
 #include "secrets.h"
 #include "WiFiClient.h"
+#include "PersistentStore.h"
 
 class WifiDriver {
 public:
-    bool begin();
+    bool begin(PersistentStore* store, std::function<void(void)> idleCallback, unsigned long timeoutMillis);
+    uint32_t bytesSent();
     WiFiClient* client();
+    unsigned long connectMillis();
+    uint32_t credentialHeap();
+    uint32_t credentialMicros();
+    uint16_t fullHandshakes();
+    bool isFastConnect();
+    void end();
+    bool isConnected();
     const char* macAddress();
     void printStatus();
+    uint16_t resumedHandshakes();
+    unsigned long tlsConnectMillis();
 private:
+    struct ConnectionCache {
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint32_t ip;
+        uint32_t gateway;
+        uint32_t subnet;
+        uint32_t dns;
+    };
     static const int MAC_ADDRESS_SIZE = 14;
     char _macAddress[MAC_ADDRESS_SIZE];
+    PersistentStore* _store;
+    unsigned long _connectMillis = 0;
+    bool _fastConnect = false;
+    uint32_t _credentialHeap = 0;
+    uint32_t _credentialMicros = 0;
+    std::function<void(void)> _idleCallback;
+    bool connectWithCache(unsigned long timeoutMillis);
+    bool loadCredentials();
+    void saveConnection();
+    bool waitForConnection(unsigned long timeoutMillis);
 };
 #endif
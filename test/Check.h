@@ -0,0 +1,38 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A minimal check macro for the host tests, so they don't need a test framework.
+// A test program returns checkResult() from main, which is non-zero if any check failed.
+
+#ifndef HEADER_CHECK
+#define HEADER_CHECK
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      checkFailures++; \
+    } \
+  } while (0)
+
+static int checkResult() {
+  if (checkFailures > 0) {
+    printf("%d check(s) failed\n", checkFailures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
+#endif
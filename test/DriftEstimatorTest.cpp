@@ -0,0 +1,147 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Host test of DriftEstimator: it should learn the correction factor and the startup time from simulated
+// sleeps and boots, and ignore the samples it can't trust.
+
+#include <math.h>
+#include "Check.h"
+#include "DriftEstimator.h"
+
+// A device whose timer runs fast: it sleeps 900 real seconds when asked for 945
+const double TRUE_FACTOR = 1.05;
+
+// Deterministic noise in [-1, 1)
+static double noise(uint32_t* seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return ((*seed >> 16) % 2000) / 1000.0 - 1;
+}
+
+static void testDefaults() {
+  DriftEstimator estimator;
+  CHECK(fabs(estimator.correctionFactor() - 1.062f) < 1e-6);
+  CHECK(fabs(estimator.uncertainty() - 0.01f) < 1e-6);
+  CHECK(estimator.startupSeconds() == 15.0f);
+  CHECK(estimator.state().sleepSamples == 0);
+  CHECK(estimator.state().startupSamples == 0);
+}
+
+static void testConvergesOnCorrectionFactor() {
+  DriftEstimator estimator;
+  uint32_t seed = 1;
+  for (int i = 0; i < 30; i++) {
+    // the time NTP says passed is off by up to half a second, and the sleeps vary in length
+    double actualSeconds = 900.0 * (1 + i % 4);
+    double requestedSeconds = actualSeconds * TRUE_FACTOR;
+    CHECK(estimator.addSleepSample(requestedSeconds, actualSeconds + 0.5 * noise(&seed)));
+  }
+  CHECK(fabs(estimator.correctionFactor() - TRUE_FACTOR) < 0.001);
+  CHECK(estimator.uncertainty() < 0.01f);
+  CHECK(estimator.state().sleepSamples == 30);
+  // asking for 900 real seconds gets the timer 945 seconds
+  CHECK(fabs(estimator.requestedMicrosFor(900) / 1e6 - 900 * TRUE_FACTOR) < 1.0);
+}
+
+static void testUncertaintyHasAFloor() {
+  DriftEstimator estimator;
+  for (int i = 0; i < 20; i++) {
+    estimator.addSleepSample(900 * TRUE_FACTOR, 900);
+  }
+  CHECK(fabs(estimator.correctionFactor() - TRUE_FACTOR) < 1e-4);
+  CHECK(fabs(estimator.uncertainty() - 0.002f) < 1e-6);
+}
+
+static void testRejectsUnusableSamples() {
+  DriftEstimator estimator;
+  // too short to say anything, or no real time at all
+  CHECK(!estimator.addSleepSample(30, 28));
+  CHECK(!estimator.addSleepSample(900, 0));
+  CHECK(!estimator.addSleepSample(900, -5));
+  CHECK(estimator.state().sleepSamples == 0);
+  CHECK(fabs(estimator.correctionFactor() - 1.062f) < 1e-6);
+}
+
+static void testRejectsOutliersOnceItHasAnEstimate() {
+  DriftEstimator estimator;
+  // the first samples can't be judged yet, so even a bad one counts
+  CHECK(estimator.addSleepSample(900 * 1.3, 900));
+  for (int i = 0; i < 20; i++) {
+    CHECK(estimator.addSleepSample(900 * TRUE_FACTOR, 900));
+  }
+  float factor = estimator.correctionFactor();
+  CHECK(fabs(factor - TRUE_FACTOR) < 0.01);
+  uint16_t samples = estimator.state().sleepSamples;
+  // a bad NTP response (e.g. a minute off) over a short sleep, and a timer that ran way off
+  CHECK(!estimator.addSleepSample(900 * TRUE_FACTOR, 900 + 180));
+  CHECK(!estimator.addSleepSample(900 * TRUE_FACTOR * 1.2, 900));
+  CHECK(estimator.correctionFactor() == factor);
+  CHECK(estimator.state().sleepSamples == samples);
+  // within the deviation it still learns
+  CHECK(estimator.addSleepSample(900 * TRUE_FACTOR * 1.1, 900));
+  CHECK(estimator.correctionFactor() > factor);
+}
+
+static void testConvergesOnStartupTime() {
+  DriftEstimator estimator;
+  uint32_t seed = 7;
+  for (int i = 0; i < 30; i++) {
+    estimator.addStartupSample(6.0 + noise(&seed));
+  }
+  CHECK(fabs(estimator.startupSeconds() - 6.0f) < 0.5);
+  CHECK(estimator.state().startupSamples == 30);
+}
+
+static void testClampsStartupTime() {
+  DriftEstimator estimator;
+  for (int i = 0; i < 30; i++) {
+    estimator.addStartupSample(100);
+  }
+  CHECK(fabs(estimator.startupSeconds() - 40.0f) < 0.01);
+  for (int i = 0; i < 50; i++) {
+    estimator.addStartupSample(-3);
+  }
+  CHECK(fabs(estimator.startupSeconds() - 1.0f) < 0.01);
+}
+
+static void testRequestedMicros() {
+  DriftEstimator estimator;
+  CHECK(estimator.requestedMicrosFor(0) == 0);
+  CHECK(estimator.requestedMicrosFor(-1) == 0);
+  CHECK(estimator.requestedMicrosFor(100) == static_cast<uint64_t>(100.0 * estimator.correctionFactor() * 1e6));
+}
+
+static void testStateRoundTrip() {
+  DriftEstimator estimator;
+  for (int i = 0; i < 5; i++) {
+    estimator.addSleepSample(900 * TRUE_FACTOR, 900);
+    estimator.addStartupSample(8);
+  }
+  DriftEstimator restored;
+  restored.setState(estimator.state());
+  CHECK(restored.correctionFactor() == estimator.correctionFactor());
+  CHECK(restored.uncertainty() == estimator.uncertainty());
+  CHECK(restored.startupSeconds() == estimator.startupSeconds());
+  CHECK(restored.state().sleepSamples == 5);
+  CHECK(restored.state().startupSamples == 5);
+}
+
+int main() {
+  testDefaults();
+  testConvergesOnCorrectionFactor();
+  testUncertaintyHasAFloor();
+  testRejectsUnusableSamples();
+  testRejectsOutliersOnceItHasAnEstimate();
+  testConvergesOnStartupTime();
+  testClampsStartupTime();
+  testRequestedMicros();
+  testStateRoundTrip();
+  return checkResult();
+}
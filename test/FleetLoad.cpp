@@ -0,0 +1,591 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+
+// Shows the load a fleet of sensors puts on one MQTT broker, and how much slot jitter (Scheduler::setSlotJitter)
+// takes off the peaks. The publish pattern of a wake comes from MoistureSensor.ino itself: it runs as the sketch module
+// (see SketchModule.h) against the fake broker, which keeps what every write of the device held, i.e. every TLS
+// record. Its first connection after a cold start (with the announcement) is the pattern of a cold start, and the
+// connection of a later wake with the radio on is the normal one.
+// The run times of every device come from the real Scheduler, without and with slot jitter. Two scenarios: devices
+// that started at random times, and all of them starting within seconds after a power cut.
+// Then a discrete event model of a single threaded broker (like mosquitto) plays those wakes for the whole fleet, with
+// the costs below. Its messages per second, connect latency (from the TCP connect to the CONNACK) and publish latency
+// (from the write on the device until the broker handled the message) are estimates, as good as those costs.
+// With a broker (host[:port], plain MQTT on 1883 by default), it also replays the busiest REPLAY_SECONDS of every
+// scenario on it in real time, and measures the same. Every wake is a TCP connection with the writes of its pattern,
+// and a client ID of its own. A PINGREQ follows every write with publishes; the broker handles the packets of a
+// connection in order, so its PINGRESP says when the publishes were handled. There is no TLS, so that part of the
+// load is missing; the retained messages of all devices go to the topics of one.
+//   FleetLoad [devices] [hours] [broker[:port]]
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <queue>
+#include <random>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include <ESP.h>
+#include "FakeNetwork.h"
+#include "PersistentStore.h"
+#include "Scheduler.h"
+#include "SketchModule.h"
+
+// as in MoistureSensor.ino
+const long INTERVAL_SECONDS = 900;
+const int BATCH_SIZE = 4;
+// as in Scheduler.cpp: devices aim to be up this long before the run
+const double WAKE_MARGIN_SECONDS = 3.0;
+
+// Recording: enough wakes for the first runs to be over, and the time an NTP request takes
+const int RECORDED_WAKES = 3 * BATCH_SIZE;
+const unsigned long NTP_MILLIS = 50;
+
+// Device side. How far off a wake is after DriftEstimator corrected it, how long WiFi takes (fast reconnect to a known
+// access point), and the time between two writes. After a power cut, the devices start within POWER_RETURN_SECONDS.
+const double WAKE_ERROR_SECONDS = 1.0;
+const double WIFI_MIN_MILLIS = 800;
+const double WIFI_MAX_MILLIS = 2500;
+const double WRITE_GAP_MILLIS = 10;
+const double POWER_RETURN_SECONDS = 10;
+
+// Network and broker in the model. Rough costs for a small broker on a LAN; change them to what your broker shows.
+// A cold start needs a full TLS handshake, since the session to resume was in RTC memory.
+const double RTT_MILLIS = 5;
+const double FULL_HANDSHAKE_MILLIS = 8;
+const double RESUMED_HANDSHAKE_MILLIS = 1;
+const double CONNECT_MILLIS = 0.2;
+const double PACKET_MILLIS = 0.02;
+const double RETAIN_MILLIS = 0.03;
+const double BYTE_MILLIS = 0.00002;
+
+// Replay on a broker: the busiest part of every scenario, and how long the broker gets to finish it after that
+const double REPLAY_SECONDS = 10;
+const double REPLAY_TIMEOUT_SECONDS = 30;
+const char* DEFAULT_BROKER_PORT = "1883";
+const uint8_t MQTT_CONNACK = 2 << 4;
+const uint8_t MQTT_PINGREQ = 12 << 4;
+const uint8_t MQTT_PINGRESP = 13 << 4;
+const uint8_t MQTT_DISCONNECT = 14 << 4;
+
+// 2024-10-17 00:00:00 UTC
+const time_t START_TIME = 1729123200;
+
+// the writes of one connection to the broker
+typedef std::vector<Fake::Broker::Write> WakePattern;
+
+// Runs MoistureSensor.ino from a cold start, and keeps the first connection of the first wake and the last connection
+// of the last wake with the radio on
+static bool recordWakes(WakePattern* coldWake, WakePattern* normalWake) {
+  Fake::reset();
+  Fake::setSerialOutput(getenv("SERIAL") != nullptr);
+  SketchNetwork network;
+  Fake::boot(REASON_DEFAULT_RST, true);
+  for (int wake = 0; wake < RECORDED_WAKES; wake++) {
+    Fake::setNetwork(true, NTP_MILLIS);
+    network.broker.clearWrites();
+    if (!SketchModule::runWake(SKETCH_DEFAULT_MODULE, []() {})) {
+      return false;
+    }
+    std::vector<WakePattern> connections;
+    for (const Fake::Broker::Write& write : network.broker.writes()) {
+      if (write.connect || connections.empty()) {
+        connections.emplace_back();
+      }
+      connections.back().push_back(write);
+    }
+    if (connections.empty()) {
+      continue;
+    }
+    if (wake == 0) {
+      *coldWake = connections.front();
+    } else {
+      *normalWake = connections.back();
+    }
+  }
+  return !coldWake->empty() && !normalWake->empty() && coldWake->front().connect && normalWake->front().connect;
+}
+
+// The first run of a device that got the time at that moment, from the real Scheduler
+static time_t firstRunAfter(time_t now, uint32_t chipId, bool slotJitter) {
+  Fake::boot(REASON_DEFAULT_RST, true);
+  PersistentStore store;
+  store.begin(nullptr, nullptr);
+  Scheduler scheduler;
+  scheduler.begin(&store, INTERVAL_SECONDS);
+  if (slotJitter) {
+    scheduler.setSlotJitter(chipId);
+  }
+  struct timeval time = { now, 0 };
+  settimeofday(&time, nullptr);
+  return scheduler.getNextRunTimestamp();
+}
+
+// A wake with the radio on, from the moment the device starts the TCP connect to the broker
+struct Wake {
+    int device;
+    double startMillis;
+    const WakePattern* pattern;
+    bool fullHandshake;
+};
+
+struct Scenario {
+    const char* name;
+    bool powerCut;
+    bool slotJitter;
+};
+
+// The wakes with the radio on in the simulated period, with times relative to its start
+static std::vector<Wake> scheduleFleet(const Scenario& scenario, int devices, double hours, const WakePattern* coldWake, 
+  const WakePattern* normalWake, std::mt19937* random) {
+  std::uniform_real_distribution<double> wifiMillis(WIFI_MIN_MILLIS, WIFI_MAX_MILLIS);
+  std::uniform_real_distribution<double> wakeError(-WAKE_ERROR_SECONDS, WAKE_ERROR_SECONDS);
+  std::uniform_real_distribution<double> bootSeconds(scenario.powerCut ? 0 : -86400, scenario.powerCut ? POWER_RETURN_SECONDS : 0);
+  std::uniform_int_distribution<int> batchPhase(0, BATCH_SIZE - 1);
+  double endSeconds = hours * 3600;
+  std::vector<Wake> wakes;
+  for (int device = 0; device < devices; device++) {
+    uint32_t chipId = 0x100000 + device;
+    double bootTime = bootSeconds(*random);
+    int phase = 0;
+    if (scenario.powerCut) {
+      wakes.push_back({ device, bootTime * 1000 + wifiMillis(*random), coldWake, true });
+    } else {
+      phase = batchPhase(*random);
+    }
+    time_t firstRun = firstRunAfter(START_TIME + static_cast<time_t>(floor(bootTime)), chipId, scenario.slotJitter) - START_TIME;
+    for (long run = 0; firstRun + run * INTERVAL_SECONDS < endSeconds; run++) {
+      double runTime = firstRun + run * INTERVAL_SECONDS;
+      if (runTime < 0 || (run + phase) % BATCH_SIZE != 0) {
+        continue;
+      }
+      double readyTime = runTime - WAKE_MARGIN_SECONDS + wakeError(*random);
+      wakes.push_back({ device, readyTime * 1000 + wifiMillis(*random), normalWake, false });
+    }
+  }
+  return wakes;
+}
+
+struct Results {
+    unsigned long wakes = 0;
+    unsigned long messages = 0;
+    double seconds = 0;
+    int peakMessages = 0;
+    int peakConnects = 0;
+    std::vector<double> connectMillis;
+    std::vector<double> publishMillis;
+};
+
+// Something that arrives at the broker: the TLS handshake (write -1) or a write of the device
+struct Arrival {
+    double millis;
+    double sentMillis;
+    size_t wake;
+    int write;
+    bool operator>(const Arrival& other) const { return millis > other.millis; }
+};
+
+// The broker handles one thing at a time, in the order it arrives. Only the CONNECT makes the device wait;
+// the rest is QoS 0, so the device keeps writing.
+static Results simulateBroker(const std::vector<Wake>& wakes, double hours) {
+  Results results;
+  results.wakes = wakes.size();
+  results.seconds = hours * 3600;
+  std::vector<int> messagesPerSecond(static_cast<size_t>(results.seconds) + 1);
+  std::vector<int> connectsPerSecond(messagesPerSecond.size());
+  std::priority_queue<Arrival, std::vector<Arrival>, std::greater<Arrival>> arrivals;
+  for (size_t i = 0; i < wakes.size(); i++) {
+    arrivals.push({ wakes[i].startMillis + RTT_MILLIS, wakes[i].startMillis, i, -1 });
+  }
+  double brokerFreeMillis = -1e12;
+  while (!arrivals.empty()) {
+    Arrival arrival = arrivals.top();
+    arrivals.pop();
+    const Wake& wake = wakes[arrival.wake];
+    double startMillis = std::max(arrival.millis, brokerFreeMillis);
+    if (arrival.write < 0) {
+      brokerFreeMillis = startMillis + (wake.fullHandshake ? FULL_HANDSHAKE_MILLIS : RESUMED_HANDSHAKE_MILLIS);
+      // the client's part of the handshake, and then the CONNECT
+      double handshakeRoundTrips = wake.fullHandshake ? 2 : 1;
+      arrivals.push({ brokerFreeMillis + handshakeRoundTrips * RTT_MILLIS, brokerFreeMillis + RTT_MILLIS / 2, arrival.wake, 0 });
+      continue;
+    }
+    const Fake::Broker::Write& write = (*wake.pattern)[arrival.write];
+    brokerFreeMillis = startMillis + write.packets * PACKET_MILLIS + write.retained * RETAIN_MILLIS + 
+      write.bytes * BYTE_MILLIS + (write.connect ? CONNECT_MILLIS : 0);
+    long second = static_cast<long>(floor(brokerFreeMillis / 1000));
+    bool counted = second >= 0 && second < static_cast<long>(messagesPerSecond.size());
+    if (write.connect) {
+      double connackMillis = brokerFreeMillis + RTT_MILLIS / 2;
+      results.connectMillis.push_back(connackMillis - wake.startMillis);
+      connectsPerSecond[counted ? second : 0] += counted ? 1 : 0;
+      for (size_t next = arrival.write + 1; next < wake.pattern->size(); next++) {
+        double sentMillis = connackMillis + (next - arrival.write) * WRITE_GAP_MILLIS;
+        arrivals.push({ sentMillis + RTT_MILLIS / 2, sentMillis, arrival.wake, static_cast<int>(next) });
+      }
+    }
+    if (write.publishes > 0 && counted) {
+      messagesPerSecond[second] += write.publishes;
+      results.messages += write.publishes;
+      results.publishMillis.insert(results.publishMillis.end(), write.publishes, brokerFreeMillis - arrival.sentMillis);
+    }
+  }
+  results.peakMessages = *std::max_element(messagesPerSecond.begin(), messagesPerSecond.end());
+  results.peakConnects = *std::max_element(connectsPerSecond.begin(), connectsPerSecond.end());
+  return results;
+}
+
+// A wake replayed on the broker, on a TCP connection of its own
+struct Replay {
+    const Wake* wake;
+    double startMillis;
+    int socket = -1;
+    bool connected = false;
+    bool acknowledged = false;
+    bool closed = false;
+    size_t nextWrite = 0;
+    double nextWriteMillis = 0;
+    std::vector<uint8_t> output;
+    std::vector<uint8_t> input;
+    // the writes with publishes that wait for their PINGRESP: when they were sent, and how many publishes they held
+    std::deque<std::pair<double, int>> pings;
+};
+
+static void appendLength(std::vector<uint8_t>* packet, size_t length) {
+  do {
+    uint8_t digit = length % 128;
+    length /= 128;
+    packet->push_back(length > 0 ? digit | 0x80 : digit);
+  } while (length > 0);
+}
+
+// The CONNECT at the start of the write, with the device number added to the client ID, so the broker doesn't take
+// the connections for one client
+static std::vector<uint8_t> withClientId(const std::vector<uint8_t>& data, int device) {
+  size_t position = 1;
+  size_t length = 0;
+  int shift = 0;
+  uint8_t digit;
+  do {
+    digit = data[position++];
+    length |= static_cast<size_t>(digit & 0x7F) << shift;
+    shift += 7;
+  } while (digit & 0x80);
+  // the protocol name, level, flags and keep alive, then the client ID
+  size_t idStart = position + 2 + (data[position] << 8 | data[position + 1]) + 4;
+  size_t idLength = data[idStart] << 8 | data[idStart + 1];
+  std::string id = std::string(data.begin() + idStart + 2, data.begin() + idStart + 2 + idLength) + "-" + std::to_string(device);
+  std::vector<uint8_t> packet = { data[0] };
+  appendLength(&packet, length - idLength + id.size());
+  packet.insert(packet.end(), data.begin() + position, data.begin() + idStart);
+  packet.insert(packet.end(), { static_cast<uint8_t>(id.size() >> 8), static_cast<uint8_t>(id.size() & 0xFF) });
+  packet.insert(packet.end(), id.begin(), id.end());
+  packet.insert(packet.end(), data.begin() + idStart + 2 + idLength, data.end());
+  return packet;
+}
+
+// The next write of the pattern, with a PINGREQ after the publishes (before a DISCONNECT, which ends the connection)
+static void queueWrite(Replay* replay, double nowMillis) {
+  const Fake::Broker::Write& write = (*replay->wake->pattern)[replay->nextWrite++];
+  std::vector<uint8_t> data = write.connect ? withClientId(write.data, replay->wake->device) : write.data;
+  if (write.publishes > 0) {
+    bool disconnects = data.size() >= 2 && data[data.size() - 2] == MQTT_DISCONNECT && data.back() == 0;
+    data.insert(data.end() - (disconnects ? 2 : 0), { MQTT_PINGREQ, 0 });
+    replay->pings.push_back({ nowMillis, write.publishes });
+  }
+  replay->output.insert(replay->output.end(), data.begin(), data.end());
+  replay->nextWriteMillis = nowMillis + WRITE_GAP_MILLIS;
+}
+
+static bool isDone(const Replay& replay) {
+  return replay.acknowledged && replay.nextWrite == replay.wake->pattern->size() && replay.pings.empty() && 
+    replay.output.empty();
+}
+
+static void closeReplay(Replay* replay, int* failures) {
+  ::close(replay->socket);
+  replay->closed = true;
+  *failures += isDone(*replay) ? 0 : 1;
+}
+
+static void countIn(std::vector<int>* perSecond, double millis, int count) {
+  size_t second = static_cast<size_t>(std::max(0.0, millis / 1000));
+  (*perSecond)[std::min(second, perSecond->size() - 1)] += count;
+}
+
+// The CONNACK and the PINGRESPs in what the broker sent; the rest (SUBACK, retained messages) doesn't matter here
+static void readPackets(Replay* replay, double nowMillis, Results* results, std::vector<int>* messagesPerSecond, 
+  std::vector<int>* connectsPerSecond, int* failures) {
+  size_t offset = 0;
+  while (offset + 2 <= replay->input.size()) {
+    size_t position = offset + 1;
+    size_t length = 0;
+    bool lengthComplete = false;
+    for (int shift = 0; position < replay->input.size() && shift <= 21 && !lengthComplete; shift += 7) {
+      uint8_t digit = replay->input[position++];
+      length |= static_cast<size_t>(digit & 0x7F) << shift;
+      lengthComplete = (digit & 0x80) == 0;
+    }
+    if (!lengthComplete || replay->input.size() - position < length) {
+      break;
+    }
+    uint8_t type = replay->input[offset] & 0xF0;
+    if (type == MQTT_CONNACK && !replay->acknowledged) {
+      if (length < 2 || replay->input[position + 1] != 0) {
+        printf("Device %d: connection refused\n", replay->wake->device);
+        closeReplay(replay, failures);
+        return;
+      }
+      replay->acknowledged = true;
+      replay->nextWriteMillis = nowMillis + WRITE_GAP_MILLIS;
+      results->connectMillis.push_back(nowMillis - replay->startMillis);
+      countIn(connectsPerSecond, nowMillis, 1);
+    } else if (type == MQTT_PINGRESP && !replay->pings.empty()) {
+      int publishes = replay->pings.front().second;
+      results->messages += publishes;
+      results->publishMillis.insert(results->publishMillis.end(), publishes, nowMillis - replay->pings.front().first);
+      countIn(messagesPerSecond, nowMillis, publishes);
+      replay->pings.pop_front();
+    }
+    offset = position + length;
+  }
+  replay->input.erase(replay->input.begin(), replay->input.begin() + offset);
+}
+
+// Plays the wakes that start in the busiest REPLAY_SECONDS on the broker, at the same times relative to each other.
+// Counts the connections that failed or didn't finish in time.
+static Results replayOnBroker(const std::vector<Wake>& wakes, const addrinfo* broker, int* failures) {
+  std::vector<const Wake*> sorted;
+  for (const Wake& wake : wakes) {
+    sorted.push_back(&wake);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const Wake* a, const Wake* b) { return a->startMillis < b->startMillis; });
+  size_t first = 0;
+  size_t count = 0;
+  for (size_t begin = 0, end = 0; begin < sorted.size(); begin++) {
+    while (end < sorted.size() && sorted[end]->startMillis < sorted[begin]->startMillis + REPLAY_SECONDS * 1000) {
+      end++;
+    }
+    if (end - begin > count) {
+      first = begin;
+      count = end - begin;
+    }
+  }
+  std::vector<Replay> replays(count);
+  for (size_t i = 0; i < count; i++) {
+    replays[i].wake = sorted[first + i];
+    replays[i].startMillis = sorted[first + i]->startMillis - sorted[first]->startMillis;
+  }
+  Results results;
+  results.wakes = count;
+  results.seconds = REPLAY_SECONDS;
+  std::vector<int> messagesPerSecond(static_cast<size_t>(REPLAY_SECONDS + REPLAY_TIMEOUT_SECONDS) + 1);
+  std::vector<int> connectsPerSecond(messagesPerSecond.size());
+  *failures = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto elapsedMillis = [&start]() { 
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); 
+  };
+  size_t started = 0;
+  std::vector<Replay*> open;
+  while ((started < count || !open.empty()) && elapsedMillis() < (REPLAY_SECONDS + REPLAY_TIMEOUT_SECONDS) * 1000) {
+    double nowMillis = elapsedMillis();
+    for (; started < count && replays[started].startMillis <= nowMillis; started++) {
+      Replay* replay = &replays[started];
+      replay->socket = socket(broker->ai_family, broker->ai_socktype | SOCK_NONBLOCK, broker->ai_protocol);
+      if (replay->socket < 0 || (connect(replay->socket, broker->ai_addr, broker->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        printf("Device %d: %s\n", replay->wake->device, strerror(errno));
+        closeReplay(replay, failures);
+        continue;
+      }
+      replay->startMillis = nowMillis;
+      queueWrite(replay, nowMillis);
+      open.push_back(replay);
+    }
+    double waitMillis = started < count ? replays[started].startMillis - nowMillis : 100;
+    std::vector<pollfd> sockets;
+    for (Replay* replay : open) {
+      if (replay->connected && replay->acknowledged && replay->nextWrite < replay->wake->pattern->size()) {
+        if (replay->nextWriteMillis <= nowMillis) {
+          queueWrite(replay, nowMillis);
+        }
+        waitMillis = std::min(waitMillis, replay->nextWriteMillis - nowMillis);
+      }
+      if (replay->connected && !replay->output.empty()) {
+        ssize_t sent = send(replay->socket, replay->output.data(), replay->output.size(), MSG_NOSIGNAL);
+        if (sent > 0) {
+          replay->output.erase(replay->output.begin(), replay->output.begin() + sent);
+        }
+      }
+      short events = POLLIN | (!replay->connected || !replay->output.empty() ? POLLOUT : 0);
+      sockets.push_back({ replay->socket, events, 0 });
+    }
+    if (poll(sockets.data(), sockets.size(), static_cast<int>(std::max(0.0, std::min(waitMillis, 100.0)))) < 0) {
+      break;
+    }
+    nowMillis = elapsedMillis();
+    for (size_t i = 0; i < sockets.size(); i++) {
+      Replay* replay = open[i];
+      if (!replay->connected && (sockets[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        getsockopt(replay->socket, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0) {
+          printf("Device %d: %s\n", replay->wake->device, strerror(error));
+          closeReplay(replay, failures);
+          continue;
+        }
+        replay->connected = true;
+      }
+      if (sockets[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        uint8_t buffer[4096];
+        ssize_t received = recv(replay->socket, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+          replay->input.insert(replay->input.end(), buffer, buffer + received);
+          readPackets(replay, nowMillis, &results, &messagesPerSecond, &connectsPerSecond, failures);
+        } else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+          closeReplay(replay, failures);
+          continue;
+        }
+      }
+      if (!replay->closed && isDone(*replay)) {
+        closeReplay(replay, failures);
+      }
+    }
+    open.erase(std::remove_if(open.begin(), open.end(), [](Replay* replay) { return replay->closed; }), open.end());
+  }
+  for (Replay* replay : open) {
+    closeReplay(replay, failures);
+  }
+  *failures += count - started;
+  results.peakMessages = *std::max_element(messagesPerSecond.begin(), messagesPerSecond.end());
+  results.peakConnects = *std::max_element(connectsPerSecond.begin(), connectsPerSecond.end());
+  return results;
+}
+
+static double percentile(std::vector<double>* values, double fraction) {
+  if (values->empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(fraction * (values->size() - 1));
+  std::nth_element(values->begin(), values->begin() + index, values->end());
+  return (*values)[index];
+}
+
+static void printPattern(const char* name, const WakePattern& pattern) {
+  size_t bytes = 0;
+  int publishes = 0;
+  for (const Fake::Broker::Write& write : pattern) {
+    bytes += write.bytes;
+    publishes += write.publishes;
+  }
+  printf("%-12s %3zu writes %4d publishes %6zu bytes\n", name, pattern.size(), publishes, bytes);
+}
+
+static void printHeader() {
+  printf("%-16s %6s %7s %8s %8s %8s %7s %7s %7s %7s %7s %7s\n", "scenario", "jitter", "wakes", "msg/s", "peak/s", 
+    "conn/s", "conn50", "conn95", "conn99", "pub50", "pub95", "pub99");
+}
+
+static void printResults(const Scenario& scenario, Results* results) {
+  printf("%-16s %6s %7lu %8.1f %8d %8d %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f\n", scenario.name, scenario.slotJitter ? "yes" : "no",
+    results->wakes, results->messages / results->seconds, results->peakMessages, results->peakConnects, 
+    percentile(&results->connectMillis, 0.5), percentile(&results->connectMillis, 0.95), 
+    percentile(&results->connectMillis, 0.99), percentile(&results->publishMillis, 0.5), 
+    percentile(&results->publishMillis, 0.95), percentile(&results->publishMillis, 0.99));
+}
+
+// host[:port]
+static addrinfo* resolve(const std::string& broker) {
+  size_t colon = broker.rfind(':');
+  std::string host = broker.substr(0, colon);
+  std::string port = colon == std::string::npos ? DEFAULT_BROKER_PORT : broker.substr(colon + 1);
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* address = nullptr;
+  int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &address);
+  if (error != 0) {
+    printf("Could not resolve %s: %s\n", broker.c_str(), gai_strerror(error));
+    return nullptr;
+  }
+  return address;
+}
+
+int main(int argc, char* argv[]) {
+  int devices = argc > 1 ? atoi(argv[1]) : 2000;
+  double hours = argc > 2 ? atof(argv[2]) : 4;
+  addrinfo* broker = nullptr;
+  if (argc > 3 && (broker = resolve(argv[3])) == nullptr) {
+    return 1;
+  }
+  WakePattern coldWake;
+  WakePattern normalWake;
+  if (!recordWakes(&coldWake, &normalWake)) {
+    printf("Could not record the wakes of the sketch\n");
+    return 1;
+  }
+  printf("Connection of a wake with the radio on, recorded from MoistureSensor.ino (batch %d):\n", BATCH_SIZE);
+  printPattern("cold start", coldWake);
+  printPattern("normal", normalWake);
+
+  std::vector<Scenario> scenarios = {
+    { "random starts", false, false }, { "random starts", false, true },
+    { "after power cut", true, false }, { "after power cut", true, true }
+  };
+  std::vector<std::vector<Wake>> fleetWakes;
+  for (const Scenario& scenario : scenarios) {
+    // the same devices and WiFi times for both settings of the jitter
+    std::mt19937 random(42);
+    fleetWakes.push_back(scheduleFleet(scenario, devices, hours, &coldWake, &normalWake, &random));
+  }
+  printf("\nModel estimates, not measurements: %d devices, interval %ld s, %.1f hours; latencies in ms\n", devices, 
+    INTERVAL_SECONDS, hours);
+  printHeader();
+  bool complete = true;
+  for (size_t i = 0; i < scenarios.size(); i++) {
+    Results results = simulateBroker(fleetWakes[i], hours);
+    complete = complete && results.messages > 0 && results.connectMillis.size() == results.wakes;
+    printResults(scenarios[i], &results);
+  }
+  if (broker == nullptr) {
+    return complete ? 0 : 1;
+  }
+
+  // one socket per open connection; a slow broker can have many at a time
+  rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+  printf("\nMeasured on %s, without TLS: the busiest %.0f s of every scenario, in real time; latencies in ms\n", argv[3], 
+    REPLAY_SECONDS);
+  printHeader();
+  for (size_t i = 0; i < scenarios.size(); i++) {
+    int failures = 0;
+    Results results = replayOnBroker(fleetWakes[i], broker, &failures);
+    printResults(scenarios[i], &results);
+    if (failures > 0) {
+      printf("%d of %lu connections failed or didn't finish\n", failures, results.wakes);
+      complete = false;
+    }
+  }
+  freeaddrinfo(broker);
+  return complete ? 0 : 1;
+}
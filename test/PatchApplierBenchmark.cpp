@@ -0,0 +1,60 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Throughput of PatchApplier on the host, for a 1 MB image, per chunk size (1460 is what a TCP segment delivers).
+// On the device the flash and the download dominate, so this mainly shows the applier itself isn't the bottleneck
+// and how its cost scales with the chunk size.
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "PatchApplier.h"
+#include "PatchMaker.h"
+#include "TestImages.h"
+
+const int ROUNDS = 20;
+
+int main() {
+  std::vector<uint8_t> source = makeSourceImage(1024 * 1024, 1);
+  std::vector<uint8_t> target = makeTargetImage(source);
+  std::vector<uint8_t> patch = makePatch(source, target);
+  printf("image %zu bytes, patch %zu bytes\n", target.size(), patch.size());
+  std::vector<uint8_t> written(target.size());
+  const size_t chunkSizes[] = { 64, 512, 1460, 4096, 65536 };
+  for (size_t chunkSize : chunkSizes) {
+    auto start = std::chrono::steady_clock::now();
+    bool complete = true;
+    for (int round = 0; round < ROUNDS; round++) {
+      size_t writtenSize = 0;
+      PatchApplier applier;
+      applier.begin(
+        [&source](uint32_t offset, uint8_t* data, size_t size) {
+          memcpy(data, source.data() + offset, size);
+          return true;
+        },
+        source.size(),
+        [&written, &writtenSize](const uint8_t* data, size_t size) {
+          memcpy(written.data() + writtenSize, data, size);
+          writtenSize += size;
+          return true;
+        });
+      for (size_t offset = 0; offset < patch.size(); offset += chunkSize) {
+        applier.write(patch.data() + offset, patch.size() - offset < chunkSize ? patch.size() - offset : chunkSize);
+      }
+      complete = complete && applier.isComplete();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / ROUNDS;
+    printf("chunk %6zu: %7.2f ms per image, %7.1f MB/s of target%s\n", chunkSize, seconds * 1000, 
+      target.size() / seconds / 1e6, complete ? "" : " (FAILED)");
+  }
+  return 0;
+}
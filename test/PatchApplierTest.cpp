@@ -0,0 +1,166 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Host test of PatchApplier: round trips with different chunk sizes, and patches that must fail without the writer
+// ever receiving a complete image.
+
+#include <string.h>
+#include <vector>
+#include "Check.h"
+#include "PatchApplier.h"
+#include "PatchMaker.h"
+#include "PersistentStore.h"
+#include "TestImages.h"
+
+const size_t HEADER_SIZE = 20;
+
+struct Outcome {
+    bool complete;
+    bool failed;
+    const char* error;
+    std::vector<uint8_t> written;
+};
+
+static Outcome apply(const std::vector<uint8_t>& source, const std::vector<uint8_t>& patch, size_t chunkSize) {
+  Outcome outcome;
+  PatchApplier applier;
+  applier.begin(
+    [&source](uint32_t offset, uint8_t* data, size_t size) {
+      if (offset + size > source.size()) {
+        return false;
+      }
+      memcpy(data, source.data() + offset, size);
+      return true;
+    },
+    source.size(),
+    [&outcome](const uint8_t* data, size_t size) {
+      outcome.written.insert(outcome.written.end(), data, data + size);
+      return true;
+    });
+  for (size_t offset = 0; offset < patch.size(); offset += chunkSize) {
+    size_t size = patch.size() - offset < chunkSize ? patch.size() - offset : chunkSize;
+    if (!applier.write(patch.data() + offset, size)) {
+      break;
+    }
+  }
+  outcome.complete = applier.isComplete();
+  outcome.failed = applier.isFailed();
+  outcome.error = applier.error();
+  return outcome;
+}
+
+static void testRoundTrip(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target, const std::vector<uint8_t>& patch) {
+  const size_t chunkSizes[] = { 1, 7, 64, 1460, 4096, 1 << 20 };
+  for (size_t chunkSize : chunkSizes) {
+    Outcome outcome = apply(source, patch, chunkSize);
+    CHECK(outcome.complete);
+    CHECK(!outcome.failed);
+    CHECK(outcome.error == nullptr);
+    CHECK(outcome.written == target);
+  }
+  CHECK(patch.size() < target.size() / 10);
+}
+
+// The writer must never get the whole target if it is wrong
+static void checkRejected(const Outcome& outcome, size_t targetSize) {
+  CHECK(!outcome.complete);
+  CHECK(outcome.failed);
+  CHECK(outcome.error != nullptr);
+  CHECK(outcome.written.size() < targetSize);
+}
+
+static void testCorruptTarget(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target, const std::vector<uint8_t>& patch) {
+  // a wrong target CRC in the header
+  std::vector<uint8_t> wrongCrc(patch);
+  wrongCrc[16] ^= 0x01;
+  checkRejected(apply(source, wrongCrc, 1460), target.size());
+  // a changed byte in the first literal
+  std::vector<uint8_t> wrongLiteral(patch);
+  size_t position = HEADER_SIZE;
+  while (position < wrongLiteral.size() && wrongLiteral[position] != 0x02) {
+    position++;
+  }
+  CHECK(position < wrongLiteral.size());
+  // opcode, varint length (the literals are shorter than 16384 bytes), then the bytes
+  size_t literalStart = position + 1 + (wrongLiteral[position + 1] & 0x80 ? 2 : 1);
+  wrongLiteral[literalStart] ^= 0xFF;
+  Outcome outcome = apply(source, wrongLiteral, 1460);
+  checkRejected(outcome, target.size());
+  CHECK(strcmp(outcome.error, "target CRC mismatch") == 0);
+}
+
+static void testWrongSource(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target, const std::vector<uint8_t>& patch) {
+  std::vector<uint8_t> otherSource(source);
+  otherSource[source.size() / 2] ^= 0x01;
+  Outcome outcome = apply(otherSource, patch, 1460);
+  checkRejected(outcome, target.size());
+  CHECK(outcome.written.empty());
+  CHECK(strcmp(outcome.error, "made for another image") == 0);
+  // a source larger than the running image can't be ours
+  std::vector<uint8_t> smallSource(source.begin(), source.begin() + source.size() / 2);
+  checkRejected(apply(smallSource, patch, 1460), target.size());
+}
+
+static void testTruncatedPatch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target, const std::vector<uint8_t>& patch) {
+  const size_t cuts[] = { 1, 100, patch.size() / 2, patch.size() - HEADER_SIZE };
+  for (size_t cut : cuts) {
+    std::vector<uint8_t> truncated(patch.begin(), patch.end() - cut);
+    Outcome outcome = apply(source, truncated, 1460);
+    // nothing is wrong yet, it just isn't done
+    CHECK(!outcome.complete);
+    CHECK(!outcome.failed);
+    CHECK(outcome.written.size() < target.size());
+  }
+}
+
+static void testOversizedVarint(const std::vector<uint8_t>& source, const std::vector<uint8_t>& patch) {
+  std::vector<uint8_t> oversized(patch.begin(), patch.begin() + HEADER_SIZE);
+  oversized.push_back(0x02);
+  for (int i = 0; i < 6; i++) {
+    oversized.push_back(0xFF);
+  }
+  oversized.push_back(0x01);
+  Outcome outcome = apply(source, oversized, 1460);
+  CHECK(outcome.failed);
+  CHECK(strcmp(outcome.error, "varint too long") == 0);
+  CHECK(outcome.written.empty());
+  // a length that fits in a varint but not in the target
+  std::vector<uint8_t> tooLong(patch.begin(), patch.begin() + HEADER_SIZE);
+  tooLong.push_back(0x02);
+  appendVarint(&tooLong, 0xFFFFFFFF);
+  outcome = apply(source, tooLong, 1460);
+  CHECK(outcome.failed);
+  CHECK(outcome.written.empty());
+}
+
+static void testUnknownOperation(const std::vector<uint8_t>& source, const std::vector<uint8_t>& patch) {
+  std::vector<uint8_t> unknown(patch.begin(), patch.begin() + HEADER_SIZE);
+  unknown.push_back(0x7F);
+  Outcome outcome = apply(source, unknown, 1460);
+  CHECK(outcome.failed);
+  CHECK(strcmp(outcome.error, "unknown operation") == 0);
+  std::vector<uint8_t> notAPatch(patch);
+  notAPatch[0] = 'X';
+  CHECK(apply(source, notAPatch, 1460).failed);
+}
+
+int main() {
+  std::vector<uint8_t> source = makeSourceImage(500 * 1024, 1);
+  std::vector<uint8_t> target = makeTargetImage(source);
+  std::vector<uint8_t> patch = makePatch(source, target);
+  testRoundTrip(source, target, patch);
+  testCorruptTarget(source, target, patch);
+  testWrongSource(source, target, patch);
+  testTruncatedPatch(source, target, patch);
+  testOversizedVarint(source, patch);
+  testUnknownOperation(source, patch);
+  return checkResult();
+}
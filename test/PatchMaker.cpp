@@ -0,0 +1,87 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+#include <string.h>
+#include <unordered_map>
+#include "PatchMaker.h"
+#include "PersistentStore.h"
+
+const size_t BLOCK_SIZE = 16;
+const uint8_t OPCODE_COPY = 0x01;
+const uint8_t OPCODE_INSERT = 0x02;
+
+static uint64_t blockHash(const uint8_t* data) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < BLOCK_SIZE; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void appendUint32(std::vector<uint8_t>* patch, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    patch->push_back(value >> (8 * i));
+  }
+}
+
+void appendVarint(std::vector<uint8_t>* patch, uint32_t value) {
+  while (value >= 0x80) {
+    patch->push_back(0x80 | (value & 0x7F));
+    value >>= 7;
+  }
+  patch->push_back(value);
+}
+
+static void flushLiteral(std::vector<uint8_t>* patch, std::vector<uint8_t>* literal) {
+  if (literal->empty()) {
+    return;
+  }
+  patch->push_back(OPCODE_INSERT);
+  appendVarint(patch, literal->size());
+  patch->insert(patch->end(), literal->begin(), literal->end());
+  literal->clear();
+}
+
+std::vector<uint8_t> makePatch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target) {
+  std::vector<uint8_t> patch = { 'M', 'S', 'P', '1' };
+  appendUint32(&patch, source.size());
+  appendUint32(&patch, PersistentStore::crc32(source.data(), source.size()));
+  appendUint32(&patch, target.size());
+  appendUint32(&patch, PersistentStore::crc32(target.data(), target.size()));
+  std::unordered_map<uint64_t, size_t> index;
+  for (size_t i = 0; i + BLOCK_SIZE <= source.size(); i++) {
+    index.emplace(blockHash(&source[i]), i);
+  }
+  std::vector<uint8_t> literal;
+  size_t sourcePosition = 0;
+  size_t i = 0;
+  while (i < target.size()) {
+    auto match = i + BLOCK_SIZE <= target.size() ? index.find(blockHash(&target[i])) : index.end();
+    if (match == index.end() || memcmp(&source[match->second], &target[i], BLOCK_SIZE) != 0) {
+      literal.push_back(target[i++]);
+      continue;
+    }
+    size_t offset = match->second;
+    size_t length = BLOCK_SIZE;
+    while (i + length < target.size() && offset + length < source.size() && target[i + length] == source[offset + length]) {
+      length++;
+    }
+    flushLiteral(&patch, &literal);
+    int32_t delta = static_cast<int32_t>(offset) - static_cast<int32_t>(sourcePosition);
+    patch.push_back(OPCODE_COPY);
+    appendVarint(&patch, delta < 0 ? -2 * delta - 1 : 2 * delta);
+    appendVarint(&patch, length);
+    sourcePosition = offset + length;
+    i += length;
+  }
+  flushLiteral(&patch, &literal);
+  return patch;
+}
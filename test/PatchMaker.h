@@ -0,0 +1,24 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Makes patches in the format PatchApplier reads (see PatchApplier.h), for the host tests and the benchmark.
+// It matches blocks of the target against a hash of the source blocks and extends the matches, which is simple
+// but good enough for images that share most of their code.
+
+#ifndef HEADER_PATCHMAKER
+#define HEADER_PATCHMAKER
+
+#include <stdint.h>
+#include <vector>
+
+std::vector<uint8_t> makePatch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target);
+void appendVarint(std::vector<uint8_t>* patch, uint32_t value);
+#endif
@@ -0,0 +1,266 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Host test of PersistentStore over buffer backed storage: records survive a commit, a corrupt or missing fast image
+// falls back to the durable one, changed record sizes read as absent, and only durable records reach durable storage.
+
+#include <string.h>
+#include <vector>
+#include "Check.h"
+#include "PersistentStore.h"
+
+// What RtcStorage and FlashStorage do on the device, in a buffer. It counts the writes and can be made to fail.
+class BufferStorage : public Storage {
+public:
+    explicit BufferStorage(size_t capacity) : _data(capacity / sizeof(uint32_t), 0) {}
+    size_t capacity() override { return _data.size() * sizeof(uint32_t); }
+    bool read(uint32_t* data, size_t size) override {
+      memcpy(data, _data.data(), size);
+      return true;
+    }
+    bool write(const uint32_t* data, size_t size) override {
+      if (failWrites) {
+        return false;
+      }
+      memcpy(_data.data(), data, size);
+      writes++;
+      return true;
+    }
+    uint8_t* bytes() { return reinterpret_cast<uint8_t*>(_data.data()); }
+    bool contains(const void* pattern, size_t size) {
+      for (size_t i = 0; i + size <= capacity(); i++) {
+        if (memcmp(bytes() + i, pattern, size) == 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+    int writes = 0;
+    bool failWrites = false;
+private:
+    std::vector<uint32_t> _data;
+};
+
+const size_t STORAGE_SIZE = 512;
+
+struct Drift {
+    float factor;
+    uint16_t samples;
+};
+
+static void testRoundTrip() {
+  BufferStorage fast(STORAGE_SIZE);
+  BufferStorage durable(STORAGE_SIZE);
+  PersistentStore store;
+  store.begin(&fast, &durable);
+  CHECK(store.isColdStart());
+  uint32_t nextRun = 1700000000;
+  Drift drift = { 1.05f, 3 };
+  CHECK(store.save(RECORD_SCHEDULER, &nextRun, sizeof(nextRun)));
+  CHECK(store.save(RECORD_DRIFT, &drift, sizeof(drift), true));
+  CHECK(store.commit());
+
+  PersistentStore next;
+  next.begin(&fast, &durable);
+  CHECK(!next.isColdStart());
+  uint32_t loadedRun = 0;
+  Drift loadedDrift = { 0, 0 };
+  CHECK(next.load(RECORD_SCHEDULER, &loadedRun, sizeof(loadedRun)));
+  CHECK(loadedRun == nextRun);
+  CHECK(next.load(RECORD_DRIFT, &loadedDrift, sizeof(loadedDrift)));
+  CHECK(loadedDrift.factor == drift.factor && loadedDrift.samples == drift.samples);
+  CHECK(!next.load(RECORD_WIFI, &loadedRun, sizeof(loadedRun)));
+}
+
+// A flipped bit in the fast image must not be taken for state: the store goes back to the durable copy
+static void testCrcRejection() {
+  BufferStorage fast(STORAGE_SIZE);
+  BufferStorage durable(STORAGE_SIZE);
+  PersistentStore store;
+  store.begin(&fast, &durable);
+  uint32_t nextRun = 1700000000;
+  uint32_t config = 42;
+  store.save(RECORD_SCHEDULER, &nextRun, sizeof(nextRun));
+  store.save(RECORD_CONFIG, &config, sizeof(config), true);
+  CHECK(store.commit());
+  // in the payload of the first record, after the image and record headers
+  fast.bytes()[16] ^= 0x04;
+
+  PersistentStore next;
+  next.begin(&fast, &durable);
+  CHECK(next.isColdStart());
+  uint32_t loaded = 0;
+  CHECK(!next.load(RECORD_SCHEDULER, &loaded, sizeof(loaded)));
+  CHECK(next.load(RECORD_CONFIG, &loaded, sizeof(loaded)));
+  CHECK(loaded == config);
+
+  // with both images corrupt, the store starts empty
+  durable.bytes()[16] ^= 0x01;
+  fast.bytes()[8] ^= 0x01;
+  PersistentStore empty;
+  empty.begin(&fast, &durable);
+  CHECK(empty.isColdStart());
+  CHECK(!empty.load(RECORD_CONFIG, &loaded, sizeof(loaded)));
+  CHECK(empty.save(RECORD_CONFIG, &config, sizeof(config)));
+}
+
+// After a cold boot the RTC memory is blank, so the durable records come from flash, and the next commit makes
+// the fast image valid again without rewriting flash
+static void testColdStartFallback() {
+  BufferStorage fast(STORAGE_SIZE);
+  BufferStorage durable(STORAGE_SIZE);
+  PersistentStore store;
+  store.begin(&fast, &durable);
+  Drift drift = { 1.062f, 12 };
+  uint32_t nextRun = 1700000000;
+  store.save(RECORD_DRIFT, &drift, sizeof(drift), true);
+  store.save(RECORD_SCHEDULER, &nextRun, sizeof(nextRun));
+  CHECK(store.commit());
+  CHECK(durable.writes == 1);
+
+  BufferStorage blank(STORAGE_SIZE);
+  PersistentStore coldStore;
+  coldStore.begin(&blank, &durable);
+  CHECK(coldStore.isColdStart());
+  Drift loaded = { 0, 0 };
+  CHECK(coldStore.load(RECORD_DRIFT, &loaded, sizeof(loaded)));
+  CHECK(loaded.factor == drift.factor && loaded.samples == drift.samples);
+  uint32_t loadedRun = 0;
+  CHECK(!coldStore.load(RECORD_SCHEDULER, &loadedRun, sizeof(loadedRun)));
+  CHECK(!coldStore.hasDurableChanges());
+  CHECK(coldStore.commit());
+  CHECK(blank.writes == 1);
+  CHECK(durable.writes == 1);
+
+  PersistentStore warmStore;
+  warmStore.begin(&blank, &durable);
+  CHECK(!warmStore.isColdStart());
+  CHECK(warmStore.load(RECORD_DRIFT, &loaded, sizeof(loaded)));
+
+  // no durable storage at all (or nothing in it yet) is a cold start with an empty store
+  BufferStorage blankToo(STORAGE_SIZE);
+  PersistentStore newStore;
+  newStore.begin(&blankToo, nullptr);
+  CHECK(newStore.isColdStart());
+  CHECK(!newStore.load(RECORD_DRIFT, &loaded, sizeof(loaded)));
+}
+
+// A firmware update can change the layout of a record. The old one then reads as absent, and saving the new one
+// replaces it without disturbing the records after it.
+static void testChangedRecordSize() {
+  BufferStorage fast(STORAGE_SIZE);
+  BufferStorage durable(STORAGE_SIZE);
+  PersistentStore store;
+  store.begin(&fast, &durable);
+  uint8_t oldLayout[6] = { 1, 2, 3, 4, 5, 6 };
+  uint32_t nextRun = 1700000000;
+  store.save(RECORD_WIFI, oldLayout, sizeof(oldLayout));
+  store.save(RECORD_SCHEDULER, &nextRun, sizeof(nextRun));
+  CHECK(store.commit());
+
+  PersistentStore updated;
+  updated.begin(&fast, &durable);
+  uint8_t newLayout[10] = { 0 };
+  CHECK(!updated.load(RECORD_WIFI, newLayout, sizeof(newLayout)));
+  for (size_t i = 0; i < sizeof(newLayout); i++) {
+    newLayout[i] = 10 + i;
+  }
+  CHECK(updated.save(RECORD_WIFI, newLayout, sizeof(newLayout)));
+  CHECK(updated.commit());
+
+  PersistentStore next;
+  next.begin(&fast, &durable);
+  uint8_t loaded[10] = { 0 };
+  CHECK(!next.load(RECORD_WIFI, oldLayout, sizeof(oldLayout)));
+  CHECK(next.load(RECORD_WIFI, loaded, sizeof(loaded)));
+  CHECK(memcmp(loaded, newLayout, sizeof(loaded)) == 0);
+  uint32_t loadedRun = 0;
+  CHECK(next.load(RECORD_SCHEDULER, &loadedRun, sizeof(loadedRun)));
+  CHECK(loadedRun == nextRun);
+}
+
+// TLS sessions and the like stay in RTC memory. Only durable records reach flash, and only when one of them changed.
+static void testOnlyDurableRecordsReachDurableStorage() {
+  BufferStorage fast(STORAGE_SIZE);
+  BufferStorage durable(STORAGE_SIZE);
+  PersistentStore store;
+  store.begin(&fast, &durable);
+  uint8_t session[48];
+  for (size_t i = 0; i < sizeof(session); i++) {
+    session[i] = 0xA0 + i;
+  }
+  uint32_t announcement = 0x12345678;
+  store.save(RECORD_TLS_SESSIONS, session, sizeof(session));
+  store.save(RECORD_ANNOUNCEMENT, &announcement, sizeof(announcement), true);
+  CHECK(store.hasDurableChanges());
+  CHECK(store.commit());
+  CHECK(fast.contains(session, sizeof(session)));
+  CHECK(!durable.contains(session, sizeof(session)));
+  CHECK(durable.contains(&announcement, sizeof(announcement)));
+
+  // a changed session doesn't rewrite flash, and neither does saving the same durable value again
+  session[0] = 0x55;
+  store.save(RECORD_TLS_SESSIONS, session, sizeof(session));
+  store.save(RECORD_ANNOUNCEMENT, &announcement, sizeof(announcement), true);
+  CHECK(!store.hasDurableChanges());
+  CHECK(store.commit());
+  CHECK(durable.writes == 1);
+  CHECK(fast.writes == 2);
+
+  // once durable, a record stays durable, and its latest value goes along with the next durable save
+  uint32_t changedAnnouncement = 0x0BADF00D;
+  uint32_t config = 7;
+  store.save(RECORD_ANNOUNCEMENT, &changedAnnouncement, sizeof(changedAnnouncement));
+  CHECK(!store.hasDurableChanges());
+  store.save(RECORD_CONFIG, &config, sizeof(config), true);
+  CHECK(store.commit());
+  CHECK(durable.writes == 2);
+  CHECK(durable.contains(&changedAnnouncement, sizeof(changedAnnouncement)));
+  CHECK(!durable.contains(session, sizeof(session)));
+
+  BufferStorage blank(STORAGE_SIZE);
+  PersistentStore coldStore;
+  coldStore.begin(&blank, &durable);
+  CHECK(!coldStore.load(RECORD_TLS_SESSIONS, session, sizeof(session)));
+  uint32_t loaded = 0;
+  CHECK(coldStore.load(RECORD_ANNOUNCEMENT, &loaded, sizeof(loaded)));
+  CHECK(loaded == changedAnnouncement);
+}
+
+static void testFullImageAndFailedWrites() {
+  BufferStorage fast(STORAGE_SIZE);
+  BufferStorage durable(STORAGE_SIZE);
+  PersistentStore store;
+  store.begin(&fast, &durable);
+  uint8_t large[400] = { 0 };
+  CHECK(store.save(RECORD_LOG, large, sizeof(large)));
+  CHECK(!store.save(RECORD_MEASUREMENTS, large, 100));
+  // a failed write is tried again on the next commit
+  uint32_t config = 3;
+  store.save(RECORD_CONFIG, &config, sizeof(config), true);
+  durable.failWrites = true;
+  CHECK(!store.commit());
+  CHECK(store.hasDurableChanges());
+  durable.failWrites = false;
+  CHECK(store.commit());
+  CHECK(!store.hasDurableChanges());
+  CHECK(durable.writes == 1);
+}
+
+int main() {
+  testRoundTrip();
+  testCrcRejection();
+  testColdStartFallback();
+  testChangedRecordSize();
+  testOnlyDurableRecordsReachDurableStorage();
+  testFullImageAndFailedWrites();
+  return checkResult();
+}
@@ -0,0 +1,173 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Host test of the fixed point filter, the resistance table and its interpolation against the float arithmetic
+// they replace. It includes SensorManager.cpp to get at the functions that are private to it.
+
+#include <math.h>
+#include <algorithm>
+#include "Check.h"
+#include "../MoistureSensor/SensorManager.cpp"
+
+// The float formula itself is only that precise, so the interpolation can't be held to anything stricter
+const double TOLERANCE_OHM = 2.0;
+const double TOLERANCE_RELATIVE = 1e-6;
+// Each rounded filter step is off by at most half a fixed point step, and the filter shrinks earlier errors by 1 - ALPHA
+const double TOLERANCE_PIN_VALUE = 0.5 / (1 << FRACTION_BITS) * ALPHA_DIVISOR;
+
+// A copy of the arithmetic in SensorManager::read() before it went fixed point. It is frozen here, so the reference
+// doesn't move along with SensorManager.cpp.
+namespace Baseline {
+  const double ALPHA = 0.1;
+  const double R_REF = 320000.0; 
+  const double V_IN = 3.3;
+
+  float filter(const int* samples, int count) {
+    float rawPinValue = 0;
+    for (int i = 0; i < count; i++) {
+      int sensorValue = samples[i];
+      rawPinValue = i==0 ? sensorValue : sensorValue * ALPHA + rawPinValue * (1 - ALPHA);
+    }
+    return rawPinValue;
+  }
+
+  float resistance(float rawPinValue) {
+    float correctedPinValue = rawPinValue < 1024 ? std::max(rawPinValue * 0.95 - 5.7, 1.0) : 1024;
+    float vOut = correctedPinValue * V_IN / 1024.0;
+    return R_REF * (V_IN - vOut) / vOut;
+  }
+}
+
+static double formula(float rawPinValue) {
+  return static_cast<double>(Baseline::resistance(rawPinValue));
+}
+
+static int32_t filterFixed(const int* samples, int count) {
+  int32_t filteredValue = samples[0] << FRACTION_BITS;
+  for (int i = 1; i < count; i++) {
+    filteredValue = filterStep(filteredValue, samples[i] << FRACTION_BITS);
+  }
+  return filteredValue;
+}
+
+static void testTableMatchesFormula() {
+  for (int i = 0; i < ADC_STEPS; i++) {
+    CHECK(tableResistance(i) == static_cast<uint32_t>(formula(static_cast<float>(i)) + 0.5));
+  }
+  CHECK(tableResistance(ADC_STEPS - 1) == 0);
+}
+
+static void testInterpolationMatchesFormula() {
+  double worstError = 0;
+  uint32_t previous = UINT32_MAX;
+  for (int32_t pinValue = 0; pinValue <= (ADC_STEPS - 1) << FRACTION_BITS; pinValue++) {
+    uint32_t resistance = resistanceForFixed(pinValue);
+    double expected = formula(pinValue / static_cast<float>(1 << FRACTION_BITS));
+    double error = fabs(resistance - expected);
+    if (error > TOLERANCE_OHM + TOLERANCE_RELATIVE * expected) {
+      CHECK(error <= TOLERANCE_OHM + TOLERANCE_RELATIVE * expected);
+      printf("  pin value %.4f: %u Ω, formula %.1f Ω\n", pinValue / 256.0, resistance, expected);
+    }
+    worstError = error > worstError ? error : worstError;
+    // the resistance goes down as the pin value goes up
+    CHECK(resistance <= previous);
+    previous = resistance;
+  }
+  printf("Largest difference from the formula: %.2f Ω\n", worstError);
+}
+
+static void testOutOfRange() {
+  CHECK(resistanceForFixed(-1) == tableResistance(0));
+  CHECK(resistanceForFixed(INT32_MAX) == 0);
+  SensorManager sensorManager;
+  CHECK(sensorManager.resistanceFor(-3.0f) == tableResistance(0));
+  CHECK(sensorManager.resistanceFor(1024.0f) == 0);
+  CHECK(sensorManager.resistanceFor(2000.0f) == 0);
+}
+
+static void testResistanceFor() {
+  SensorManager sensorManager;
+  const float pinValues[] = { 7.0f, 7.04f, 8.5f, 100.0f, 512.25f, 1000.1f, 1023.5f };
+  for (float pinValue : pinValues) {
+    double expected = formula(pinValue);
+    CHECK(fabs(sensorManager.resistanceFor(pinValue) - expected) <= 
+      TOLERANCE_OHM + TOLERANCE_RELATIVE * expected + fabs(expected - formula(pinValue + 1 / 512.0f)));
+  }
+}
+
+// Steady values, noise, ramps, steps and anything in range, with all the sample counts SensorManager allows
+static void testFilterMatchesBaseline() {
+  uint32_t seed = 1;
+  auto random = [&seed](int range) { seed = seed * 1103515245 + 12345; return static_cast<int>((seed >> 16) % range); };
+  double worstPinError = 0;
+  double worstResistanceError = 0;
+  double sumPinError = 0;
+  int sequences = 0;
+  for (int round = 0; round < 2000; round++) {
+    int samples[SensorManager::SAMPLE_COUNT];
+    int count = 1 + random(SensorManager::SAMPLE_COUNT);
+    int start = random(ADC_STEPS);
+    int end = random(ADC_STEPS);
+    for (int i = 0; i < count; i++) {
+      int value;
+      switch (round % 5) {
+        case 0: value = start; break;
+        case 1: value = start + random(7) - 3; break;
+        case 2: value = start + (end - start) * i / count; break;
+        case 3: value = i < count / 2 ? start : end; break;
+        default: value = random(ADC_STEPS); break;
+      }
+      samples[i] = value < 0 ? 0 : value > ADC_STEPS - 1 ? ADC_STEPS - 1 : value;
+    }
+    int32_t fixedValue = filterFixed(samples, count);
+    float baselineValue = Baseline::filter(samples, count);
+    double pinError = fixedValue / static_cast<double>(1 << FRACTION_BITS) - baselineValue;
+    CHECK(fabs(pinError) <= TOLERANCE_PIN_VALUE);
+    worstPinError = std::max(worstPinError, fabs(pinError));
+    sumPinError += pinError;
+    sequences++;
+    // the resistance may be off by as much as the pin value error moves it, on top of the interpolation tolerance
+    double expected = formula(baselineValue);
+    double slope = std::max(fabs(formula(baselineValue - TOLERANCE_PIN_VALUE) - expected), 
+      fabs(formula(baselineValue + TOLERANCE_PIN_VALUE) - expected));
+    double resistanceError = fabs(resistanceForFixed(fixedValue) - expected);
+    if (resistanceError > TOLERANCE_OHM + TOLERANCE_RELATIVE * expected + slope) {
+      CHECK(resistanceError <= TOLERANCE_OHM + TOLERANCE_RELATIVE * expected + slope);
+      printf("  pin value %.4f: %u Ω, baseline %.1f Ω\n", baselineValue, resistanceForFixed(fixedValue), expected);
+    }
+    worstResistanceError = std::max(worstResistanceError, resistanceError);
+  }
+  printf("Largest filter difference from the baseline: %.4f ADC steps (mean %+.5f), resistance %.1f Ω\n", 
+    worstPinError, sumPinError / sequences, worstResistanceError);
+}
+
+// A steady input ends up on the sample, where truncating steps stopped up to 9/256 of a step short of it
+static void testFilterSettlesOnSteadyInput() {
+  for (int start = 0; start < ADC_STEPS; start += 97) {
+    for (int target = 0; target < ADC_STEPS; target += 89) {
+      int32_t filteredValue = start << FRACTION_BITS;
+      for (int i = 0; i < 200; i++) {
+        filteredValue = filterStep(filteredValue, target << FRACTION_BITS);
+      }
+      CHECK(abs(filteredValue - (target << FRACTION_BITS)) <= ALPHA_DIVISOR / 2 - 1);
+    }
+  }
+}
+
+int main() {
+  testFilterMatchesBaseline();
+  testFilterSettlesOnSteadyInput();
+  testTableMatchesFormula();
+  testInterpolationMatchesFormula();
+  testOutOfRange();
+  testResistanceFor();
+  return checkResult();
+}
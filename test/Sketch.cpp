@@ -0,0 +1,41 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// MoistureSensor.ino as it is, built into a module (shared library) with the sketch classes and the drivers, on the
+// fake core and network in the executable that loads it. Loading it runs the static constructors, like a boot, and
+// unloading it throws the RAM away, like deep sleep. So a wake is: load, sketchSetup, sketchLoop until Fake::DeepSleep,
+// unload. Build it with -fno-gnu-unique, or the unload doesn't happen.
+// The compile time settings of the sketch are constants, so variants are separate modules. SKETCH_SCAN_MODE and
+// SKETCH_ACQUISITION_MODE replace the default values of SCAN_MODE and ACQUISITION_MODE.
+
+#include <ESP.h>
+#include "SensorManager.h"
+
+// what the Arduino IDE does: the prototypes of the functions that are used before they are defined
+bool connectRadio();
+bool radioFailed(const char* message);
+
+#ifdef SKETCH_SCAN_MODE
+#define SCAN_PER_SENSOR SKETCH_SCAN_MODE
+#endif
+#ifdef SKETCH_ACQUISITION_MODE
+#define ACQUIRE_FIXED SKETCH_ACQUISITION_MODE
+#endif
+
+#include "../MoistureSensor/MoistureSensor.ino"
+
+extern "C" void sketchSetup() {
+  setup();
+}
+
+extern "C" void sketchLoop() {
+  loop();
+}
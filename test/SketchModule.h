@@ -0,0 +1,110 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Loads the sketch module (see Sketch.cpp) and runs wakes with it. Loading it is the boot of a wake: the globals of
+// the sketch start fresh, like the RAM of the device after deep sleep. The executable has the fake core, so its state
+// survives the wakes; link it with ENABLE_EXPORTS, so the module can use it.
+
+#ifndef HEADER_SKETCHMODULE
+#define HEADER_SKETCHMODULE
+
+#include <dlfcn.h>
+#include <functional>
+#include <stdio.h>
+#include <string>
+#include <ESP.h>
+#include <ESP8266WiFi.h>
+#include "FakeNetwork.h"
+#include "secrets.h"
+
+class SketchModule {
+public:
+    explicit SketchModule(const char* path) {
+      _handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+      if (_handle == nullptr) {
+        printf("Could not load %s: %s\n", path, dlerror());
+        return;
+      }
+      _setup = reinterpret_cast<void (*)()>(dlsym(_handle, "sketchSetup"));
+      _loop = reinterpret_cast<void (*)()>(dlsym(_handle, "sketchLoop"));
+    }
+
+    ~SketchModule() {
+      if (_handle != nullptr) {
+        dlclose(_handle);
+      }
+    }
+
+    bool isLoaded() {
+      return _setup != nullptr && _loop != nullptr;
+    }
+
+    // Runs setup and loop until the sketch goes into deep sleep. atSleep runs then, with the state of the wake, and
+    // the device sleeps. Returns false if the module didn't load or the wake doesn't end.
+    static bool runWake(const char* path, std::function<void(void)> atSleep) {
+      SketchModule sketch(path);
+      if (!sketch.isLoaded()) {
+        return false;
+      }
+      try {
+        sketch._setup();
+        // more runs in one wake only happen with short intervals
+        for (int run = 0; run < MAX_RUNS; run++) {
+          sketch._loop();
+        }
+      } catch (const Fake::DeepSleep& sleep) {
+        atSleep();
+        // the boot drops the callbacks into the module, so it has to come before the module unloads
+        Fake::wakeFrom(sleep);
+        return true;
+      }
+      printf("The wake doesn't end\n");
+      Fake::boot(REASON_DEFAULT_RST, false);
+      return false;
+    }
+
+private:
+    static const int MAX_RUNS = 1000;
+    void* _handle = nullptr;
+    void (*_setup)() = nullptr;
+    void (*_loop)() = nullptr;
+};
+
+// The servers the sketch talks to, on the fake network: the broker, and the firmware server that
+// CONFIG_BASE_FIRMWARE_URL points to. Both have version BUILD_NUMBER of MoistureSensor.ino, so the sketch doesn't
+// update itself. Make it after Fake::reset, which sets the MAC address.
+class SketchNetwork {
+public:
+    Fake::Broker broker;
+    Fake::WebServer firmwareServer;
+
+    SketchNetwork() {
+      const char* VERSION = "40";
+      broker.retain("firmware/" + macAddress() + "/version", VERSION);
+      Fake::addServer(CONFIG_MQTT_BROKER, CONFIG_MQTT_PORT, &broker);
+      firmwareServer.setFile("/moisture/" + macAddress() + ".version", VERSION, "\"v40\"");
+      Fake::addServer("firmware.local", 443, &firmwareServer);
+    }
+
+    ~SketchNetwork() {
+      Fake::removeServers();
+    }
+
+    // the machine ID in the firmware topic and URL, as WifiDriver makes it
+    static std::string macAddress() {
+      uint8_t mac[6];
+      WiFi.macAddress(mac);
+      char address[13];
+      snprintf(address, sizeof(address), "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+      return address;
+    }
+};
+#endif
@@ -0,0 +1,46 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Two firmware-like images for the patch tests: a pseudo random source, and a target that differs from it the way
+// a new build does (changed bytes, inserted and removed code, a moved function). Both are reproducible.
+
+#ifndef HEADER_TESTIMAGES
+#define HEADER_TESTIMAGES
+
+#include <stdint.h>
+#include <vector>
+
+static std::vector<uint8_t> makeSourceImage(size_t size, uint32_t seed) {
+  std::vector<uint8_t> image(size);
+  uint32_t state = seed;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1664525 + 1013904223;
+    image[i] = state >> 24;
+  }
+  return image;
+}
+
+static std::vector<uint8_t> makeTargetImage(const std::vector<uint8_t>& source) {
+  std::vector<uint8_t> target(source);
+  size_t size = target.size();
+  for (size_t i = size / 10; i < size; i += size / 7) {
+    target[i] ^= 0x5A;
+  }
+  std::vector<uint8_t> inserted = makeSourceImage(3000, 42);
+  target.insert(target.begin() + size / 3, inserted.begin(), inserted.end());
+  target.erase(target.begin() + size / 2, target.begin() + size / 2 + 2000);
+  // move a "function" to the end
+  std::vector<uint8_t> moved(target.begin() + size / 5, target.begin() + size / 5 + 5000);
+  target.erase(target.begin() + size / 5, target.begin() + size / 5 + 5000);
+  target.insert(target.end(), moved.begin(), moved.end());
+  return target;
+}
+#endif
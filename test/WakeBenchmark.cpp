@@ -0,0 +1,158 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// Runs thousands of wakes of MoistureSensor.ino on the host, and reports what a wake costs on average for a few
+// configurations: radio-on ms, CPU ms (awake, minus light sleep), bytes sent and flash writes.
+// It is the sketch itself with its drivers, built as a module (see Sketch.cpp) that gets loaded for every wake, on the
+// fake core and network in fake/. WiFi, TLS and the broker take the times in Fake::NetworkTimes. The broker has the
+// configuration as a retained message, so it takes effect from the second wake on, like it would for a fleet. It also
+// has the firmware version, and the firmware server has the version file for the wakes that check that instead.
+// Bytes sent is what the sketch wrote to its clients, i.e. the application data without the TLS overhead, like the
+// wake-cost property on the device.
+//   WakeBenchmark [wakes per configuration]
+// With SERIAL set in the environment, it shows what the sketch prints.
+
+#include <math.h>
+#include <vector>
+#include <ESP.h>
+#include <FS.h>
+#include "FakeNetwork.h"
+#include "SketchModule.h"
+#include "secrets.h"
+
+// what the ROM and the SDK take before setup runs, and the time that an NTP request takes
+const unsigned long BOOT_MILLIS = 100;
+const unsigned long NTP_MILLIS = 50;
+const uint64_t DAY_MICROS = 86400ULL * 1000000;
+
+struct Configuration {
+    const char* name;
+    // the module with the compile time settings
+    const char* module;
+    // the retained config message, or nullptr to keep the defaults of the sketch
+    const char* config;
+    // the access point is gone for this part of the wakes
+    double outageStart;
+    double outageEnd;
+};
+
+// What a wall looks like to the ADC: it settles after power up, has a little noise, dries out slowly over
+// the day, and sensor 1 gets wet for a few hours every few days
+class SimulatedWall {
+public:
+    int read() {
+      int channel = (Fake::pinState(D5) | Fake::pinState(D6) << 1 | Fake::pinState(D7) << 2);
+      int powered = Fake::pinState(D2) == LOW && Fake::pinState(D1) == LOW;
+      if (channel != _channel || powered != _powered) {
+        _channel = channel;
+        _powered = powered;
+        _selectedMicros = Fake::nowMicros();
+      }
+      if (!_powered) {
+        return 0;
+      }
+      double days = Fake::realTime() / static_cast<double>(DAY_MICROS);
+      double target = 30 + 15 * _channel + 5 * sin(days * 2 * M_PI);
+      if (_channel == 1 && fmod(days, 3.0) < 0.15) {
+        target = 600;
+      }
+      double settling = exp(-static_cast<double>(Fake::nowMicros() - _selectedMicros) / 25000.0);
+      _noise = _noise * 1103515245 + 12345;
+      int noise = static_cast<int>((_noise >> 16) % 3) - 1;
+      return static_cast<int>(target * (1 - settling)) + noise;
+    }
+private:
+    int _channel = -1;
+    int _powered = -1;
+    uint64_t _selectedMicros = 0;
+    uint32_t _noise = 1;
+};
+
+SimulatedWall wall;
+
+struct Totals {
+    unsigned long wakes = 0;
+    unsigned long radioWakes = 0;
+    double awakeMillis = 0;
+    double cpuMillis = 0;
+    double radioMillis = 0;
+    unsigned long bytesSent = 0;
+    unsigned long flashWrites = 0;
+    unsigned long flashBytes = 0;
+    double days = 0;
+};
+
+static Totals simulate(const Configuration& configuration, int wakes) {
+  Totals totals;
+  Fake::reset();
+  Fake::setSerialOutput(getenv("SERIAL") != nullptr);
+  Fake::setSleepDrift(1 / 1.05);
+  Fake::setAnalogRead([](uint8_t) { return wall.read(); });
+  SketchNetwork network;
+  if (configuration.config != nullptr) {
+    network.broker.retain("homie/" CONFIG_DEVICE_NAME "/device/config/set", configuration.config);
+  }
+  Fake::boot(REASON_DEFAULT_RST, true);
+  uint64_t startMicros = Fake::realTime();
+  for (int wake = 0; wake < wakes; wake++) {
+    bool available = wake < configuration.outageStart * wakes || wake >= configuration.outageEnd * wakes;
+    Fake::setNetwork(available, NTP_MILLIS);
+    unsigned long flashWrites = SPIFFS.writes();
+    unsigned long flashBytes = SPIFFS.bytesWritten();
+    bool radioWake = Fake::isRadioOn();
+    delay(BOOT_MILLIS);
+    bool ended = SketchModule::runWake(configuration.module, [&]() {
+      totals.wakes++;
+      totals.radioWakes += radioWake ? 1 : 0;
+      double awakeMillis = Fake::nowMicros() / 1000.0;
+      totals.awakeMillis += awakeMillis;
+      totals.cpuMillis += awakeMillis - Fake::lightSleepMicros() / 1000.0;
+      totals.radioMillis += Fake::radioMicros() / 1000.0;
+      totals.bytesSent += Fake::bytesSent();
+      totals.flashWrites += SPIFFS.writes() - flashWrites;
+      totals.flashBytes += SPIFFS.bytesWritten() - flashBytes;
+    });
+    if (!ended) {
+      printf("%s: wake %d failed\n", configuration.name, wake);
+      break;
+    }
+  }
+  totals.days = (Fake::realTime() - startMicros) / static_cast<double>(DAY_MICROS);
+  return totals;
+}
+
+int main(int argc, char* argv[]) {
+  int wakes = argc > 1 ? atoi(argv[1]) : 5000;
+  std::vector<Configuration> configurations = {
+    { "default", SKETCH_DEFAULT_MODULE, nullptr, 0, 0 },
+    { "batch 1", SKETCH_DEFAULT_MODULE, "batch=1", 0, 0 },
+    { "delta samples", SKETCH_DEFAULT_MODULE, "format=delta", 0, 0 },
+    { "adaptive acquisition", SKETCH_ADAPTIVE_MODULE, "format=delta", 0, 0 },
+    { "single window", SKETCH_WINDOW_MODULE, "format=delta", 0, 0 },
+    { "report on change", SKETCH_WINDOW_MODULE, "format=delta,on-change=1", 0, 0 },
+    { "+ adaptive interval", SKETCH_WINDOW_MODULE, "format=delta,on-change=1,adaptive=1", 0, 0 },
+    { "default, AP outage", SKETCH_DEFAULT_MODULE, nullptr, 0.3, 0.5 }
+  };
+
+  printf("%d wakes per configuration; averages per wake\n", wakes);
+  printf("%-22s %8s %8s %8s %8s %8s %8s %8s %8s\n", "configuration", "wakes/d", "radio %", "awake ms", "CPU ms", "radio ms", 
+    "bytes", "flash wr", "flash B");
+  bool complete = true;
+  for (const Configuration& configuration : configurations) {
+    Totals totals = simulate(configuration, wakes);
+    complete = complete && static_cast<int>(totals.wakes) == wakes;
+    double count = totals.wakes > 0 ? totals.wakes : 1;
+    printf("%-22s %8.1f %8.1f %8.0f %8.0f %8.0f %8.0f %8.2f %8.1f\n", configuration.name, totals.wakes / totals.days, 
+      100.0 * totals.radioWakes / count, totals.awakeMillis / count, totals.cpuMillis / count, totals.radioMillis / count, 
+      totals.bytesSent / count, totals.flashWrites / count, totals.flashBytes / count);
+  }
+  return complete ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+
+// The part of the Arduino Client (a Stream over a network connection) that PubSubClient and MqttDriver use.
+
+#ifndef HEADER_FAKE_CLIENT
+#define HEADER_FAKE_CLIENT
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Client {
+public:
+    virtual ~Client() {}
+    virtual int connect(const char* host, uint16_t port) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    // from Stream: how long reads wait
+    void setTimeout(unsigned long timeoutMillis) { _timeout = timeoutMillis; }
+
+protected:
+    unsigned long _timeout = 1000;
+};
+#endif
@@ -0,0 +1,132 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the parts of the Arduino/ESP8266 core that the sketch uses, so it builds and runs on a host.
+// Time only moves when the code waits (delay, light sleep) or a test moves it, and it is the same time
+// for millis(), micros() and the C library's time(), gettimeofday() and settimeofday(), which Fake.cpp replaces.
+// Deep sleep throws Fake::DeepSleep, which ends the wake like a reset would; RTC memory and SPIFFS survive it.
+// ESP.restart throws Fake::Restart. The network (WiFi, TCP, TLS and HTTP) is in FakeNetwork.h.
+// The analog input returns what the test sets. The Fake namespace is the control side that tests use.
+
+#ifndef HEADER_FAKE_ESP
+#define HEADER_FAKE_ESP
+
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define PROGMEM
+#define pgm_read_dword(address) (*reinterpret_cast<const uint32_t*>(address))
+
+typedef uint8_t byte;
+
+class IPAddress;
+class String;
+
+// GPIO numbers of the NodeMCU pin names
+enum { D1 = 5, D2 = 4, D5 = 14, D6 = 12, D7 = 13, LED_BUILTIN = 2, A0 = 17 };
+enum { INPUT = 0, OUTPUT = 1 };
+enum { LOW = 0, HIGH = 1 };
+
+enum RFMode { WAKE_RF_DEFAULT = 0, WAKE_RF_DISABLED = 4 };
+enum { REASON_DEFAULT_RST = 0, REASON_DEEP_SLEEP_AWAKE = 5 };
+
+struct rst_info {
+    uint32_t reason;
+};
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int analogRead(uint8_t pin);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long milliseconds);
+void yield();
+void configTime(int timezoneSeconds, int daylightOffsetSeconds, const char* server1, const char* server2);
+
+class HardwareSerial {
+public:
+    void begin(unsigned long) {}
+    void flush() {}
+    void print(const char* text);
+    void print(const String& text);
+    void print(const IPAddress& address);
+    void println(const char* text = "");
+    void println(const String& text);
+    template <typename... Arguments> void printf(const char* format, Arguments... arguments) {
+      char buffer[256];
+      snprintf(buffer, sizeof(buffer), format, arguments...);
+      print(buffer);
+    }
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    [[noreturn]] void deepSleep(uint64_t micros, RFMode mode = WAKE_RF_DEFAULT);
+    uint64_t deepSleepMax();
+    bool flashRead(uint32_t address, uint8_t* data, size_t size);
+    bool forcedLightSleepBegin(uint64_t micros, void (*wakeupCallback)());
+    void forcedLightSleepEnd();
+    uint32_t getChipId();
+    uint32_t getFreeHeap() { return 40000; }
+    uint16_t getMaxFreeBlockSize() { return 30000; }
+    rst_info* getResetInfoPtr();
+    uint32_t getSketchSize() { return 400000; }
+    [[noreturn]] void restart();
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+};
+
+extern EspClass ESP;
+
+namespace Fake {
+    // What ESP.deepSleep asked for. The wake ends with this exception.
+    struct DeepSleep {
+        uint64_t micros;
+        bool radioOn;
+    };
+    // What ESP.restart throws
+    struct Restart {};
+    // Starts a wake: millis() and the system clock start at 0, and the radio is on if the wake mode says so.
+    // A reset other than from deep sleep clears RTC memory too.
+    void boot(uint32_t resetReason, bool radioEnabled);
+    // sleeps for what the wake asked, and boots again
+    void wakeFrom(const DeepSleep& sleep);
+    // advances the clock, in microseconds
+    void advanceMicros(uint64_t micros);
+    uint64_t nowMicros();
+    // Real time in µs since the epoch, which NTP returns. Deep sleep takes its real time times the drift factor.
+    void setRealTime(uint64_t epochMicros);
+    uint64_t realTime();
+    void setSleepDrift(double factor);
+    // whether NTP answers, and after how long
+    void setNetwork(bool available, unsigned long ntpMillis);
+    bool isNetworkAvailable();
+    void setChipId(uint32_t chipId);
+    // the ADC value per pin read; by default the middle of the range
+    void setAnalogRead(std::function<int(uint8_t)> analogRead);
+    void setSerialOutput(bool enabled);
+    int pinState(uint8_t pin);
+    // The radio is powered from boot on wakes with the radio, until it is switched off
+    void setRadio(bool on);
+    bool isRadioOn();
+    // time spent since boot with the radio on, and with the CPU stopped in light sleep
+    uint64_t radioMicros();
+    uint64_t lightSleepMicros();
+    void reset();
+}
+#endif
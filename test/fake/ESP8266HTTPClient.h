@@ -0,0 +1,56 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the HTTP client of the ESP8266 core, with what FirmwareManager uses. GET sends an HTTP/1.1 request over
+// the client it got, and reads the whole response (with a Content-Length) before it returns, up to the timeout.
+
+#ifndef HEADER_FAKE_ESP8266HTTPCLIENT
+#define HEADER_FAKE_ESP8266HTTPCLIENT
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Stream.h"
+#include "WString.h"
+#include "WiFiClient.h"
+
+#define HTTPC_ERROR_CONNECTION_FAILED (-1)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_STREAM_WRITE (-10)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+enum { HTTP_CODE_OK = 200, HTTP_CODE_NOT_MODIFIED = 304, HTTP_CODE_NOT_FOUND = 404 };
+
+class HTTPClient {
+public:
+    bool begin(WiFiClient& client, const String& url);
+    void addHeader(const String& name, const String& value);
+    void collectHeaders(const char* headerKeys[], size_t count);
+    void end();
+    int GET();
+    String getString();
+    String header(const char* name);
+    void setTimeout(uint16_t timeoutMillis) { _timeoutMillis = timeoutMillis; }
+    int writeToStream(Stream* stream);
+
+private:
+    WiFiClient* _client = nullptr;
+    std::string _host;
+    uint16_t _port = 0;
+    std::string _path;
+    std::string _requestHeaders;
+    std::vector<std::string> _headerKeys;
+    std::map<std::string, std::string> _headers;
+    std::string _body;
+    uint16_t _timeoutMillis = 5000;
+    bool readLine(std::string* line);
+};
+#endif
@@ -0,0 +1,50 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the WiFi station of the ESP8266 core, with one access point. begin switches the radio on, and the status
+// becomes connected after the connect time (see Fake::NetworkTimes) if the network is available (Fake::setNetwork).
+// That is the fast connect time if begin got the BSSID and channel of the access point, else the full one (scan and
+// DHCP). disconnect(true) switches the radio off. The MAC address is the Espressif prefix and the chip ID.
+
+#ifndef HEADER_FAKE_ESP8266WIFI
+#define HEADER_FAKE_ESP8266WIFI
+
+#include "ESP.h"
+#include "IPAddress.h"
+#include "WString.h"
+#include "WiFiClient.h"
+
+enum WiFiMode_t { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 };
+enum wl_status_t { WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL = 1, WL_CONNECTED = 3, WL_CONNECT_FAILED = 4, WL_DISCONNECTED = 6 };
+
+class ESP8266WiFiClass {
+public:
+    void persistent(bool) {}
+    bool mode(WiFiMode_t mode);
+    bool hostname(const char* name);
+    String hostname();
+    wl_status_t begin(const char* ssid, const char* passphrase, int32_t channel = 0, const uint8_t* bssid = nullptr,
+      bool connect = true);
+    bool config(IPAddress localIP, IPAddress gateway, IPAddress subnet, IPAddress dns = IPAddress());
+    bool disconnect(bool wifiOff = false);
+    wl_status_t status();
+    uint8_t* BSSID();
+    int32_t channel();
+    IPAddress localIP();
+    IPAddress gatewayIP();
+    IPAddress subnetMask();
+    IPAddress dnsIP(uint8_t number = 0);
+    uint8_t* macAddress(uint8_t* mac);
+    String SSID();
+};
+
+extern ESP8266WiFiClass WiFi;
+#endif
@@ -0,0 +1,40 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the OTA update of the ESP8266 core: it downloads the image with HTTPClient into Update, and restarts
+// if that worked. A 304 means no update. The return value is an int, like the enum it stands for.
+
+#ifndef HEADER_FAKE_ESP8266HTTPUPDATE
+#define HEADER_FAKE_ESP8266HTTPUPDATE
+
+#include <functional>
+#include "WString.h"
+#include "WiFiClient.h"
+
+enum { HTTP_UPDATE_FAILED, HTTP_UPDATE_NO_UPDATES, HTTP_UPDATE_OK };
+typedef int t_httpUpdate_return;
+
+class ESP8266HTTPUpdate {
+public:
+    int getLastError() { return _lastError; }
+    String getLastErrorString();
+    void onProgress(std::function<void(int, int)> callback) { _progressCallback = callback; }
+    void setClientTimeout(int timeoutMillis) { _timeoutMillis = timeoutMillis; }
+    t_httpUpdate_return update(WiFiClient& client, const String& url);
+
+private:
+    int _lastError = 0;
+    int _timeoutMillis = 8000;
+    std::function<void(int, int)> _progressCallback;
+};
+
+extern ESP8266HTTPUpdate ESPhttpUpdate;
+#endif
@@ -0,0 +1,62 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of SPIFFS that keeps the files in memory, so they survive a (fake) deep sleep. It counts the writes,
+// since those are what wear the flash and cost power.
+
+#ifndef HEADER_FAKE_FS
+#define HEADER_FAKE_FS
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class FakeFileSystem;
+
+class File {
+public:
+    File() = default;
+    File(FakeFileSystem* fileSystem, const std::string& name, size_t position);
+    explicit operator bool() const { return _fileSystem != nullptr; }
+    void close() {}
+    size_t position() const { return _position; }
+    size_t read(uint8_t* data, size_t size);
+    bool seek(size_t position);
+    size_t size() const;
+    size_t write(const uint8_t* data, size_t size);
+private:
+    FakeFileSystem* _fileSystem = nullptr;
+    std::string _name;
+    size_t _position = 0;
+};
+
+class FakeFileSystem {
+public:
+    bool begin();
+    bool exists(const char* path);
+    File open(const char* path, const char* mode);
+    bool remove(const char* path);
+    bool rename(const char* pathFrom, const char* pathTo);
+    // the control side
+    void clear();
+    unsigned long writes() const { return _writes; }
+    unsigned long bytesWritten() const { return _bytesWritten; }
+private:
+    friend class File;
+    std::map<std::string, std::vector<uint8_t>> _files;
+    unsigned long _writes = 0;
+    unsigned long _bytesWritten = 0;
+};
+
+extern FakeFileSystem SPIFFS;
+#endif
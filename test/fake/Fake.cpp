@@ -0,0 +1,397 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// The state behind the fake Arduino/ESP8266 core in ESP.h, coredecls.h and FS.h. The network is in FakeNetwork.cpp.
+
+#include <algorithm>
+#include "ESP.h"
+#include "FS.h"
+#include "FakeNetwork.h"
+#include "IPAddress.h"
+#include "WString.h"
+#include "coredecls.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+FakeFileSystem SPIFFS;
+
+namespace {
+    const int PIN_COUNT = 18;
+    const size_t RTC_MEMORY_SIZE = 512;
+    // about 3.5 hours, like most ESP8266s
+    const uint64_t DEEP_SLEEP_MAX_MICROS = 12600000000ULL;
+    const uint64_t START_EPOCH_MICROS = 1704067200ULL * 1000000;
+
+    // the real time, and when this wake started in it
+    uint64_t realMicros = START_EPOCH_MICROS;
+    uint64_t bootMicros = START_EPOCH_MICROS;
+    // the system clock is systemBaseMicros at systemSetMicros (real time)
+    int64_t systemBaseMicros = 0;
+    uint64_t systemSetMicros = START_EPOCH_MICROS;
+    double sleepDrift = 1.0;
+    rst_info resetInfo = { REASON_DEFAULT_RST };
+    uint32_t rtcMemory[RTC_MEMORY_SIZE / sizeof(uint32_t)];
+    uint32_t chipId = 0x00C0FFEE;
+    int pinStates[PIN_COUNT];
+    std::function<int(uint8_t)> analogReader;
+    bool serialOutput = true;
+    bool networkAvailable = true;
+    unsigned long ntpDelayMillis = 50;
+    uint64_t ntpDueMicros = 0;
+    bool ntpPending = false;
+    std::function<void(bool)> timeSetCallback;
+    bool radioOn = false;
+    uint64_t radioOnSinceMicros = 0;
+    uint64_t radioTotalMicros = 0;
+    bool lightSleeping = false;
+    uint64_t lightSleepTotalMicros = 0;
+
+    void setSystemClock(int64_t micros) {
+      systemBaseMicros = micros;
+      systemSetMicros = realMicros;
+    }
+
+    int64_t systemClock() {
+      return systemBaseMicros + static_cast<int64_t>(realMicros - systemSetMicros);
+    }
+
+    // SNTP answers in the background, so the sync happens while time passes
+    void advance(uint64_t micros) {
+      uint64_t endMicros = realMicros + micros;
+      if (ntpPending && ntpDueMicros <= endMicros) {
+        realMicros = std::max(realMicros, ntpDueMicros);
+        ntpPending = false;
+        setSystemClock(static_cast<int64_t>(realMicros));
+        if (timeSetCallback) {
+          timeSetCallback(true);
+        }
+      }
+      if (lightSleeping) {
+        lightSleepTotalMicros += endMicros - realMicros;
+      }
+      realMicros = endMicros;
+    }
+}
+
+extern "C" time_t time(time_t* result) noexcept {
+  time_t now = static_cast<time_t>(systemClock() / 1000000);
+  if (result != nullptr) {
+    *result = now;
+  }
+  return now;
+}
+
+extern "C" int gettimeofday(struct timeval* now, void*) noexcept {
+  int64_t micros = systemClock();
+  now->tv_sec = static_cast<time_t>(micros / 1000000);
+  now->tv_usec = static_cast<suseconds_t>(micros % 1000000);
+  return 0;
+}
+
+extern "C" int settimeofday(const struct timeval* now, const struct timezone*) noexcept {
+  setSystemClock(static_cast<int64_t>(now->tv_sec) * 1000000 + now->tv_usec);
+  if (timeSetCallback) {
+    timeSetCallback(false);
+  }
+  return 0;
+}
+
+void settimeofday_cb(std::function<void(bool fromSntp)> callback) {
+  timeSetCallback = callback;
+}
+
+void configTime(int, int, const char*, const char*) {
+  if (networkAvailable && radioOn) {
+    ntpPending = true;
+    ntpDueMicros = realMicros + ntpDelayMillis * 1000;
+  }
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < PIN_COUNT) {
+    pinStates[pin] = value;
+  }
+}
+
+int analogRead(uint8_t pin) {
+  return analogReader ? analogReader(pin) : 512;
+}
+
+unsigned long millis() {
+  return static_cast<unsigned long>((realMicros - bootMicros) / 1000);
+}
+
+unsigned long micros() {
+  return static_cast<unsigned long>(realMicros - bootMicros);
+}
+
+void delay(unsigned long milliseconds) {
+  advance(static_cast<uint64_t>(milliseconds) * 1000);
+}
+
+void yield() {}
+
+void HardwareSerial::print(const char* text) {
+  if (serialOutput) {
+    fputs(text, stdout);
+  }
+}
+
+void HardwareSerial::print(const String& text) {
+  print(text.c_str());
+}
+
+void HardwareSerial::print(const IPAddress& address) {
+  printf("%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
+}
+
+void HardwareSerial::println(const char* text) {
+  print(text);
+  print("\n");
+}
+
+void HardwareSerial::println(const String& text) {
+  println(text.c_str());
+}
+
+void EspClass::deepSleep(uint64_t micros, RFMode mode) {
+  throw Fake::DeepSleep{ micros, mode != WAKE_RF_DISABLED };
+}
+
+uint64_t EspClass::deepSleepMax() {
+  return DEEP_SLEEP_MAX_MICROS;
+}
+
+// The timer ends the light sleep, so the next delay is spent with the CPU stopped
+// There is no running image to read, so patches can't be applied
+bool EspClass::flashRead(uint32_t, uint8_t*, size_t) {
+  return false;
+}
+
+bool EspClass::forcedLightSleepBegin(uint64_t, void (*)()) {
+  lightSleeping = !radioOn;
+  return lightSleeping;
+}
+
+void EspClass::forcedLightSleepEnd() {
+  lightSleeping = false;
+}
+
+uint32_t EspClass::getChipId() {
+  return chipId;
+}
+
+rst_info* EspClass::getResetInfoPtr() {
+  return &resetInfo;
+}
+
+void EspClass::restart() {
+  throw Fake::Restart();
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+  if (offset * sizeof(uint32_t) + size > RTC_MEMORY_SIZE) {
+    return false;
+  }
+  memcpy(data, rtcMemory + offset, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+  if (offset * sizeof(uint32_t) + size > RTC_MEMORY_SIZE) {
+    return false;
+  }
+  memcpy(rtcMemory + offset, data, size);
+  return true;
+}
+
+File::File(FakeFileSystem* fileSystem, const std::string& name, size_t position) {
+  _fileSystem = fileSystem;
+  _name = name;
+  _position = position;
+}
+
+size_t File::read(uint8_t* data, size_t size) {
+  const std::vector<uint8_t>& content = _fileSystem->_files[_name];
+  size_t count = std::min(size, content.size() - std::min(_position, content.size()));
+  memcpy(data, content.data() + _position, count);
+  _position += count;
+  return count;
+}
+
+bool File::seek(size_t position) {
+  if (position > size()) {
+    return false;
+  }
+  _position = position;
+  return true;
+}
+
+size_t File::size() const {
+  return _fileSystem->_files[_name].size();
+}
+
+size_t File::write(const uint8_t* data, size_t size) {
+  std::vector<uint8_t>& content = _fileSystem->_files[_name];
+  if (_position + size > content.size()) {
+    content.resize(_position + size);
+  }
+  memcpy(content.data() + _position, data, size);
+  _position += size;
+  _fileSystem->_writes++;
+  _fileSystem->_bytesWritten += size;
+  return size;
+}
+
+bool FakeFileSystem::begin() {
+  return true;
+}
+
+void FakeFileSystem::clear() {
+  _files.clear();
+  _writes = 0;
+  _bytesWritten = 0;
+}
+
+bool FakeFileSystem::exists(const char* path) {
+  return _files.count(path) > 0;
+}
+
+// "r" reads, "w" truncates, "a" appends
+File FakeFileSystem::open(const char* path, const char* mode) {
+  if (mode[0] == 'r' && !exists(path)) {
+    return File();
+  }
+  std::vector<uint8_t>& content = _files[path];
+  if (mode[0] == 'w') {
+    content.clear();
+  }
+  return File(this, path, mode[0] == 'a' ? content.size() : 0);
+}
+
+bool FakeFileSystem::remove(const char* path) {
+  return _files.erase(path) > 0;
+}
+
+bool FakeFileSystem::rename(const char* pathFrom, const char* pathTo) {
+  if (!exists(pathFrom) || exists(pathTo)) {
+    return false;
+  }
+  _files[pathTo] = _files[pathFrom];
+  _files.erase(pathFrom);
+  return true;
+}
+
+void Fake::boot(uint32_t resetReason, bool radioEnabled) {
+  resetInfo.reason = resetReason;
+  if (resetReason != REASON_DEEP_SLEEP_AWAKE) {
+    memset(rtcMemory, 0, sizeof(rtcMemory));
+  }
+  bootMicros = realMicros;
+  setSystemClock(0);
+  ntpPending = false;
+  timeSetCallback = nullptr;
+  lightSleeping = false;
+  lightSleepTotalMicros = 0;
+  radioTotalMicros = 0;
+  radioOn = false;
+  setRadio(radioEnabled);
+  memset(pinStates, 0, sizeof(pinStates));
+  resetNetwork();
+}
+
+// Real time passes while the device sleeps; the RTC timer is off by the drift factor
+void Fake::wakeFrom(const DeepSleep& sleep) {
+  setRadio(false);
+  advance(static_cast<uint64_t>(sleep.micros * sleepDrift));
+  boot(REASON_DEEP_SLEEP_AWAKE, sleep.radioOn);
+}
+
+void Fake::advanceMicros(uint64_t micros) {
+  advance(micros);
+}
+
+uint64_t Fake::nowMicros() {
+  return realMicros - bootMicros;
+}
+
+void Fake::setRealTime(uint64_t epochMicros) {
+  realMicros = epochMicros;
+  bootMicros = epochMicros;
+  systemSetMicros = epochMicros;
+}
+
+uint64_t Fake::realTime() {
+  return realMicros;
+}
+
+void Fake::setSleepDrift(double factor) {
+  sleepDrift = factor;
+}
+
+void Fake::setNetwork(bool available, unsigned long ntpMillis) {
+  networkAvailable = available;
+  ntpDelayMillis = ntpMillis;
+}
+
+bool Fake::isNetworkAvailable() {
+  return networkAvailable;
+}
+
+void Fake::setChipId(uint32_t id) {
+  chipId = id;
+}
+
+void Fake::setAnalogRead(std::function<int(uint8_t)> analogRead) {
+  analogReader = analogRead;
+}
+
+void Fake::setSerialOutput(bool enabled) {
+  serialOutput = enabled;
+}
+
+int Fake::pinState(uint8_t pin) {
+  return pin < PIN_COUNT ? pinStates[pin] : LOW;
+}
+
+void Fake::setRadio(bool on) {
+  if (on && !radioOn) {
+    radioOnSinceMicros = realMicros;
+  } else if (!on && radioOn) {
+    radioTotalMicros += realMicros - radioOnSinceMicros;
+  }
+  radioOn = on;
+}
+
+bool Fake::isRadioOn() {
+  return radioOn;
+}
+
+uint64_t Fake::radioMicros() {
+  return radioTotalMicros + (radioOn ? realMicros - radioOnSinceMicros : 0);
+}
+
+uint64_t Fake::lightSleepMicros() {
+  return lightSleepTotalMicros;
+}
+
+void Fake::reset() {
+  setRealTime(START_EPOCH_MICROS);
+  sleepDrift = 1.0;
+  analogReader = nullptr;
+  serialOutput = true;
+  networkAvailable = true;
+  ntpDelayMillis = 50;
+  SPIFFS.clear();
+  boot(REASON_DEFAULT_RST, true);
+}
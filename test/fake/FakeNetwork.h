@@ -0,0 +1,110 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// The control side of the fake network behind ESP8266WiFi.h, WiFiClient.h, WiFiClientSecure.h and ESP8266HTTPClient.h.
+// Tests put servers on it by host name and port, and the clients of the device connect to those. A server gets what
+// the device writes, per write, and answers; there is one connection at a time, like on the device.
+// Broker is an MQTT 3.1.1 broker with retained messages, and WebServer serves files over HTTP/1.1.
+// The times are what the network and TLS cost the device. The defaults are rough numbers for a fast reconnect to a
+// known access point and a broker on the LAN; change them to what the wake-phases property of a real device shows.
+
+#ifndef HEADER_FAKE_NETWORK
+#define HEADER_FAKE_NETWORK
+
+#include <map>
+#include <set>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Fake {
+    struct NetworkTimes {
+        // with the BSSID and channel of the access point, and a static IP address
+        unsigned long fastConnectMillis = 1200;
+        // with a scan and DHCP
+        unsigned long fullConnectMillis = 3500;
+        unsigned long roundTripMillis = 20;
+        // with the client certificate, and with a session to resume
+        unsigned long fullHandshakeMillis = 1800;
+        unsigned long resumedHandshakeMillis = 600;
+        // per TLS record, i.e. per write
+        unsigned long recordMillis = 10;
+    };
+
+    // The other end of a connection
+    class Server {
+    public:
+        virtual ~Server() {}
+        // a new connection
+        virtual void accept() {}
+        // What the device wrote. The answer goes into reply. Returns false to close the connection after that.
+        virtual bool receive(const uint8_t* data, size_t size, std::vector<uint8_t>* reply) = 0;
+        // the TLS sessions it issued, which clients can resume
+        std::set<std::string> sessions;
+    };
+
+    // Answers CONNECT, SUBSCRIBE (with the retained messages on the topic; no wildcards) and PINGREQ, keeps retained
+    // PUBLISH messages, and closes on DISCONNECT. Messages that the device publishes don't go back to it.
+    class Broker : public Server {
+    public:
+        // What one write of the device held
+        struct Write {
+            size_t bytes = 0;
+            int packets = 0;
+            int publishes = 0;
+            int retained = 0;
+            // starts with a CONNECT, so the device waits for the CONNACK
+            bool connect = false;
+            // what it was, to replay it
+            std::vector<uint8_t> data;
+        };
+        void accept() override;
+        bool receive(const uint8_t* data, size_t size, std::vector<uint8_t>* reply) override;
+        void retain(const std::string& topic, const std::string& payload);
+        // empty if there is nothing retained on the topic
+        std::string retained(const std::string& topic);
+        // the writes since the last clearWrites
+        const std::vector<Write>& writes() { return _writes; }
+        void clearWrites() { _writes.clear(); }
+    private:
+        std::map<std::string, std::string> _retained;
+        std::vector<uint8_t> _pending;
+        std::vector<Write> _writes;
+        bool handle(uint8_t header, const uint8_t* body, size_t length, std::vector<uint8_t>* reply, Write* write);
+    };
+
+    // Answers GET requests with the file (200, with its ETag), 304 if the If-None-Match header has the ETag, or 404
+    class WebServer : public Server {
+    public:
+        void accept() override;
+        bool receive(const uint8_t* data, size_t size, std::vector<uint8_t>* reply) override;
+        void setFile(const std::string& path, const std::string& content, const std::string& etag);
+        unsigned long requests() { return _requests; }
+    private:
+        struct File {
+            std::string content;
+            std::string etag;
+        };
+        std::map<std::string, File> _files;
+        std::string _request;
+        unsigned long _requests = 0;
+    };
+
+    void addServer(const std::string& host, uint16_t port, Server* server);
+    void removeServers();
+    void setNetworkTimes(const NetworkTimes& times);
+    // what the clients of the device wrote since boot
+    uint32_t bytesSent();
+    // called on boot: WiFi is disconnected, and there are no connections
+    void resetNetwork();
+}
+#endif
@@ -0,0 +1,31 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// An IPv4 address, which converts to and from the uint32_t that the ESP8266 core keeps it in (first octet lowest)
+
+#ifndef HEADER_FAKE_IPADDRESS
+#define HEADER_FAKE_IPADDRESS
+
+#include <stdint.h>
+
+class IPAddress {
+public:
+    IPAddress() : _address(0) {}
+    IPAddress(uint32_t address) : _address(address) {}
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth) :
+      _address(first | second << 8 | third << 16 | static_cast<uint32_t>(fourth) << 24) {}
+    operator uint32_t() const { return _address; }
+    uint8_t operator[](int index) const { return (_address >> (8 * index)) & 0xFF; }
+
+private:
+    uint32_t _address;
+};
+#endif
@@ -0,0 +1,237 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+
+#include <string.h>
+#include <ESP.h>
+#include "PubSubClient.h"
+
+const uint8_t PROTOCOL_LEVEL = 4;
+const uint16_t KEEPALIVE_SECONDS = 15;
+const size_t MAX_HEADER_SIZE = 5;
+
+void PubSubClient::appendString(std::vector<uint8_t>* packet, const char* text) {
+  size_t length = strlen(text);
+  packet->push_back(length >> 8);
+  packet->push_back(length & 0xFF);
+  packet->insert(packet->end(), text, text + length);
+}
+
+bool PubSubClient::connect(const char* id, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage) {
+  return connect(id, nullptr, nullptr, willTopic, willQos, willRetain, willMessage);
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, 
+  bool willRetain, const char* willMessage) {
+  if (connected()) {
+    return true;
+  }
+  if (_client == nullptr || !_client->connect(_domain, _port)) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  std::vector<uint8_t> body;
+  appendString(&body, "MQTT");
+  body.push_back(PROTOCOL_LEVEL);
+  // clean session, plus the will and the credentials if we have them
+  uint8_t flags = 0x02;
+  if (willTopic != nullptr) {
+    flags |= 0x04 | (willQos << 3) | (willRetain ? 0x20 : 0);
+  }
+  if (user != nullptr) {
+    flags |= 0x80 | (pass != nullptr ? 0x40 : 0);
+  }
+  body.push_back(flags);
+  body.push_back(KEEPALIVE_SECONDS >> 8);
+  body.push_back(KEEPALIVE_SECONDS & 0xFF);
+  appendString(&body, id);
+  if (willTopic != nullptr) {
+    appendString(&body, willTopic);
+    appendString(&body, willMessage);
+  }
+  if (user != nullptr) {
+    appendString(&body, user);
+    if (pass != nullptr) {
+      appendString(&body, pass);
+    }
+  }
+  if (!writePacket(MQTTCONNECT, body)) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  uint8_t header;
+  std::vector<uint8_t> reply;
+  if (!readPacket(&header, &reply)) {
+    _client->stop();
+    _state = MQTT_CONNECTION_TIMEOUT;
+    return false;
+  }
+  if (header != MQTTCONNACK || reply.size() < 2 || reply[1] != 0) {
+    _client->stop();
+    _state = reply.size() < 2 ? MQTT_CONNECT_FAILED : reply[1];
+    return false;
+  }
+  _state = MQTT_CONNECTED;
+  return true;
+}
+
+bool PubSubClient::connected() {
+  if (_client == nullptr || !_client->connected()) {
+    if (_state == MQTT_CONNECTED) {
+      _state = MQTT_DISCONNECTED;
+    }
+    return false;
+  }
+  return _state == MQTT_CONNECTED;
+}
+
+void PubSubClient::disconnect() {
+  if (connected()) {
+    writePacket(MQTTDISCONNECT, std::vector<uint8_t>());
+  }
+  if (_client != nullptr) {
+    _client->stop();
+  }
+  _state = MQTT_DISCONNECTED;
+}
+
+// Handles what came in. A PUBLISH goes to the callback, the rest (like SUBACK) is dropped.
+bool PubSubClient::loop() {
+  if (!connected()) {
+    return false;
+  }
+  while (_client->available() > 0) {
+    uint8_t header;
+    std::vector<uint8_t> body;
+    if (!readPacket(&header, &body)) {
+      return false;
+    }
+    if ((header & 0xF0) != MQTTPUBLISH || body.size() < 2 || _callback == nullptr) {
+      continue;
+    }
+    size_t topicLength = body[0] << 8 | body[1];
+    size_t payloadStart = 2 + topicLength + ((header & 0x06) != 0 ? 2 : 0);
+    if (payloadStart > body.size()) {
+      continue;
+    }
+    std::vector<char> topic(body.begin() + 2, body.begin() + 2 + topicLength);
+    topic.push_back(0);
+    _callback(topic.data(), body.data() + payloadStart, body.size() - payloadStart);
+  }
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload, bool retained) {
+  if (!connected()) {
+    return false;
+  }
+  size_t payloadLength = strlen(payload);
+  // the library builds the packet in its buffer, so it can't send more than that
+  if (MAX_HEADER_SIZE + 2 + strlen(topic) + payloadLength > _bufferSize) {
+    return false;
+  }
+  std::vector<uint8_t> body;
+  appendString(&body, topic);
+  body.insert(body.end(), payload, payload + payloadLength);
+  return writePacket(MQTTPUBLISH | (retained ? 1 : 0), body);
+}
+
+// Waits for a packet up to the socket timeout, since the broker answers over the network
+bool PubSubClient::readPacket(uint8_t* header, std::vector<uint8_t>* body) {
+  unsigned long startMillis = millis();
+  auto nextByte = [&](uint8_t* value) {
+    while (_client->available() <= 0) {
+      if (!_client->connected() || millis() - startMillis >= _socketTimeoutMillis) {
+        return false;
+      }
+      delay(1);
+    }
+    *value = _client->read();
+    return true;
+  };
+  if (!nextByte(header)) {
+    return false;
+  }
+  size_t length = 0;
+  uint8_t digit;
+  int shift = 0;
+  do {
+    if (shift > 21 || !nextByte(&digit)) {
+      return false;
+    }
+    length |= static_cast<size_t>(digit & 0x7F) << shift;
+    shift += 7;
+  } while (digit & 0x80);
+  body->resize(length);
+  for (size_t i = 0; i < length; i++) {
+    if (!nextByte(&(*body)[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size) {
+  _bufferSize = size;
+  return true;
+}
+
+PubSubClient& PubSubClient::setCallback(Callback callback) {
+  _callback = callback;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setClient(Client& client) {
+  _client = &client;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setServer(const char* domain, uint16_t port) {
+  _domain = domain;
+  _port = port;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeoutSeconds) {
+  _socketTimeoutMillis = timeoutSeconds * 1000UL;
+  return *this;
+}
+
+int PubSubClient::state() {
+  return _state;
+}
+
+bool PubSubClient::subscribe(const char* topic) {
+  if (!connected()) {
+    return false;
+  }
+  std::vector<uint8_t> body;
+  body.push_back(_nextMessageId >> 8);
+  body.push_back(_nextMessageId & 0xFF);
+  _nextMessageId = _nextMessageId == UINT16_MAX ? 1 : _nextMessageId + 1;
+  appendString(&body, topic);
+  body.push_back(0);
+  return writePacket(MQTTSUBSCRIBE | MQTTQOS1, body);
+}
+
+// The fixed header with the remaining length, then the body, in one write
+bool PubSubClient::writePacket(uint8_t header, const std::vector<uint8_t>& body) {
+  std::vector<uint8_t> packet;
+  packet.push_back(header);
+  size_t value = body.size();
+  do {
+    uint8_t digit = value % 128;
+    value /= 128;
+    packet.push_back(value > 0 ? digit | 0x80 : digit);
+  } while (value > 0);
+  packet.insert(packet.end(), body.begin(), body.end());
+  return _client->write(packet.data(), packet.size()) == packet.size();
+}
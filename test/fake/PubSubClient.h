@@ -0,0 +1,71 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+
+// A fake of PubSubClient (MQTT 3.1.1) with the methods MqttDriver uses. It sends the same packets as the library:
+// CONNECT with a will, PUBLISH and SUBSCRIBE with QoS 0, and DISCONNECT, each in one write to the Client.
+// connect waits for the CONNACK like the library does, and loop hands incoming PUBLISH packets to the callback.
+// Keepalive pings are left out, since the sketch never stays connected for long.
+
+#ifndef HEADER_FAKE_PUBSUBCLIENT
+#define HEADER_FAKE_PUBSUBCLIENT
+
+#include <functional>
+#include <vector>
+#include "Client.h"
+
+#define MQTTCONNECT (1 << 4)
+#define MQTTCONNACK (2 << 4)
+#define MQTTPUBLISH (3 << 4)
+#define MQTTSUBSCRIBE (8 << 4)
+#define MQTTSUBACK (9 << 4)
+#define MQTTDISCONNECT (14 << 4)
+#define MQTTQOS1 (1 << 1)
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+class PubSubClient {
+public:
+    typedef std::function<void(char*, uint8_t*, unsigned int)> Callback;
+
+    bool connect(const char* id, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage);
+    bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, 
+      bool willRetain, const char* willMessage);
+    bool connected();
+    void disconnect();
+    bool loop();
+    bool publish(const char* topic, const char* payload, bool retained);
+    bool setBufferSize(uint16_t size);
+    PubSubClient& setCallback(Callback callback);
+    PubSubClient& setClient(Client& client);
+    PubSubClient& setServer(const char* domain, uint16_t port);
+    PubSubClient& setSocketTimeout(uint16_t timeoutSeconds);
+    int state();
+    bool subscribe(const char* topic);
+
+private:
+    Client* _client = nullptr;
+    Callback _callback = nullptr;
+    const char* _domain = nullptr;
+    uint16_t _port = 1883;
+    uint16_t _bufferSize = 256;
+    unsigned long _socketTimeoutMillis = 15000;
+    uint16_t _nextMessageId = 1;
+    int _state = MQTT_DISCONNECTED;
+
+    static void appendString(std::vector<uint8_t>* packet, const char* text);
+    bool readPacket(uint8_t* header, std::vector<uint8_t>* body);
+    bool writePacket(uint8_t header, const std::vector<uint8_t>& body);
+};
+#endif
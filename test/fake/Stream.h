@@ -0,0 +1,35 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// The part of the Arduino Stream (with Print) that HTTPClient writes a download to
+
+#ifndef HEADER_FAKE_STREAM
+#define HEADER_FAKE_STREAM
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Stream {
+public:
+    virtual ~Stream() {}
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      size_t written = 0;
+      while (written < size && write(buffer[written]) == 1) {
+        written++;
+      }
+      return written;
+    }
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+#endif
@@ -0,0 +1,42 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the updater of the ESP8266 core, which writes a new image to the OTA part of the flash. It keeps it in
+// memory, and end succeeds if the image has the size that begin announced.
+
+#ifndef HEADER_FAKE_UPDATER
+#define HEADER_FAKE_UPDATER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "WString.h"
+
+class UpdaterClass {
+public:
+    bool begin(size_t size);
+    bool end(bool evenIfRemaining = false);
+    String getErrorString();
+    bool isRunning() { return _running; }
+    size_t write(uint8_t* data, size_t size);
+    // for the tests: the image of the last successful update
+    const std::vector<uint8_t>& image() { return _image; }
+
+private:
+    bool _running = false;
+    size_t _size = 0;
+    std::vector<uint8_t> _written;
+    std::vector<uint8_t> _image;
+    const char* _error = "";
+};
+
+extern UpdaterClass Update;
+#endif
@@ -0,0 +1,32 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// The part of the Arduino String that the drivers use
+
+#ifndef HEADER_FAKE_WSTRING
+#define HEADER_FAKE_WSTRING
+
+#include <stdlib.h>
+#include <string>
+
+class String {
+public:
+    String(const char* text = "") : _text(text) {}
+    String(const std::string& text) : _text(text) {}
+    const char* c_str() const { return _text.c_str(); }
+    unsigned int length() const { return _text.length(); }
+    long toInt() const { return atol(_text.c_str()); }
+    bool operator==(const String& other) const { return _text == other._text; }
+
+private:
+    std::string _text;
+};
+#endif
@@ -0,0 +1,54 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the TCP client of the ESP8266 core. It connects to the servers of the fake network (see FakeNetwork.h)
+// by host name, once WiFi is connected. What it writes goes to the server right away, and counts as bytes sent;
+// the server's answer can be read a round trip later. Connecting takes a round trip too.
+
+#ifndef HEADER_FAKE_WIFICLIENT
+#define HEADER_FAKE_WIFICLIENT
+
+#include <deque>
+#include <vector>
+#include "Client.h"
+#include "WString.h"
+
+namespace Fake {
+    class Server;
+}
+
+class WiFiClient : public Client {
+public:
+    int connect(const char* host, uint16_t port) override;
+    virtual int connect(const String& host, uint16_t port) { return connect(host.c_str(), port); }
+    size_t write(const uint8_t* buffer, size_t size) override;
+    size_t write(uint8_t value) { return write(&value, 1); }
+    int available() override;
+    int read() override;
+    void stop() override;
+    uint8_t connected() override;
+
+protected:
+    // the server of the connection, for the TLS handshake
+    Fake::Server* server() { return _server; }
+
+private:
+    // an answer of the server, and when it arrives
+    struct Reply {
+        uint64_t dueMicros;
+        std::vector<uint8_t> data;
+    };
+    Fake::Server* _server = nullptr;
+    bool _open = false;
+    std::deque<Reply> _replies;
+    size_t _replyOffset = 0;
+};
+#endif
@@ -0,0 +1,80 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the BearSSL TLS client of the ESP8266 core. There is no encryption: the application data goes to the
+// server as is, so the bytes sent are those of the application, like the wake-cost property on the device.
+// What TLS costs is time (see Fake::NetworkTimes): a handshake on connect, which is short if the client has a session
+// that the server issued before, and every write is a TLS record. Like BearSSL, a full handshake stores a new session
+// in the Session the client has, and a resumed one leaves it as it was.
+// The certificates and the key only get counted and typed: a PEM text or a DER array with data parses.
+
+#ifndef HEADER_FAKE_WIFICLIENTSECURE
+#define HEADER_FAKE_WIFICLIENTSECURE
+
+#include <string.h>
+#include "WiFiClient.h"
+
+#define BR_KEYTYPE_RSA 1
+#define BR_KEYTYPE_EC 2
+#define BR_KEYTYPE_KEYX 0x10
+#define BR_KEYTYPE_SIGN 0x20
+
+namespace BearSSL {
+    class X509List {
+    public:
+        explicit X509List(const char* pem);
+        X509List(const uint8_t* der, size_t size);
+        size_t getCount() const { return _count; }
+    private:
+        size_t _count;
+    };
+
+    class PrivateKey {
+    public:
+        explicit PrivateKey(const char* pem);
+        PrivateKey(const uint8_t* der, size_t size);
+        bool isRSA() const { return _type == BR_KEYTYPE_RSA; }
+        bool isEC() const { return _type == BR_KEYTYPE_EC; }
+    private:
+        int _type;
+    };
+
+    // the parameters of br_ssl_session_parameters, so it has the size of the real one
+    class Session {
+    public:
+        Session() { memset(static_cast<void*>(this), 0, sizeof(*this)); }
+    private:
+        friend class WiFiClientSecure;
+        uint8_t _sessionId[32];
+        uint8_t _sessionIdLength;
+        uint16_t _version;
+        uint16_t _cipherSuite;
+        uint8_t _masterSecret[48];
+    };
+
+    class WiFiClientSecure : public WiFiClient {
+    public:
+        int connect(const char* host, uint16_t port) override;
+        int connect(const String& host, uint16_t port) override { return connect(host.c_str(), port); }
+        using WiFiClient::write;
+        size_t write(const uint8_t* buffer, size_t size) override;
+        void setClientECCert(const X509List* chain, const PrivateKey* key, unsigned allowedUsages, unsigned certIssuerKeyType);
+        void setClientRSACert(const X509List* chain, const PrivateKey* key);
+        void setSession(Session* session) { _session = session; }
+        void setTrustAnchors(const X509List* trustAnchors) { _trustAnchors = trustAnchors; }
+    private:
+        const X509List* _trustAnchors = nullptr;
+        const X509List* _clientChain = nullptr;
+        const PrivateKey* _clientKey = nullptr;
+        Session* _session = nullptr;
+    };
+}
+#endif
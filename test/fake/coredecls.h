@@ -0,0 +1,21 @@
+// Copyright 2024 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//    Unless required by applicable law or agreed to in writing, software distributed under the License
+//    is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and limitations under the License.
+
+// A fake of the ESP8266 core's SNTP callback hook
+
+#ifndef HEADER_FAKE_COREDECLS
+#define HEADER_FAKE_COREDECLS
+
+#include <functional>
+
+// fromSntp is true if the time came from NTP, false if it was set with settimeofday
+void settimeofday_cb(std::function<void(bool fromSntp)> callback);
+#endif